@@ -0,0 +1,98 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define DEFAULT_SECTOR_SIZE 512
+#define MAX_SECTOR_SIZE 4096
+#define DEFAULT_CACHE_SECTORS 1024
+#define DEFAULT_DIRTY_LIMIT (1024 * 1024)
+#define BDEV_COPY_CHUNK (1024 * 1024)
+
+/* Image storage backends */
+#define BACKEND_PREAD 0
+#define BACKEND_MMAP 1
+
+/* Batch I/O engines */
+#define IO_ENGINE_SYNC 0
+#define IO_ENGINE_URING 1
+#define IO_URING_ENTRIES 64
+
+/* Block device over an image file (pread/pwrite or a shared mapping) */
+typedef struct {
+    int fd;
+    int backend;
+    int io_engine;
+    void *ring;             /* io_uring state when io_engine is URING */
+    pthread_mutex_t ring_lock;
+    uint8_t *map;
+    uint64_t size;
+    uint32_t sector_size;
+} BlockDevice;
+
+/* One transfer in an I/O batch */
+typedef struct {
+    uint64_t offset;        /* Byte offset in the image */
+    uint8_t *buffer;
+    uint32_t length;
+} IoRequest;
+
+/* One cached sector */
+typedef struct CacheBuffer {
+    uint64_t sector;
+    uint8_t *data;
+    int dirty;
+    struct CacheBuffer *lru_prev;
+    struct CacheBuffer *lru_next;
+    struct CacheBuffer *hash_next;
+} CacheBuffer;
+
+/* Bounded LRU cache of sector buffers, shared by all threads under one
+ * lock; file data bypasses it (see bdev_submit) */
+typedef struct {
+    BlockDevice *dev;
+    pthread_mutex_t lock;
+    uint32_t capacity;
+    uint32_t used;
+    CacheBuffer *buffers;
+    uint8_t *data;
+    CacheBuffer **hash;
+    uint32_t hash_mask;
+    CacheBuffer lru;        /* Sentinel: lru.lru_next is most recently used */
+    int write_back;
+    uint32_t dirty_count;
+    uint32_t dirty_limit;   /* Flush once this many sectors are dirty */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+} BufferCache;
+
+/* Block device functions */
+int bdev_open(BlockDevice *dev, const char *path, int backend);
+void bdev_close(BlockDevice *dev);
+int bdev_read(BlockDevice *dev, uint64_t sector, uint32_t count, void *buffer);
+int bdev_write(BlockDevice *dev, uint64_t sector, uint32_t count,
+               const void *buffer);
+int bdev_sync(BlockDevice *dev);
+int bdev_set_io_engine(BlockDevice *dev, int io_engine);
+int bdev_submit(BlockDevice *dev, IoRequest *requests, int count, int write);
+int bdev_copy_out(BlockDevice *dev, uint64_t offset, size_t len, int out_fd);
+
+/* Buffer cache functions */
+int cache_init(BufferCache *cache, BlockDevice *dev, uint32_t capacity);
+void cache_destroy(BufferCache *cache);
+int cache_read(BufferCache *cache, uint64_t sector, uint32_t count,
+               void *buffer);
+int cache_write(BufferCache *cache, uint64_t sector, uint32_t count,
+                const void *buffer);
+void cache_patch(BufferCache *cache, uint64_t offset, const void *buffer,
+                 size_t len);
+int cache_overlay(BufferCache *cache, uint64_t offset, void *buffer,
+                  size_t len, uint64_t writebacks);
+uint64_t cache_writebacks(BufferCache *cache);
+void cache_set_write_back(BufferCache *cache, int enable, size_t dirty_bytes);
+int cache_flush(BufferCache *cache);
+
+#endif
@@ -5,7 +5,9 @@
 
 /* Command functions */
 void cmd_info(FileSystem *fs);
-void cmd_ls(FileSystem *fs);
+void cmd_stats(FileSystem *fs);
+void cmd_sync(FileSystem *fs);
+void cmd_ls(FileSystem *fs, const char *path);
 void cmd_cd(FileSystem *fs, const char *dirname);
 void cmd_mkdir(FileSystem *fs, const char *dirname);
 void cmd_creat(FileSystem *fs, const char *filename);
@@ -13,16 +15,20 @@ void cmd_open(FileSystem *fs, const char *filename, const char *mode);
 void cmd_close(FileSystem *fs, const char *filename);
 void cmd_lsof(FileSystem *fs);
 void cmd_lseek(FileSystem *fs, const char *filename, uint32_t offset);
-void cmd_read(FileSystem *fs, const char *filename, uint32_t size);
+void cmd_read(FileSystem *fs, const char *filename, uint32_t size, int raw);
 void cmd_write(FileSystem *fs, const char *filename, const char *string);
 void cmd_mv(FileSystem *fs, const char *source, const char *dest);
 void cmd_rm(FileSystem *fs, const char *filename);
 void cmd_rmdir(FileSystem *fs, const char *dirname);
-
-/* Helper functions */
-OpenFile *find_open_file(FileSystem *fs, const char *filename);
-int add_open_file(FileSystem *fs, const char *filename, const char *mode,
-                  const char *path, uint32_t first_cluster, uint32_t size);
-void remove_open_file(FileSystem *fs, const char *filename);
+void cmd_compact(FileSystem *fs, const char *dirname);
+void cmd_defrag(FileSystem *fs, const char *option);
+void cmd_put(FileSystem *fs, const char *host_path, const char *filename);
+void cmd_get(FileSystem *fs, const char *filename, const char *host_path);
+void cmd_truncate(FileSystem *fs, const char *filename, uint32_t size);
+void cmd_fallocate(FileSystem *fs, const char *filename, uint32_t size);
+void cmd_fsck(FileSystem *fs, int repair, int threads);
+void cmd_du(FileSystem *fs, const char *dirname);
+void cmd_tree(FileSystem *fs, const char *dirname);
+void cmd_find(FileSystem *fs, const char *pattern, const char *dirname);
 
 #endif
@@ -0,0 +1,46 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <stdint.h>
+#include "fat32.h"
+
+#define DEFRAG_BATCH_BYTES (1024 * 1024)
+#define DEFRAG_PASSES 3
+#define DEFRAG_CANDIDATES 16
+
+/* One cluster chain reachable from the root directory */
+typedef struct {
+    char *path;
+    DirEntry entry;         /* Entry naming the chain (unused for the root) */
+    int32_t parent;         /* Chain of the containing directory, -1 for the root */
+    uint32_t slot;          /* Slot of the entry in the parent */
+    uint32_t first;         /* First cluster */
+    uint32_t clusters;
+    uint32_t extents;       /* Runs of physically contiguous clusters */
+    int is_dir;
+    int fixed;              /* Cross-linked or cyclic: never moved */
+} DefragChain;
+
+/* Every chain of the volume, parents before their children */
+typedef struct {
+    DefragChain *chains;
+    uint32_t count;
+    uint32_t capacity;
+} DefragPlan;
+
+/* Fragmentation summary of a plan */
+typedef struct {
+    uint32_t chains;
+    uint32_t fragmented;    /* Chains of more than one extent */
+    uint32_t extents;       /* Ideally equal to chains */
+    uint32_t clusters;
+    uint32_t fixed;
+} DefragStats;
+
+/* Defragmentation functions */
+int defrag_scan(FileSystem *fs, DefragPlan *plan);
+void defrag_stats(const DefragPlan *plan, DefragStats *stats);
+int defrag_run(FileSystem *fs, DefragPlan *plan, uint32_t *moved);
+void defrag_free(DefragPlan *plan);
+
+#endif
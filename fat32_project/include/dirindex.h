@@ -0,0 +1,72 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <stdint.h>
+#include "fat32.h"
+
+#define DIR_CACHE_MAX_DIRS 64
+#define DIR_CACHE_BUCKETS 128
+
+/* One live short-name entry of an indexed directory */
+typedef struct {
+    DirEntry entry;
+    uint32_t slot;          /* Physical entry index in the directory chain */
+    uint32_t first_slot;    /* First long-name slot, slot itself if none */
+    char *long_name;        /* UTF-8 long name, NULL if the entry has none */
+    int32_t next;           /* Next record in the same name bucket, -1 ends */
+    int32_t long_next;      /* Next record in the same long-name bucket */
+} DirIndexRecord;
+
+/* Name index of one directory, keyed by its first cluster. Short names
+ * and (case-folded) long names hash into separate bucket arrays of the
+ * same size. */
+typedef struct DirIndex {
+    uint32_t cluster;
+    DirIndexRecord *records;
+    uint32_t count;
+    uint32_t capacity;
+    int32_t *buckets;
+    int32_t *long_buckets;
+    uint32_t bucket_mask;
+    int32_t *slots;         /* Slot -> record, -1 when the slot is not live */
+    uint64_t *free_slots;   /* Bit set for deleted slots below end_slot */
+    uint32_t free_count;    /* Bits set in free_slots */
+    uint32_t num_slots;
+    uint32_t first_free;    /* No deleted slot lies below this one */
+    uint32_t end_slot;      /* Slot of the end-of-directory marker */
+    uint32_t *chain;        /* Clusters of the directory, in order */
+    uint32_t num_clusters;
+    uint32_t chain_capacity;
+    LfnAssembler pending;   /* Long-name slots written ahead of a short entry */
+    uint32_t users;         /* Callers between dir_index_get and _put */
+    int dropped;            /* Out of the cache; the last user frees it */
+    struct DirIndex *hash_next;
+    struct DirIndex *lru_prev;
+    struct DirIndex *lru_next;
+} DirIndex;
+
+/* Bounded LRU set of directory indexes. The lock guards the set and the
+ * users counts; the contents of an index follow its directory lock. */
+struct DirCache {
+    pthread_mutex_t lock;
+    DirIndex *table[DIR_CACHE_BUCKETS];
+    DirIndex lru;           /* Sentinel: lru.lru_next is most recently used */
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* Directory index functions */
+int dir_cache_init(FileSystem *fs);
+void dir_cache_destroy(FileSystem *fs);
+DirIndex *dir_index_get(FileSystem *fs, uint32_t cluster);
+DirIndex *dir_index_peek(FileSystem *fs, uint32_t cluster);
+void dir_index_put(FileSystem *fs, DirIndex *index);
+DirIndexRecord *dir_index_lookup(DirIndex *index, const char *formatted_name);
+DirIndexRecord *dir_index_find(DirIndex *index, const char *name);
+void dir_index_update(FileSystem *fs, uint32_t cluster, const DirEntry *entry,
+                      int entry_index);
+void dir_index_drop(FileSystem *fs, uint32_t cluster);
+int dir_index_free_run(FileSystem *fs, DirIndex *index, uint32_t count);
+
+#endif
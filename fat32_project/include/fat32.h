@@ -3,9 +3,16 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include "blockdev.h"
+#include "lock.h"
 
 #define MAX_OPEN_FILES 10
+#define RA_MIN_CLUSTERS 4
+#define RA_MAX_CLUSTERS 64
 #define MAX_PATH_LENGTH 256
+#define MAX_NAME_LENGTH 768     /* UTF-8 bytes of a 255-character long name */
+#define TRANSFER_BUFFER_SIZE (4 * 1024 * 1024) /* Host file copy batch */
 #define DIR_ENTRY_SIZE 32
 #define ATTR_READ_ONLY 0x01
 #define ATTR_HIDDEN 0x02
@@ -46,6 +53,22 @@ typedef struct __attribute__((packed)) {
     uint8_t  BS_FilSysType[8];
 } BootSector;
 
+/* FAT32 FSInfo Sector Structure */
+typedef struct __attribute__((packed)) {
+    uint32_t FSI_LeadSig;
+    uint8_t  FSI_Reserved1[480];
+    uint32_t FSI_StrucSig;
+    uint32_t FSI_Free_Count;
+    uint32_t FSI_Nxt_Free;
+    uint8_t  FSI_Reserved2[12];
+    uint32_t FSI_TrailSig;
+} FSInfo;
+
+#define FSI_LEAD_SIG 0x41615252
+#define FSI_STRUC_SIG 0x61417272
+#define FSI_TRAIL_SIG 0xAA550000
+#define FSI_UNKNOWN 0xFFFFFFFF
+
 /* FAT32 Directory Entry Structure */
 typedef struct __attribute__((packed)) {
     uint8_t  DIR_Name[11];
@@ -62,51 +85,228 @@ typedef struct __attribute__((packed)) {
     uint32_t DIR_FileSize;
 } DirEntry;
 
-/* Open File Structure */
+/* VFAT Long Name Directory Entry Structure (UTF-16LE name pieces) */
+typedef struct __attribute__((packed)) {
+    uint8_t  LDIR_Ord;
+    uint8_t  LDIR_Name1[10];
+    uint8_t  LDIR_Attr;
+    uint8_t  LDIR_Type;
+    uint8_t  LDIR_Chksum;
+    uint8_t  LDIR_Name2[12];
+    uint16_t LDIR_FstClusLO;
+    uint8_t  LDIR_Name3[4];
+} LfnEntry;
+
+#define LFN_MAX_CHARS 255
+#define LFN_CHARS_PER_ENTRY 13
+#define LFN_MAX_ENTRIES 20
+#define LFN_LAST_ENTRY 0x40
+#define LFN_ORDINAL_MASK 0x1F
+
+/* Long-name sequence collected from the slots before a short entry */
+typedef struct {
+    uint16_t chars[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    uint32_t first_slot;    /* Slot of the sequence's first (last-ordinal) entry */
+    uint32_t next_slot;     /* Slot the sequence must continue at */
+    uint8_t checksum;
+    uint8_t count;          /* Entries in the sequence, 0 when none is open */
+    uint8_t expected;       /* Ordinal of the next entry, 0 once complete */
+} LfnAssembler;
+
+/* Run of physically contiguous clusters within a file */
 typedef struct {
-    char filename[12];
+    uint32_t file_index;    /* Position of the run's first cluster in the file */
+    uint32_t start;         /* First cluster of the run on disk */
+    uint32_t length;
+} ClusterExtent;
+
+/* Open File Structure. The file_* functions hold lock while they use
+ * the extent map and readahead state. */
+typedef struct {
+    char filename[MAX_PATH_LENGTH];
+    uint8_t short_name[11]; /* Short name of the entry, unique in its directory */
     char mode[4];
     uint32_t offset;
     char path[MAX_PATH_LENGTH];
+    uint32_t dir_cluster;   /* First cluster of the containing directory */
     uint32_t first_cluster;
     uint32_t size;
     int is_open;
+    /* Extent map of the cluster chain, built on first use */
+    ClusterExtent *extents;
+    uint32_t num_extents;
+    uint32_t extent_capacity;
+    uint32_t num_clusters;
+    uint32_t tail_cluster;
+    int extents_valid;
+    /* Sequential readahead */
+    uint8_t *ra_buffer;
+    uint32_t ra_capacity;
+    uint32_t ra_start;      /* File offset of the buffered bytes */
+    uint32_t ra_length;
+    uint32_t ra_window;     /* Clusters to prefetch on the next miss */
+    uint32_t ra_next;       /* Offset a sequential read would start at */
+    pthread_mutex_t lock;
 } OpenFile;
 
-/* File System State */
+/* In-memory FAT table with per-sector dirty tracking and free bitmap.
+ * Changes are made under lock, which its holder may take again; entries
+ * are read without it. */
+typedef struct {
+    uint32_t *entries;
+    uint32_t num_entries;
+    uint32_t num_sectors;
+    uint8_t *dirty;
+    uint32_t dirty_count;
+    uint64_t *free_map;     /* One bit per cluster, set when free */
+    uint32_t free_words;
+    uint32_t free_count;
+    uint32_t next_free;     /* Rotating allocation cursor */
+    int fsinfo_dirty;
+    int mapped;             /* entries points into the mmap'd image */
+    pthread_mutex_t lock;
+} FatTable;
+
+/* Streaming cursor over the live entries of a directory chain. Entries
+ * are read into the embedded buffer one cluster (at most
+ * DIR_ITER_BUFFER_SIZE bytes) per I/O; no heap memory is used. Long-name
+ * slots are assembled on the way for dir_iter_next_named. The caller
+ * holds the directory's lock (dir_lock_read) if other threads may change
+ * it. */
+#define DIR_ITER_BUFFER_SIZE 32768
+typedef struct {
+    struct FileSystem *fs;
+    uint32_t cluster;       /* Cluster the buffer was read from */
+    uint32_t chunk_offset;  /* Byte offset of the buffer within the cluster */
+    uint32_t count;         /* Entries in the buffer */
+    uint32_t position;      /* Next entry in the buffer */
+    uint32_t slot;          /* Physical index of the next entry */
+    uint32_t visited;
+    int done;
+    uint32_t name_slot;     /* First slot of the last entry's long name */
+    LfnAssembler lfn;
+    DirEntry buffer[DIR_ITER_BUFFER_SIZE / DIR_ENTRY_SIZE];
+} DirIterator;
+
+/* Mount Options */
 typedef struct {
-    FILE *image;
+    int backend;
+    uint32_t cache_sectors;
+    int io_engine;
+    int write_back;
+    uint32_t compact_threshold;
+} MountOptions;
+
+/* Cache of per-directory name indexes (see dirindex.h) */
+typedef struct DirCache DirCache;
+
+/* Cache of path component lookups (see path.h) */
+typedef struct DentryCache DentryCache;
+
+/* File System State. mount_image sets up the shared state and the first
+ * session; session_open attaches further sessions (one per server
+ * client), which share everything but the current directory, the open
+ * files and the output stream. */
+typedef struct FileSystem {
+    BlockDevice *dev;
+    BufferCache *cache;
+    FatTable *fat;
+    DirCache *dirs;
+    DentryCache *dentries;
     BootSector boot_sector;
     uint32_t current_cluster;
     char current_path[MAX_PATH_LENGTH];
     char image_name[256];
     OpenFile open_files[MAX_OPEN_FILES];
+    FILE *out;                  /* Where commands print */
     uint32_t data_start_sector;
     uint32_t fat_start_sector;
     uint32_t root_cluster;
     uint32_t total_clusters;
+    uint32_t compact_threshold; /* Deleted-slot percentage that compacts a
+                                   directory after a delete, 0 = never */
+    DirLockTable *dir_locks;    /* Directory locks, by first cluster */
+    pthread_mutex_t open_lock;  /* Guards open_files slot allocation */
+    struct FileSystem *volume;  /* Mounted session the state belongs to */
+    struct FileSystem *next_session;
+    pthread_mutex_t session_lock; /* Guards the session list (volume only) */
 } FileSystem;
 
 /* Function declarations */
-int mount_image(FileSystem *fs, const char *image_path);
+int mount_image(FileSystem *fs, const char *image_path,
+                const MountOptions *options);
 void close_image(FileSystem *fs);
+void session_open(FileSystem *volume, FileSystem *session);
+void session_close(FileSystem *session);
+int image_read(FileSystem *fs, uint64_t offset, void *buffer, size_t len);
+int image_write(FileSystem *fs, uint64_t offset, const void *buffer,
+                size_t len);
+int image_sync(FileSystem *fs);
+int image_submit(FileSystem *fs, IoRequest *requests, int count, int write);
+int fs_flush(FileSystem *fs);
+int fs_sync(FileSystem *fs);
+int fs_commit(FileSystem *fs);
+uint8_t *image_map(FileSystem *fs, uint64_t offset, size_t len);
+uint64_t sector_offset(FileSystem *fs, uint32_t sector);
 uint32_t get_fat_entry(FileSystem *fs, uint32_t cluster);
 void set_fat_entry(FileSystem *fs, uint32_t cluster, uint32_t value);
+int load_fat(FileSystem *fs);
+int sync_fat(FileSystem *fs);
+int build_free_map(FileSystem *fs);
+int sync_fsinfo(FileSystem *fs);
+uint32_t find_free_cluster(FileSystem *fs, uint32_t start);
 uint32_t get_first_sector_of_cluster(FileSystem *fs, uint32_t cluster);
 DirEntry *read_directory(FileSystem *fs, uint32_t cluster, int *num_entries);
 DirEntry *find_entry(FileSystem *fs, uint32_t cluster, const char *name);
+int find_entry_name(FileSystem *fs, uint32_t cluster, const char *name,
+                    char *shown);
+void dir_iter_open(FileSystem *fs, DirIterator *it, uint32_t cluster);
+DirEntry *dir_iter_next(DirIterator *it, int *entry_index);
+DirEntry *dir_iter_next_raw(DirIterator *it, int *entry_index);
+DirEntry *dir_iter_next_named(DirIterator *it, int *entry_index, char *name);
+void dir_iter_close(DirIterator *it);
 uint32_t allocate_cluster(FileSystem *fs);
+uint32_t allocate_clusters(FileSystem *fs, uint32_t count, uint32_t hint,
+                           uint32_t data_bytes);
+uint32_t find_free_run(FileSystem *fs, uint32_t start, uint32_t count,
+                       uint32_t *run_length);
 void free_cluster_chain(FileSystem *fs, uint32_t cluster);
 void format_filename(const char *input, char *output);
 void parse_filename(const char *formatted, char *output);
 int is_valid_cluster(FileSystem *fs, uint32_t cluster);
 void write_directory_entry(FileSystem *fs, uint32_t cluster, DirEntry *entry, 
                           int entry_index);
-int find_free_entry_index(FileSystem *fs, uint32_t cluster);
+int find_free_entries(FileSystem *fs, uint32_t cluster, uint32_t count);
 int create_directory_entry(FileSystem *fs, uint32_t parent_cluster, 
                           const char *name, uint8_t attr, uint32_t first_cluster,
                           uint32_t size);
 int delete_directory_entry(FileSystem *fs, uint32_t cluster, const char *name);
+int rename_directory_entry(FileSystem *fs, uint32_t cluster,
+                           const char *old_name, const char *new_name);
 int is_directory_empty(FileSystem *fs, uint32_t cluster);
+int directory_exists(FileSystem *fs, uint32_t cluster);
+void remove_directory(FileSystem *fs, uint32_t cluster);
+void dir_lock_read(FileSystem *fs, uint32_t cluster);
+void dir_lock_write(FileSystem *fs, uint32_t cluster);
+void dir_unlock(FileSystem *fs, uint32_t cluster);
+int compact_directory(FileSystem *fs, uint32_t cluster, uint32_t *freed);
+int build_extent_map(FileSystem *fs, OpenFile *file);
+int extent_map_append(FileSystem *fs, OpenFile *file, uint32_t first_cluster);
+uint32_t file_cluster_at(FileSystem *fs, OpenFile *file, uint32_t index,
+                         uint32_t *contiguous);
+void free_extent_map(OpenFile *file);
+void open_file_init(OpenFile *file);
+void open_file_destroy(OpenFile *file);
+void release_open_file(OpenFile *file);
+ssize_t file_read(FileSystem *fs, OpenFile *file, uint32_t offset,
+                  void *buffer, uint32_t len);
+ssize_t file_write(FileSystem *fs, OpenFile *file, uint32_t offset,
+                   const void *buffer, uint32_t len);
+ssize_t file_read_ahead(FileSystem *fs, OpenFile *file, uint32_t offset,
+                        void *buffer, uint32_t len);
+ssize_t file_export(FileSystem *fs, OpenFile *file, uint32_t offset,
+                    uint32_t len, int out_fd);
+int file_truncate(FileSystem *fs, OpenFile *file, uint32_t size);
+int file_reserve(FileSystem *fs, OpenFile *file, uint32_t size);
 
 #endif
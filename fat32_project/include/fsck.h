@@ -0,0 +1,47 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <stdint.h>
+#include "fat32.h"
+
+#define FSCK_MAX_THREADS 64
+
+/* Kinds of problem */
+#define FSCK_CROSS_LINK 1   /* Chain runs into a cluster already reached */
+#define FSCK_BAD_LINK 2     /* Chain reaches a free, bad or out-of-range cluster */
+#define FSCK_SHORT_CHAIN 3  /* File size needs more clusters than the chain has */
+
+/* One problem with the chain of a directory entry */
+typedef struct {
+    int type;
+    char *path;
+    DirEntry entry;
+    uint32_t dir_cluster;   /* Directory holding the entry, 0 for the root */
+    uint32_t slot;
+    uint32_t cluster;       /* Cluster the chain went wrong at */
+    uint32_t last;          /* Last good cluster of the chain, 0 if none */
+    uint32_t kept;          /* Good clusters before the problem */
+} FsckProblem;
+
+/* Result of a check */
+typedef struct {
+    FsckProblem *problems;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t files;
+    uint32_t directories;
+    uint32_t clusters;      /* Clusters reached from the root */
+    uint32_t lost_clusters; /* Allocated but unreachable */
+    uint32_t lost_chains;
+    uint64_t *lost;         /* Bitmap of the lost clusters */
+    uint32_t recovered;     /* Lost chains saved as files by a repair */
+    uint32_t lost_left;     /* Lost clusters a repair could not save */
+    int threads;
+} FsckReport;
+
+/* Consistency check functions */
+int fsck_check(FileSystem *fs, int threads, FsckReport *report);
+int fsck_repair(FileSystem *fs, FsckReport *report);
+void fsck_free(FsckReport *report);
+
+#endif
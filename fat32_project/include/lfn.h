@@ -0,0 +1,28 @@
+#ifndef LFN_H
+#define LFN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "fat32.h"
+
+/* Long-name entry reading */
+uint8_t lfn_checksum(const uint8_t *short_name);
+void lfn_reset(LfnAssembler *lfn);
+void lfn_feed(LfnAssembler *lfn, const DirEntry *entry, uint32_t slot);
+int lfn_finish(LfnAssembler *lfn, const DirEntry *entry, uint32_t slot,
+               char *name, size_t size, uint32_t *first_slot);
+
+/* Long-name entry writing */
+int lfn_valid_name(const char *name);
+int lfn_needed(const char *name);
+void lfn_short_basis(const char *name, char *basis);
+void lfn_short_alias(const char *basis, const char *name, uint32_t attempt,
+                     char *alias);
+int lfn_build_entries(const char *name, const uint8_t *short_name,
+                      LfnEntry *entries);
+
+/* Case-insensitive long-name comparison */
+uint32_t lfn_hash(const char *name);
+int lfn_name_equal(const char *a, const char *b);
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef LIBFAT32_H
+#define LIBFAT32_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Handle of a mounted image. Paths are relative to the handle's current
+ * directory unless they start with '/'. fat32_session_open gives further
+ * handles on the same mount, each with its own current directory and
+ * descriptors. Handles of one mount, and separate descriptors of one
+ * handle, may be used from different threads at once; a descriptor is
+ * used by one thread at a time. An image must not be mounted twice. */
+typedef struct FileSystem Fat32;
+
+/* Open directory, read with fat32_readdir */
+typedef struct Fat32Dir Fat32Dir;
+
+/* Results: 0 or a count on success, one of these (negative) on failure */
+#define FAT32_OK 0
+#define FAT32_ERR_NOT_FOUND -1      /* No such file or directory */
+#define FAT32_ERR_NO_PARENT -2      /* Parent directory does not exist */
+#define FAT32_ERR_NOT_DIR -3        /* Not a directory */
+#define FAT32_ERR_IS_DIR -4         /* Is a directory */
+#define FAT32_ERR_EXISTS -5         /* Name already exists */
+#define FAT32_ERR_NOT_EMPTY -6      /* Directory is not empty */
+#define FAT32_ERR_INVALID_NAME -7   /* Not a valid FAT long name */
+#define FAT32_ERR_INVALID -8        /* Invalid flags, offset or argument */
+#define FAT32_ERR_OPEN -9           /* The file, or a file in the directory,
+                                       is open */
+#define FAT32_ERR_BUSY -10          /* In use by another handle, or the
+                                       current directory of one */
+#define FAT32_ERR_ALREADY_OPEN -11  /* Already open on this handle */
+#define FAT32_ERR_TOO_MANY_OPEN -12 /* No free descriptor */
+#define FAT32_ERR_BAD_FD -13        /* Not an open descriptor */
+#define FAT32_ERR_ACCESS -14        /* Descriptor not open for this */
+#define FAT32_ERR_NO_SPACE -15      /* No free clusters available */
+#define FAT32_ERR_CORRUPT -16       /* Corrupt cluster chain */
+#define FAT32_ERR_IO -17            /* Image could not be read or written */
+#define FAT32_ERR_NO_MEMORY -18
+#define FAT32_ERR_LOOP -19          /* Directory moved into itself */
+#define FAT32_ERR_TOO_LARGE -20     /* Past the 4 GiB FAT32 file size */
+
+/* fat32_open flags */
+#define FAT32_O_RDONLY 0x01
+#define FAT32_O_WRONLY 0x02
+#define FAT32_O_RDWR (FAT32_O_RDONLY | FAT32_O_WRONLY)
+#define FAT32_O_CREAT 0x04          /* Create the file if it is missing */
+#define FAT32_O_EXCL 0x08           /* With FAT32_O_CREAT: fail if it exists */
+
+#define FAT32_NAME_MAX 768          /* UTF-8 bytes of a long name, with NUL */
+
+/* Mount options; fat32_default_options fills in the defaults */
+typedef struct {
+    int mmap;                   /* Map the image instead of pread/pwrite */
+    int io_uring;               /* Submit extent transfers through io_uring */
+    int write_back;             /* Buffer writes until sync, close or
+                                   1 MiB of dirty data */
+    uint32_t cache_sectors;     /* Buffer cache size, 0 disables it */
+    uint32_t compact_threshold; /* Deleted-slot percentage that compacts a
+                                   directory after a delete, 0 = never */
+} Fat32Options;
+
+/* What fat32_stat reports about an entry */
+typedef struct {
+    uint32_t size;              /* Bytes; 0 for directories */
+    uint32_t cluster;           /* First cluster, 0 for an empty file */
+    uint8_t attr;               /* FAT attribute byte */
+    int is_dir;
+} Fat32Stat;
+
+/* One directory entry from fat32_readdir */
+typedef struct {
+    char name[FAT32_NAME_MAX];  /* Long name if it has one, UTF-8 */
+    Fat32Stat stat;
+} Fat32Dirent;
+
+/* Mounting */
+void fat32_default_options(Fat32Options *options);
+int fat32_mount(const char *image_path, const Fat32Options *options,
+                Fat32 **fs);
+void fat32_unmount(Fat32 *fs);
+int fat32_session_open(Fat32 *fs, Fat32 **session);
+void fat32_session_close(Fat32 *session);
+int fat32_sync(Fat32 *fs);
+const char *fat32_strerror(int error);
+
+/* Files. A file is open at most once per handle, and open on several
+ * handles only while none of them may write to it. */
+int fat32_open(Fat32 *fs, const char *path, int flags);
+int fat32_close(Fat32 *fs, int fd);
+int fat32_find_fd(Fat32 *fs, const char *path);
+ssize_t fat32_pread(Fat32 *fs, int fd, void *buffer, size_t count,
+                    uint32_t offset);
+ssize_t fat32_pwrite(Fat32 *fs, int fd, const void *buffer, size_t count,
+                     uint32_t offset);
+ssize_t fat32_read(Fat32 *fs, int fd, void *buffer, size_t count);
+ssize_t fat32_write(Fat32 *fs, int fd, const void *buffer, size_t count);
+ssize_t fat32_sendfile(Fat32 *fs, int out_fd, int fd, size_t count);
+int fat32_lseek(Fat32 *fs, int fd, uint32_t offset);
+int fat32_fstat(Fat32 *fs, int fd, Fat32Stat *st);
+
+/* Host files: a regular file copied in whole as a new file, or a file
+ * copied out to a host descriptor whether or not it is open */
+int fat32_import(Fat32 *fs, const char *path, int host_fd);
+ssize_t fat32_export(Fat32 *fs, const char *path, int host_fd);
+
+/* Names */
+int fat32_stat(Fat32 *fs, const char *path, Fat32Stat *st);
+int fat32_create(Fat32 *fs, const char *path);
+int fat32_mkdir(Fat32 *fs, const char *path);
+int fat32_unlink(Fat32 *fs, const char *path);
+int fat32_rmdir(Fat32 *fs, const char *path);
+int fat32_rename(Fat32 *fs, const char *from, const char *to);
+int fat32_truncate(Fat32 *fs, const char *path, uint32_t size);
+int fat32_fallocate(Fat32 *fs, const char *path, uint32_t size);
+int fat32_chdir(Fat32 *fs, const char *path);
+int fat32_compact(Fat32 *fs, const char *path, uint32_t *freed);
+
+/* Directories */
+int fat32_opendir(Fat32 *fs, const char *path, Fat32Dir **dir);
+int fat32_readdir(Fat32Dir *dir, Fat32Dirent *entry);
+void fat32_closedir(Fat32Dir *dir);
+
+#endif
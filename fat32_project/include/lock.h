@@ -0,0 +1,51 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define DIR_LOCK_BUCKETS 64
+
+/* Reader-writer lock the writing thread may take again, for reading or
+ * writing, while it holds it. Readers get in whenever no other thread
+ * is writing, so reads nest too; a reader must not ask to write, which
+ * unless NDEBUG is defined fails an assertion instead of hanging. */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    uint32_t readers;
+    uint32_t depth;         /* Nested holds by the writer, 0 if none */
+    pthread_t writer;
+} RwLock;
+
+/* Lock of one directory, alive while some thread holds or awaits it */
+typedef struct DirLock {
+    uint32_t cluster;       /* First cluster of the directory */
+    uint32_t users;         /* Holds taken or being waited for */
+    RwLock lock;
+    struct DirLock *next;
+} DirLock;
+
+/* A lock per directory in use, keyed by first cluster, so holding one
+ * directory never blocks another. A thread holding a directory's lock may
+ * take the lock of a subdirectory, never of a parent or a sibling. */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t spared;  /* A lock went unused, for want of memory */
+    DirLock *buckets[DIR_LOCK_BUCKETS];
+    DirLock *spare;         /* Unused locks kept for reuse */
+} DirLockTable;
+
+/* Locking functions */
+int mutex_init_recursive(pthread_mutex_t *mutex);
+void rwlock_init(RwLock *lock);
+void rwlock_destroy(RwLock *lock);
+void rwlock_read(RwLock *lock);
+void rwlock_write(RwLock *lock);
+void rwlock_unlock(RwLock *lock);
+void dir_locks_init(DirLockTable *table);
+void dir_locks_destroy(DirLockTable *table);
+RwLock *dir_locks_get(DirLockTable *table, uint32_t cluster);
+void dir_locks_release(DirLockTable *table, uint32_t cluster);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdint.h>
+#include "fat32.h"
+
+#define DENTRY_CACHE_SIZE 1024
+#define DENTRY_CACHE_BUCKETS 2048
+#define DENTRY_NAME_MAX 64      /* Longer components are looked up uncached */
+
+/* Path resolution results */
+#define PATH_OK 0
+#define PATH_NOT_FOUND -1
+#define PATH_NOT_DIR -2
+
+/* Cached result of looking up one name in one directory */
+typedef struct Dentry {
+    uint32_t parent;        /* First cluster of the containing directory */
+    char name[DENTRY_NAME_MAX]; /* Component as looked up, case ignored */
+    uint8_t attr;
+    int negative;           /* Name is known not to exist */
+    int in_use;
+    uint32_t cluster;       /* First cluster of the entry (directories only) */
+    struct Dentry *hash_next;
+    struct Dentry *lru_prev;
+    struct Dentry *lru_next;
+} Dentry;
+
+/* Fixed pool of dentries, recycled in LRU order, under one lock */
+struct DentryCache {
+    pthread_mutex_t lock;
+    uint64_t generation;    /* Bumped by every invalidation */
+    Dentry entries[DENTRY_CACHE_SIZE];
+    Dentry *table[DENTRY_CACHE_BUCKETS];
+    Dentry lru;             /* Sentinel: lru.lru_next is most recently used */
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* Location of a path's last component */
+typedef struct {
+    uint32_t parent;                /* First cluster of the containing directory */
+    char name[MAX_PATH_LENGTH];     /* Last component as given */
+    char dir_path[MAX_PATH_LENGTH]; /* Absolute path of the containing directory */
+} PathTarget;
+
+/* Dentry cache functions */
+int dcache_init(FileSystem *fs);
+void dcache_destroy(FileSystem *fs);
+void dcache_invalidate(FileSystem *fs, uint32_t parent, const char *name);
+void dcache_purge_dir(FileSystem *fs, uint32_t cluster);
+void dcache_purge_cluster(FileSystem *fs, uint32_t cluster);
+
+/* Path resolution functions */
+int resolve_path(FileSystem *fs, const char *path, PathTarget *target);
+int resolve_directory(FileSystem *fs, const char *path, uint32_t *cluster,
+                      char *abs_path);
+int display_path(FileSystem *fs, const char *abs_path, char *shown);
+DirEntry *lookup_path(FileSystem *fs, const char *path, PathTarget *target);
+int is_subdirectory(FileSystem *fs, uint32_t cluster, uint32_t ancestor);
+int path_append(char *abs_path, const char *component);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "fat32.h"
+
+#define SERVER_MAX_WORKERS 64
+#define SERVER_INPUT_LIMIT 65536    /* Unrun input buffered per client */
+
+/* Server mode functions */
+int serve(FileSystem *fs, const char *socket_path, int workers);
+int client_run(const char *socket_path);
+
+#endif
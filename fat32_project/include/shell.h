@@ -0,0 +1,15 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+#include "fat32.h"
+
+#define MAX_INPUT_SIZE 1024
+#define MAX_ARGS 10
+
+/* Shell functions */
+int parse_input(char *input, char **args);
+void print_prompt(FileSystem *fs);
+void run_command(FileSystem *fs, int argc, char **args);
+void shell_loop(FileSystem *fs);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdint.h>
+#include "fat32.h"
+
+#define WALK_MAX_THREADS 64
+
+/* One entry reached by a walk, as handed to the visitor */
+typedef struct {
+    const char *path;       /* Full path of the entry */
+    const char *name;       /* Last component of the path */
+    const DirEntry *entry;  /* NULL for the directory the walk started at */
+    uint32_t depth;         /* 0 for the directory the walk started at */
+    int last;               /* Last entry of its directory */
+    uint64_t bytes;         /* Allocated bytes: the chain of a file, or the
+                               whole subtree of a directory once walked */
+} WalkItem;
+
+/* Called for every entry in directory order, parents before children
+ * (post 0), and once more for each directory after its subtree (post 1) */
+typedef void (*WalkVisitor)(void *context, const WalkItem *item, int post);
+
+/* Parallel tree walk functions */
+int walk_tree(FileSystem *fs, uint32_t cluster, const char *path, int threads,
+              WalkVisitor visitor, void *context);
+int walk_match(const char *pattern, const char *name);
+
+#endif
@@ -0,0 +1,865 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/blockdev.h"
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* Open an image file as a block device */
+int bdev_open(BlockDevice *dev, const char *path, int backend) {
+    dev->map = NULL;
+    dev->ring = NULL;
+    dev->backend = backend;
+    dev->io_engine = IO_ENGINE_SYNC;
+    dev->sector_size = DEFAULT_SECTOR_SIZE;
+
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(dev->fd, &st) < 0 || st.st_size == 0) {
+        close(dev->fd);
+        return -1;
+    }
+    dev->size = st.st_size;
+
+    if (backend == BACKEND_MMAP) {
+        dev->map = mmap(NULL, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        dev->fd, 0);
+        if (dev->map == MAP_FAILED) {
+            dev->map = NULL;
+            close(dev->fd);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&dev->ring_lock, NULL);
+    return 0;
+}
+
+/* Close a block device */
+void bdev_close(BlockDevice *dev) {
+    bdev_set_io_engine(dev, IO_ENGINE_SYNC);
+    pthread_mutex_destroy(&dev->ring_lock);
+    if (dev->map) {
+        munmap(dev->map, dev->size);
+        dev->map = NULL;
+    }
+    if (dev->fd >= 0) {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+}
+
+/* Read count sectors starting at sector */
+int bdev_read(BlockDevice *dev, uint64_t sector, uint32_t count, void *buffer) {
+    uint64_t offset = sector * dev->sector_size;
+    size_t len = (size_t)count * dev->sector_size;
+
+    if (offset + len > dev->size) {
+        return -1;
+    }
+    if (dev->map) {
+        memcpy(buffer, dev->map + offset, len);
+        return 0;
+    }
+
+    uint8_t *out = buffer;
+    while (len > 0) {
+        ssize_t n = pread(dev->fd, out, len, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        out += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write count sectors starting at sector */
+int bdev_write(BlockDevice *dev, uint64_t sector, uint32_t count,
+               const void *buffer) {
+    uint64_t offset = sector * dev->sector_size;
+    size_t len = (size_t)count * dev->sector_size;
+
+    if (offset + len > dev->size) {
+        return -1;
+    }
+    if (dev->map) {
+        memcpy(dev->map + offset, buffer, len);
+        return 0;
+    }
+
+    const uint8_t *in = buffer;
+    while (len > 0) {
+        ssize_t n = pwrite(dev->fd, in, len, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        in += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Make all writes durable */
+int bdev_sync(BlockDevice *dev) {
+    if (dev->map) {
+        return msync(dev->map, dev->size, MS_SYNC);
+    }
+    return fsync(dev->fd);
+}
+
+/* Write a whole buffer to a host file descriptor */
+static int write_all(int fd, const uint8_t *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Copy a byte range of the image to a host file descriptor, inside the
+ * kernel where possible: copy_file_range when out_fd is a regular file,
+ * else sendfile (pipes, sockets, terminals), else through a bounded
+ * buffer. The caller must have flushed any cached writes to the range. */
+int bdev_copy_out(BlockDevice *dev, uint64_t offset, size_t len, int out_fd) {
+    if (offset + len > dev->size) {
+        return -1;
+    }
+    if (dev->map) {
+        return write_all(out_fd, dev->map + offset, len);
+    }
+
+#ifdef __linux__
+    while (len > 0) {
+        loff_t in = offset;
+        ssize_t n = copy_file_range(dev->fd, &in, out_fd, NULL, len, 0);
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+        len -= n;
+    }
+    while (len > 0) {
+        off_t in = offset;
+        ssize_t n = sendfile(out_fd, dev->fd, &in, len);
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+        len -= n;
+    }
+#endif
+
+    if (len == 0) {
+        return 0;
+    }
+    size_t chunk = len < BDEV_COPY_CHUNK ? len : BDEV_COPY_CHUNK;
+    uint8_t *buffer = malloc(chunk);
+    if (!buffer) {
+        return -1;
+    }
+    int result = 0;
+    while (len > 0) {
+        size_t want = len < chunk ? len : chunk;
+        ssize_t n = pread(dev->fd, buffer, want, offset);
+        if (n <= 0 || write_all(out_fd, buffer, n) < 0) {
+            result = -1;
+            break;
+        }
+        offset += n;
+        len -= n;
+    }
+    free(buffer);
+    return result;
+}
+
+/* Transfer one request synchronously */
+static int submit_sync(BlockDevice *dev, IoRequest *request, int write) {
+    uint8_t *buffer = request->buffer;
+    uint64_t offset = request->offset;
+    size_t len = request->length;
+
+    if (dev->map) {
+        if (write) {
+            memcpy(dev->map + offset, buffer, len);
+        } else {
+            memcpy(buffer, dev->map + offset, len);
+        }
+        return 0;
+    }
+
+    while (len > 0) {
+        ssize_t n = write ? pwrite(dev->fd, buffer, len, offset) :
+                            pread(dev->fd, buffer, len, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        buffer += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/* Submission and completion rings shared with the kernel */
+typedef struct {
+    int fd;
+    uint32_t entries;
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    uint8_t *finished;      /* Per request of a batch, set once reaped */
+} IoUring;
+
+static void uring_destroy(IoUring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->finished);
+    free(ring);
+}
+
+static IoUring *uring_create(uint32_t entries) {
+    struct io_uring_params params;
+    IoUring *ring = calloc(1, sizeof(IoUring));
+    if (!ring) {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+    ring->finished = malloc(ring->entries);
+    if (!ring->finished) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array +
+                         params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_destroy(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+/* Queue up to one ring's worth of requests, then reap every completion.
+ * Short or failed transfers are finished synchronously. If io_uring_enter
+ * fails, the requests the kernel has not taken are withdrawn, the ones it
+ * has are waited for, since it still owns their buffers, and everything
+ * not completed is done synchronously. */
+static int uring_submit(BlockDevice *dev, IoRequest *requests, int count,
+                        int write) {
+    IoUring *ring = dev->ring;
+    int result = 0;
+
+    while (count > 0) {
+        uint32_t batch = (uint32_t)count < ring->entries ?
+                         (uint32_t)count : ring->entries;
+        uint32_t tail = *ring->sq_tail;
+
+        for (uint32_t i = 0; i < batch; i++) {
+            uint32_t index = (tail + i) & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = dev->fd;
+            sqe->off = requests[i].offset;
+            sqe->addr = (uint64_t)(uintptr_t)requests[i].buffer;
+            sqe->len = requests[i].length;
+            sqe->user_data = i;
+            ring->sq_array[index] = index;
+        }
+        memset(ring->finished, 0, batch);
+        __atomic_store_n(ring->sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+        uint32_t reaped = 0, in_flight = batch;
+        int failed = 0;
+        while (reaped < in_flight) {
+            int ret = syscall(__NR_io_uring_enter, ring->fd,
+                              reaped == 0 && !failed ? batch : 0,
+                              in_flight - reaped, IORING_ENTER_GETEVENTS,
+                              NULL, 0);
+            if (ret < 0 && errno != EINTR) {
+                if (!failed) {
+                    /* Nothing else submits on this ring meanwhile */
+                    uint32_t taken = __atomic_load_n(ring->sq_head,
+                                                     __ATOMIC_ACQUIRE);
+                    __atomic_store_n(ring->sq_tail, taken, __ATOMIC_RELEASE);
+                    in_flight = taken - tail;
+                    failed = 1;
+                }
+                /* Completions still arrive; poll for them */
+                sched_yield();
+            }
+
+            uint32_t head = *ring->cq_head;
+            uint32_t cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+            while (head != cq_tail) {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                IoRequest *request = &requests[cqe->user_data];
+                if (cqe->res < 0 || (uint32_t)cqe->res < request->length) {
+                    IoRequest rest = *request;
+                    uint32_t done = cqe->res < 0 ? 0 : cqe->res;
+                    rest.offset += done;
+                    rest.buffer += done;
+                    rest.length -= done;
+                    if (submit_sync(dev, &rest, write) < 0) {
+                        result = -1;
+                    }
+                }
+                ring->finished[cqe->user_data] = 1;
+                head++;
+                reaped++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        /* Requests withdrawn from the ring */
+        for (uint32_t i = 0; failed && i < batch; i++) {
+            if (!ring->finished[i] &&
+                submit_sync(dev, &requests[i], write) < 0) {
+                result = -1;
+            }
+        }
+
+        requests += batch;
+        count -= batch;
+    }
+    return result;
+}
+#endif
+
+/* Select the engine used by bdev_submit. Falls back to synchronous
+ * pread/pwrite (returning -1) when io_uring is unavailable. */
+int bdev_set_io_engine(BlockDevice *dev, int io_engine) {
+#ifdef HAVE_IO_URING
+    if (dev->ring) {
+        uring_destroy(dev->ring);
+        dev->ring = NULL;
+    }
+    dev->io_engine = IO_ENGINE_SYNC;
+    if (io_engine == IO_ENGINE_URING && !dev->map) {
+        dev->ring = uring_create(IO_URING_ENTRIES);
+        if (!dev->ring) {
+            return -1;
+        }
+        dev->io_engine = IO_ENGINE_URING;
+    }
+    return 0;
+#else
+    dev->io_engine = IO_ENGINE_SYNC;
+    return io_engine == IO_ENGINE_SYNC ? 0 : -1;
+#endif
+}
+
+/* Perform a batch of reads or writes at arbitrary byte offsets */
+int bdev_submit(BlockDevice *dev, IoRequest *requests, int count, int write) {
+    for (int i = 0; i < count; i++) {
+        if (requests[i].offset + requests[i].length > dev->size) {
+            return -1;
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if (dev->io_engine == IO_ENGINE_URING && count > 1) {
+        /* One ring is shared by every thread */
+        pthread_mutex_lock(&dev->ring_lock);
+        int result = uring_submit(dev, requests, count, write);
+        pthread_mutex_unlock(&dev->ring_lock);
+        return result;
+    }
+#endif
+
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (submit_sync(dev, &requests[i], write) < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static int cache_flush_locked(BufferCache *cache);
+
+/* Hash bucket for a sector */
+static CacheBuffer **cache_bucket(BufferCache *cache, uint64_t sector) {
+    uint64_t h = sector * 0x9E3779B97F4A7C15ULL;
+    return &cache->hash[(h >> 32) & cache->hash_mask];
+}
+
+/* Look up a cached sector */
+static CacheBuffer *cache_lookup(BufferCache *cache, uint64_t sector) {
+    CacheBuffer *buf = *cache_bucket(cache, sector);
+    while (buf && buf->sector != sector) {
+        buf = buf->hash_next;
+    }
+    return buf;
+}
+
+static void lru_unlink(CacheBuffer *buf) {
+    buf->lru_prev->lru_next = buf->lru_next;
+    buf->lru_next->lru_prev = buf->lru_prev;
+}
+
+static void lru_push_front(BufferCache *cache, CacheBuffer *buf) {
+    buf->lru_next = cache->lru.lru_next;
+    buf->lru_prev = &cache->lru;
+    cache->lru.lru_next->lru_prev = buf;
+    cache->lru.lru_next = buf;
+}
+
+/* Take a free buffer, evicting the least recently used one if full */
+static CacheBuffer *cache_take(BufferCache *cache) {
+    if (cache->used < cache->capacity) {
+        CacheBuffer *buf = &cache->buffers[cache->used++];
+        buf->dirty = 0;
+        return buf;
+    }
+
+    CacheBuffer *victim = cache->lru.lru_prev;
+    if (victim->dirty) {
+        /* Evicting dirty data writes it back first */
+        if (bdev_write(cache->dev, victim->sector, 1, victim->data) == 0) {
+            cache->writebacks++;
+        }
+        victim->dirty = 0;
+        cache->dirty_count--;
+    }
+    lru_unlink(victim);
+    CacheBuffer **link = cache_bucket(cache, victim->sector);
+    while (*link != victim) {
+        link = &(*link)->hash_next;
+    }
+    *link = victim->hash_next;
+    return victim;
+}
+
+/* Insert a copy of a sector into the cache */
+static CacheBuffer *cache_insert(BufferCache *cache, uint64_t sector,
+                                 const uint8_t *data) {
+    CacheBuffer *buf = cache_take(cache);
+    buf->sector = sector;
+    memcpy(buf->data, data, cache->dev->sector_size);
+
+    CacheBuffer **bucket = cache_bucket(cache, sector);
+    buf->hash_next = *bucket;
+    *bucket = buf;
+    lru_push_front(cache, buf);
+    return buf;
+}
+
+/* Initialize a cache of capacity sectors over dev (0 disables caching) */
+int cache_init(BufferCache *cache, BlockDevice *dev, uint32_t capacity) {
+    memset(cache, 0, sizeof(BufferCache));
+    cache->dev = dev;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->lru.lru_next = &cache->lru;
+    cache->lru.lru_prev = &cache->lru;
+    if (capacity == 0) {
+        return 0;
+    }
+
+    uint32_t buckets = 1;
+    while (buckets < capacity * 2) {
+        buckets <<= 1;
+    }
+
+    cache->buffers = calloc(capacity, sizeof(CacheBuffer));
+    cache->data = malloc((size_t)capacity * dev->sector_size);
+    cache->hash = calloc(buckets, sizeof(CacheBuffer *));
+    if (!cache->buffers || !cache->data || !cache->hash) {
+        cache_destroy(cache);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < capacity; i++) {
+        cache->buffers[i].data = cache->data + (size_t)i * dev->sector_size;
+    }
+    cache->hash_mask = buckets - 1;
+    cache->capacity = capacity;
+    return 0;
+}
+
+/* Release cache memory */
+void cache_destroy(BufferCache *cache) {
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buffers);
+    free(cache->data);
+    free(cache->hash);
+    cache->buffers = NULL;
+    cache->data = NULL;
+    cache->hash = NULL;
+    cache->capacity = 0;
+    cache->used = 0;
+}
+
+/* Read sectors through the cache. Runs of misses are fetched with one
+ * device read; runs larger than a quarter of the cache are not inserted
+ * so that streaming data does not flush out hot metadata. */
+static int cache_read_locked(BufferCache *cache, uint64_t sector,
+                             uint32_t count, void *buffer) {
+    uint32_t sector_size = cache->dev->sector_size;
+    uint8_t *out = buffer;
+
+    if (cache->capacity == 0) {
+        cache->misses += count;
+        return bdev_read(cache->dev, sector, count, buffer);
+    }
+
+    uint32_t i = 0;
+    while (i < count) {
+        CacheBuffer *buf = cache_lookup(cache, sector + i);
+        if (buf) {
+            memcpy(out + (size_t)i * sector_size, buf->data, sector_size);
+            lru_unlink(buf);
+            lru_push_front(cache, buf);
+            cache->hits++;
+            i++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (i + run < count && !cache_lookup(cache, sector + i + run)) {
+            run++;
+        }
+        uint8_t *dest = out + (size_t)i * sector_size;
+        if (bdev_read(cache->dev, sector + i, run, dest) < 0) {
+            return -1;
+        }
+        cache->misses += run;
+        if (run <= cache->capacity / 4) {
+            for (uint32_t j = 0; j < run; j++) {
+                cache_insert(cache, sector + i + j,
+                             dest + (size_t)j * sector_size);
+            }
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/* Locked entry point of cache_read_locked */
+int cache_read(BufferCache *cache, uint64_t sector, uint32_t count,
+               void *buffer) {
+    pthread_mutex_lock(&cache->lock);
+    int result = cache_read_locked(cache, sector, count, buffer);
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+/* Write sectors. In write-through mode they go straight to the device and
+ * cached copies are refreshed. In write-back mode small writes are only
+ * buffered as dirty sectors until cache_flush or the dirty limit; large
+ * writes still go straight through. */
+static int cache_write_locked(BufferCache *cache, uint64_t sector,
+                              uint32_t count, const void *buffer) {
+    uint32_t sector_size = cache->dev->sector_size;
+    const uint8_t *in = buffer;
+    int buffered = cache->write_back && count <= cache->capacity / 4;
+
+    if (!buffered && bdev_write(cache->dev, sector, count, buffer) < 0) {
+        return -1;
+    }
+    if (cache->capacity == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        CacheBuffer *buf = cache_lookup(cache, sector + i);
+        if (buf) {
+            memcpy(buf->data, in + (size_t)i * sector_size, sector_size);
+            lru_unlink(buf);
+            lru_push_front(cache, buf);
+        } else if (count <= cache->capacity / 4) {
+            buf = cache_insert(cache, sector + i,
+                               in + (size_t)i * sector_size);
+        } else {
+            continue;
+        }
+
+        if (buffered && !buf->dirty) {
+            buf->dirty = 1;
+            cache->dirty_count++;
+        } else if (!buffered && buf->dirty) {
+            buf->dirty = 0;
+            cache->dirty_count--;
+        }
+    }
+
+    if (cache->dirty_count >= cache->dirty_limit && cache->dirty_count > 0) {
+        return cache_flush_locked(cache);
+    }
+    return 0;
+}
+
+/* Locked entry point of cache_write_locked */
+int cache_write(BufferCache *cache, uint64_t sector, uint32_t count,
+                const void *buffer) {
+    pthread_mutex_lock(&cache->lock);
+    int result = cache_write_locked(cache, sector, count, buffer);
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+/* Refresh cached copies of sectors overlapped by a byte-range write that
+ * bypassed the cache */
+static void cache_patch_locked(BufferCache *cache, uint64_t offset,
+                               const void *buffer, size_t len) {
+    uint32_t sector_size = cache->dev->sector_size;
+    const uint8_t *in = buffer;
+
+    if (cache->capacity == 0 || len == 0) {
+        return;
+    }
+
+    uint64_t first = offset / sector_size;
+    uint64_t last = (offset + len - 1) / sector_size;
+    for (uint64_t sector = first; sector <= last; sector++) {
+        CacheBuffer *buf = cache_lookup(cache, sector);
+        if (!buf) {
+            continue;
+        }
+        uint64_t start = sector * sector_size;
+        uint64_t from = offset > start ? offset : start;
+        uint64_t to = offset + len < start + sector_size ?
+                      offset + len : start + sector_size;
+        memcpy(buf->data + (from - start), in + (from - offset), to - from);
+    }
+}
+
+/* Locked entry point of cache_patch_locked */
+void cache_patch(BufferCache *cache, uint64_t offset, const void *buffer,
+                 size_t len) {
+    pthread_mutex_lock(&cache->lock);
+    cache_patch_locked(cache, offset, buffer, len);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Copy dirty cached sectors over a buffer just read from the device, so
+ * transfers that bypass the cache still see buffered writes */
+static void cache_overlay_locked(BufferCache *cache, uint64_t offset,
+                                 void *buffer, size_t len) {
+    uint32_t sector_size = cache->dev->sector_size;
+    uint8_t *out = buffer;
+
+    if (cache->dirty_count == 0 || len == 0) {
+        return;
+    }
+
+    uint64_t first = offset / sector_size;
+    uint64_t last = (offset + len - 1) / sector_size;
+    for (uint64_t sector = first; sector <= last; sector++) {
+        CacheBuffer *buf = cache_lookup(cache, sector);
+        if (!buf || !buf->dirty) {
+            continue;
+        }
+        uint64_t start = sector * sector_size;
+        uint64_t from = offset > start ? offset : start;
+        uint64_t to = offset + len < start + sector_size ?
+                      offset + len : start + sector_size;
+        memcpy(out + (from - offset), buf->data + (from - start), to - from);
+    }
+}
+
+/* Locked entry point of cache_overlay_locked. Fails without touching the
+ * buffer if dirty sectors reached the device since writebacks was read
+ * (see cache_writebacks): the buffer may hold what they replaced. */
+int cache_overlay(BufferCache *cache, uint64_t offset, void *buffer,
+                  size_t len, uint64_t writebacks) {
+    pthread_mutex_lock(&cache->lock);
+    int stale = cache->writebacks != writebacks;
+    if (!stale) {
+        cache_overlay_locked(cache, offset, buffer, len);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return stale ? -1 : 0;
+}
+
+/* Number of dirty sectors written back so far */
+uint64_t cache_writebacks(BufferCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    uint64_t writebacks = cache->writebacks;
+    pthread_mutex_unlock(&cache->lock);
+    return writebacks;
+}
+
+/* Switch between write-through and write-back. The dirty limit is capped
+ * at half the cache so that eviction rarely has to write back. */
+void cache_set_write_back(BufferCache *cache, int enable, size_t dirty_bytes) {
+    pthread_mutex_lock(&cache->lock);
+    if (!enable) {
+        cache_flush_locked(cache);
+    }
+    cache->write_back = enable && cache->capacity > 0;
+
+    uint64_t limit = dirty_bytes / cache->dev->sector_size;
+    if (limit > cache->capacity / 2) {
+        limit = cache->capacity / 2;
+    }
+    cache->dirty_limit = limit ? limit : 1;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static int compare_buffers(const void *a, const void *b) {
+    const CacheBuffer *x = *(CacheBuffer * const *)a;
+    const CacheBuffer *y = *(CacheBuffer * const *)b;
+    return (x->sector > y->sector) - (x->sector < y->sector);
+}
+
+/* Write every dirty sector back, coalescing adjacent sectors into one
+ * request per run and submitting all runs as one batch */
+static int cache_flush_locked(BufferCache *cache) {
+    uint32_t sector_size = cache->dev->sector_size;
+    uint32_t count = cache->dirty_count;
+    int result = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    CacheBuffer **dirty = malloc(count * sizeof(CacheBuffer *));
+    uint8_t *staging = malloc((size_t)count * sector_size);
+    IoRequest *requests = malloc(count * sizeof(IoRequest));
+    if (!dirty || !staging || !requests) {
+        free(dirty);
+        free(staging);
+        free(requests);
+        return -1;
+    }
+
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < cache->used && found < count; i++) {
+        if (cache->buffers[i].dirty) {
+            dirty[found++] = &cache->buffers[i];
+        }
+    }
+    qsort(dirty, found, sizeof(CacheBuffer *), compare_buffers);
+
+    int num_requests = 0;
+    for (uint32_t i = 0; i < found; i++) {
+        uint8_t *slot = staging + (size_t)i * sector_size;
+        memcpy(slot, dirty[i]->data, sector_size);
+        if (i > 0 && dirty[i]->sector == dirty[i - 1]->sector + 1) {
+            requests[num_requests - 1].length += sector_size;
+        } else {
+            requests[num_requests].offset = dirty[i]->sector * sector_size;
+            requests[num_requests].buffer = slot;
+            requests[num_requests].length = sector_size;
+            num_requests++;
+        }
+    }
+
+    if (bdev_submit(cache->dev, requests, num_requests, 1) < 0) {
+        result = -1;
+    } else {
+        for (uint32_t i = 0; i < found; i++) {
+            dirty[i]->dirty = 0;
+        }
+        cache->dirty_count -= found;
+        cache->writebacks += found;
+    }
+
+    free(dirty);
+    free(staging);
+    free(requests);
+    return result;
+}
+
+/* Locked entry point of cache_flush_locked */
+int cache_flush(BufferCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    int result = cache_flush_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../include/server.h"
+
+#define CLIENT_BUFFER_SIZE 4096
+
+/* Write a whole buffer, retrying short writes */
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/* Talk to a server: stdin goes to the socket and the socket to stdout,
+ * until the server closes the connection */
+int client_run(const char *socket_path) {
+    struct sockaddr_un address;
+    char buffer[CLIENT_BUFFER_SIZE];
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long\n");
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create socket\n");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "Error: Cannot connect to %s\n", socket_path);
+        close(fd);
+        return -1;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+    int watched = 2;
+
+    while (1) {
+        if (poll(fds, watched, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        /* Server output first, so a full socket never blocks both sides */
+        if (fds[0].revents) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || write_all(STDOUT_FILENO, buffer, n) < 0) {
+                break;
+            }
+        }
+        if (watched == 2 && fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                /* No more commands; the server answers what it has */
+                shutdown(fd, SHUT_WR);
+                watched = 1;
+            } else if (write_all(fd, buffer, n) < 0) {
+                break;
+            }
+        }
+    }
+
+    close(fd);
+    return 0;
+}
@@ -2,256 +2,205 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "../include/commands.h"
+#include "../include/libfat32.h"
 #include "../include/fat32.h"
-
-/* Helper: Find open file */
-OpenFile *find_open_file(FileSystem *fs, const char *filename) {
-    char formatted_name[12];
-    format_filename(filename, formatted_name);
-
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (fs->open_files[i].is_open) {
-            char open_formatted[12];
-            format_filename(fs->open_files[i].filename, open_formatted);
-            if (memcmp(open_formatted, formatted_name, 11) == 0) {
-                return &fs->open_files[i];
-            }
-        }
-    }
-    return NULL;
-}
-
-/* Helper: Add open file */
-int add_open_file(FileSystem *fs, const char *filename, const char *mode,
-                  const char *path, uint32_t first_cluster, uint32_t size) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (!fs->open_files[i].is_open) {
-            strncpy(fs->open_files[i].filename, filename, 11);
-            fs->open_files[i].filename[11] = '\0';
-            strncpy(fs->open_files[i].mode, mode, 3);
-            fs->open_files[i].mode[3] = '\0';
-            strncpy(fs->open_files[i].path, path, MAX_PATH_LENGTH - 1);
-            fs->open_files[i].path[MAX_PATH_LENGTH - 1] = '\0';
-            fs->open_files[i].offset = 0;
-            fs->open_files[i].first_cluster = first_cluster;
-            fs->open_files[i].size = size;
-            fs->open_files[i].is_open = 1;
-            return 0;
-        }
-    }
-    return -1;
-}
-
-/* Helper: Remove open file */
-void remove_open_file(FileSystem *fs, const char *filename) {
-    OpenFile *file = find_open_file(fs, filename);
-    if (file) {
-        file->is_open = 0;
-    }
-}
+#include "../include/dirindex.h"
+#include "../include/path.h"
+#include "../include/defrag.h"
+#include "../include/fsck.h"
+#include "../include/walk.h"
 
 /* info command */
 void cmd_info(FileSystem *fs) {
-    printf("position of root cluster: %u\n", fs->boot_sector.BPB_RootClus);
-    printf("bytes per sector: %u\n", fs->boot_sector.BPB_BytsPerSec);
-    printf("sectors per cluster: %u\n", fs->boot_sector.BPB_SecPerClus);
-    printf("total # of clusters in data region: %u\n", fs->total_clusters);
-    printf("# of entries in one FAT: %u\n", 
-           fs->boot_sector.BPB_FATSz32 * fs->boot_sector.BPB_BytsPerSec / 4);
+    fprintf(fs->out, "position of root cluster: %u\n",
+            fs->boot_sector.BPB_RootClus);
+    fprintf(fs->out, "bytes per sector: %u\n", fs->boot_sector.BPB_BytsPerSec);
+    fprintf(fs->out, "sectors per cluster: %u\n",
+            fs->boot_sector.BPB_SecPerClus);
+    fprintf(fs->out, "total # of clusters in data region: %u\n",
+            fs->total_clusters);
+    fprintf(fs->out, "# of entries in one FAT: %u\n", 
+            fs->boot_sector.BPB_FATSz32 * fs->boot_sector.BPB_BytsPerSec / 4);
     
-    /* Calculate image size */
-    fseek(fs->image, 0, SEEK_END);
-    long size = ftell(fs->image);
-    printf("size of image (in bytes): %ld\n", size);
+    fprintf(fs->out, "size of image (in bytes): %llu\n",
+            (unsigned long long)fs->dev->size);
 }
 
-/* ls command */
-void cmd_ls(FileSystem *fs) {
-    int num_entries;
-    DirEntry *entries = read_directory(fs, fs->current_cluster, &num_entries);
+/* stats command */
+void cmd_stats(FileSystem *fs) {
+    BufferCache *cache = fs->cache;
+    uint64_t lookups = cache->hits + cache->misses;
+
+    fprintf(fs->out, "cache capacity (sectors): %u\n", cache->capacity);
+    fprintf(fs->out, "cache sectors in use: %u\n", cache->used);
+    fprintf(fs->out, "cache hits: %llu\n", (unsigned long long)cache->hits);
+    fprintf(fs->out, "cache misses: %llu\n", (unsigned long long)cache->misses);
+    fprintf(fs->out, "cache hit rate: %.1f%%\n",
+            lookups ? 100.0 * cache->hits / lookups : 0.0);
+    fprintf(fs->out, "write mode: %s\n", cache->write_back ? "write-back" :
+                                                     "write-through");
+    fprintf(fs->out, "dirty sectors: %u\n",
+            cache->dirty_count + fs->fat->dirty_count);
+    fprintf(fs->out, "sectors written back: %llu\n",
+            (unsigned long long)cache->writebacks);
+    fprintf(fs->out, "directory indexes: %u\n", fs->dirs->count);
+    fprintf(fs->out, "directory index hits: %llu\n",
+            (unsigned long long)fs->dirs->hits);
+    fprintf(fs->out, "directory index misses: %llu\n",
+            (unsigned long long)fs->dirs->misses);
+    fprintf(fs->out, "dentry cache hits: %llu\n",
+            (unsigned long long)fs->dentries->hits);
+    fprintf(fs->out, "dentry cache misses: %llu\n",
+            (unsigned long long)fs->dentries->misses);
+}
 
-    for (int i = 0; i < num_entries; i++) {
-        char filename[13];
-        parse_filename((char *)entries[i].DIR_Name, filename);
-        printf("%s\n", filename);
+/* sync command */
+void cmd_sync(FileSystem *fs) {
+    if (fat32_sync(fs) < 0) {
+        fprintf(fs->out, "Error: Failed to sync image\n");
     }
-
-    free(entries);
 }
 
-/* cd command */
-void cmd_cd(FileSystem *fs, const char *dirname) {
-    if (strcmp(dirname, ".") == 0) {
+/* ls command */
+void cmd_ls(FileSystem *fs, const char *path) {
+    Fat32Dir *dir;
+    Fat32Dirent entry;
+
+    int result = fat32_opendir(fs, path, &dir);
+    if (result == FAT32_ERR_NOT_FOUND) {
+        fprintf(fs->out, "Error: Directory does not exist\n");
         return;
     }
-
-    DirEntry *entry = find_entry(fs, fs->current_cluster, dirname);
-    if (!entry) {
-        printf("Error: Directory does not exist\n");
+    if (result == FAT32_ERR_NOT_DIR) {
+        fprintf(fs->out, "Error: Not a directory\n");
         return;
     }
-
-    if (!(entry->DIR_Attr & ATTR_DIRECTORY)) {
-        printf("Error: Not a directory\n");
-        free(entry);
+    if (result < 0) {
+        fprintf(fs->out, "Error: %s\n", fat32_strerror(result));
         return;
     }
 
-    uint32_t new_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) |
-                           entry->DIR_FstClusLO;
-
-    if (strcmp(dirname, "..") == 0) {
-        /* Going to parent */
-        if (strcmp(fs->current_path, "/") != 0) {
-            char *last_slash = strrchr(fs->current_path, '/');
-            if (last_slash == fs->current_path) {
-                strcpy(fs->current_path, "/");
-            } else {
-                *last_slash = '\0';
-            }
-        }
-        fs->current_cluster = (new_cluster == 0) ? 
-                              fs->root_cluster : new_cluster;
-    } else {
-        /* Going to child */
-        if (strcmp(fs->current_path, "/") != 0) {
-            strcat(fs->current_path, "/");
-        }
-        strcat(fs->current_path, dirname);
-        fs->current_cluster = new_cluster;
+    while (fat32_readdir(dir, &entry) > 0) {
+        fprintf(fs->out, "%s\n", entry.name);
     }
-
-    free(entry);
+    fat32_closedir(dir);
 }
 
-/* mkdir command */
-void cmd_mkdir(FileSystem *fs, const char *dirname) {
-    /* Check if already exists */
-    DirEntry *existing = find_entry(fs, fs->current_cluster, dirname);
-    if (existing) {
-        printf("Error: Directory/file already exists\n");
-        free(existing);
-        return;
+/* cd command */
+void cmd_cd(FileSystem *fs, const char *dirname) {
+    int result = fat32_chdir(fs, dirname);
+    if (result == FAT32_ERR_NOT_FOUND) {
+        fprintf(fs->out, "Error: Directory does not exist\n");
+    } else if (result == FAT32_ERR_NOT_DIR) {
+        fprintf(fs->out, "Error: Not a directory\n");
     }
+}
 
-    /* Allocate cluster for new directory */
-    uint32_t new_cluster = allocate_cluster(fs);
-    if (new_cluster == 0) {
-        printf("Error: No free clusters available\n");
-        return;
+/* Helper: Print the error of a call that creates name; what refers to
+ * the entry in "Failed to create ..." */
+static void print_create_error(FileSystem *fs, int result, const char *what) {
+    switch (result) {
+    case FAT32_OK:
+        break;
+    case FAT32_ERR_NO_PARENT:
+        fprintf(fs->out, "Error: Parent directory does not exist\n");
+        break;
+    case FAT32_ERR_INVALID_NAME:
+        fprintf(fs->out, "Error: Invalid name\n");
+        break;
+    case FAT32_ERR_EXISTS:
+        fprintf(fs->out, "Error: Directory/file already exists\n");
+        break;
+    case FAT32_ERR_NO_SPACE:
+        fprintf(fs->out, "Error: No free clusters available\n");
+        break;
+    case FAT32_ERR_IO:
+        fprintf(fs->out, "Error: Failed to create %s\n", what);
+        break;
+    default:
+        fprintf(fs->out, "Error: %s\n", fat32_strerror(result));
+        break;
     }
+}
 
-    /* Create "." entry */
-    DirEntry dot_entry;
-    memset(&dot_entry, 0, sizeof(DirEntry));
-    memset(dot_entry.DIR_Name, ' ', 11);
-    dot_entry.DIR_Name[0] = '.';
-    dot_entry.DIR_Attr = ATTR_DIRECTORY;
-    dot_entry.DIR_FstClusHI = (new_cluster >> 16) & 0xFFFF;
-    dot_entry.DIR_FstClusLO = new_cluster & 0xFFFF;
-    write_directory_entry(fs, new_cluster, &dot_entry, 0);
-
-    /* Create ".." entry */
-    DirEntry dotdot_entry;
-    memset(&dotdot_entry, 0, sizeof(DirEntry));
-    memset(dotdot_entry.DIR_Name, ' ', 11);
-    dotdot_entry.DIR_Name[0] = '.';
-    dotdot_entry.DIR_Name[1] = '.';
-    dotdot_entry.DIR_Attr = ATTR_DIRECTORY;
-    uint32_t parent = (fs->current_cluster == fs->root_cluster) ? 
-                      0 : fs->current_cluster;
-    dotdot_entry.DIR_FstClusHI = (parent >> 16) & 0xFFFF;
-    dotdot_entry.DIR_FstClusLO = parent & 0xFFFF;
-    write_directory_entry(fs, new_cluster, &dotdot_entry, 1);
-
-    /* Create entry in parent directory */
-    if (create_directory_entry(fs, fs->current_cluster, dirname,
-                               ATTR_DIRECTORY, new_cluster, 0) < 0) {
-        printf("Error: Failed to create directory entry\n");
-        free_cluster_chain(fs, new_cluster);
-    }
+/* mkdir command */
+void cmd_mkdir(FileSystem *fs, const char *dirname) {
+    print_create_error(fs, fat32_mkdir(fs, dirname), "directory entry");
 }
 
 /* creat command */
 void cmd_creat(FileSystem *fs, const char *filename) {
-    /* Check if already exists */
-    DirEntry *existing = find_entry(fs, fs->current_cluster, filename);
-    if (existing) {
-        printf("Error: Directory/file already exists\n");
-        free(existing);
-        return;
-    }
-
-    /* Create file with no clusters allocated initially */
-    if (create_directory_entry(fs, fs->current_cluster, filename,
-                               ATTR_ARCHIVE, 0, 0) < 0) {
-        printf("Error: Failed to create file entry\n");
-    }
+    print_create_error(fs, fat32_create(fs, filename), "file entry");
 }
 
 /* open command */
 void cmd_open(FileSystem *fs, const char *filename, const char *mode) {
     /* Validate mode */
-    if (strcmp(mode, "-r") != 0 && strcmp(mode, "-w") != 0 &&
-        strcmp(mode, "-rw") != 0 && strcmp(mode, "-wr") != 0) {
-        printf("Error: Invalid mode\n");
-        return;
-    }
-
-    /* Check if file exists */
-    DirEntry *entry = find_entry(fs, fs->current_cluster, filename);
-    if (!entry) {
-        printf("Error: File does not exist\n");
-        return;
-    }
-
-    if (entry->DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: Cannot open a directory\n");
-        free(entry);
-        return;
-    }
-
-    /* Check if already open */
-    if (find_open_file(fs, filename)) {
-        printf("Error: File is already open\n");
-        free(entry);
-        return;
-    }
-
-    uint32_t first_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) |
-                             entry->DIR_FstClusLO;
-
-    /* Add to open files */
-    char mode_str[4];
-    strncpy(mode_str, mode + 1, 3);
-    mode_str[3] = '\0';
-
-    if (add_open_file(fs, filename, mode_str, fs->current_path,
-                      first_cluster, entry->DIR_FileSize) < 0) {
-        printf("Error: Too many open files\n");
+    int flags;
+    if (strcmp(mode, "-r") == 0) {
+        flags = FAT32_O_RDONLY;
+    } else if (strcmp(mode, "-w") == 0) {
+        flags = FAT32_O_WRONLY;
+    } else if (strcmp(mode, "-rw") == 0 || strcmp(mode, "-wr") == 0) {
+        flags = FAT32_O_RDWR;
+    } else {
+        fprintf(fs->out, "Error: Invalid mode\n");
+        return;
+    }
+
+    int result = fat32_open(fs, filename, flags);
+    switch (result) {
+    case FAT32_ERR_NOT_FOUND:
+        fprintf(fs->out, "Error: File does not exist\n");
+        break;
+    case FAT32_ERR_IS_DIR:
+        fprintf(fs->out, "Error: Cannot open a directory\n");
+        break;
+    case FAT32_ERR_ALREADY_OPEN:
+        fprintf(fs->out, "Error: File is already open\n");
+        break;
+    case FAT32_ERR_BUSY:
+        fprintf(fs->out, "Error: File is open by another client\n");
+        break;
+    case FAT32_ERR_TOO_MANY_OPEN:
+        fprintf(fs->out, "Error: Too many open files\n");
+        break;
+    default:
+        if (result < 0) {
+            fprintf(fs->out, "Error: %s\n", fat32_strerror(result));
+        }
+        break;
     }
+}
 
-    free(entry);
+/* Helper: Descriptor of an open file named by the shell, printing why
+ * there is none; what names the action refused on a directory */
+static int shell_fd(FileSystem *fs, const char *filename, const char *what) {
+    int fd = fat32_find_fd(fs, filename);
+    if (fd == FAT32_ERR_NOT_FOUND) {
+        fprintf(fs->out, "Error: File does not exist\n");
+    } else if (fd == FAT32_ERR_IS_DIR && what) {
+        fprintf(fs->out, "Error: Cannot %s a directory\n", what);
+    } else if (fd < 0) {
+        fprintf(fs->out, "Error: File is not open\n");
+    }
+    return fd;
 }
 
 /* close command */
 void cmd_close(FileSystem *fs, const char *filename) {
-    /* Check if file exists */
-    DirEntry *entry = find_entry(fs, fs->current_cluster, filename);
-    if (!entry) {
-        printf("Error: File does not exist\n");
+    int fd = shell_fd(fs, filename, NULL);
+    if (fd < 0) {
         return;
     }
-    free(entry);
 
-    /* Check if file is open */
-    if (!find_open_file(fs, filename)) {
-        printf("Error: File is not open\n");
-        return;
+    /* Closing a file writes back anything still buffered */
+    if (fat32_close(fs, fd) < 0) {
+        fprintf(fs->out, "Error: Failed to flush file data\n");
     }
-
-    remove_open_file(fs, filename);
 }
 
 /* lsof command */
@@ -260,459 +209,553 @@ void cmd_lsof(FileSystem *fs) {
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         if (fs->open_files[i].is_open) {
             if (!has_open) {
-                printf("Index\tFilename\tMode\tOffset\tPath\n");
+                fprintf(fs->out, "Index\tFilename\tMode\tOffset\tPath\n");
                 has_open = 1;
             }
-            printf("%d\t%s\t\t%s\t%u\t%s\n", i,
-                   fs->open_files[i].filename,
-                   fs->open_files[i].mode,
-                   fs->open_files[i].offset,
-                   fs->open_files[i].path);
+            fprintf(fs->out, "%d\t%s\t\t%s\t%u\t%s\n", i,
+                    fs->open_files[i].filename,
+                    fs->open_files[i].mode,
+                    fs->open_files[i].offset,
+                    fs->open_files[i].path);
         }
     }
     if (!has_open) {
-        printf("No files are currently open\n");
+        fprintf(fs->out, "No files are currently open\n");
     }
 }
 
 /* lseek command */
 void cmd_lseek(FileSystem *fs, const char *filename, uint32_t offset) {
-    /* Check if file exists */
-    DirEntry *entry = find_entry(fs, fs->current_cluster, filename);
-    if (!entry) {
-        printf("Error: File does not exist\n");
-        return;
-    }
-
-    OpenFile *file = find_open_file(fs, filename);
-    if (!file) {
-        printf("Error: File is not open\n");
-        free(entry);
+    int fd = shell_fd(fs, filename, NULL);
+    if (fd < 0) {
         return;
     }
 
-    if (offset > entry->DIR_FileSize) {
-        printf("Error: Offset is larger than file size\n");
-        free(entry);
-        return;
+    if (fat32_lseek(fs, fd, offset) == FAT32_ERR_INVALID) {
+        fprintf(fs->out, "Error: Offset is larger than file size\n");
     }
-
-    file->offset = offset;
-    free(entry);
 }
 
 /* read command */
-void cmd_read(FileSystem *fs, const char *filename, uint32_t size) {
-    /* Check if file exists */
-    DirEntry *entry = find_entry(fs, fs->current_cluster, filename);
-    if (!entry) {
-        printf("Error: File does not exist\n");
-        return;
-    }
-
-    if (entry->DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: Cannot read a directory\n");
-        free(entry);
-        return;
-    }
-
-    OpenFile *file = find_open_file(fs, filename);
-    if (!file) {
-        printf("Error: File is not open\n");
-        free(entry);
+void cmd_read(FileSystem *fs, const char *filename, uint32_t size, int raw) {
+    int fd = shell_fd(fs, filename, "read");
+    if (fd < 0) {
         return;
     }
 
-    if (strchr(file->mode, 'r') == NULL) {
-        printf("Error: File is not open for reading\n");
-        free(entry);
-        return;
-    }
-
-    /* Calculate actual size to read */
-    uint32_t bytes_to_read = size;
-    if (file->offset + size > entry->DIR_FileSize) {
-        bytes_to_read = entry->DIR_FileSize - file->offset;
-    }
-
-    if (bytes_to_read == 0) {
-        free(entry);
-        return;
-    }
-
-    /* Read data */
-    uint8_t *buffer = malloc(bytes_to_read);
-    uint32_t bytes_read = 0;
-    uint32_t current_offset = file->offset;
-    uint32_t first_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) |
-                             entry->DIR_FstClusLO;
-
-    if (first_cluster == 0) {
+    int out_fd = fileno(fs->out);
+    ssize_t result;
+    if (raw && out_fd >= 0) {
+        /* Raw mode hands the extents to the kernel to copy to the output
+         * descriptor; output without one goes through the buffer below */
+        fflush(fs->out);
+        result = fat32_sendfile(fs, out_fd, fd, size);
+    } else {
+        /* Print through the readahead buffer, a bounded chunk at a time */
+        uint32_t chunk = size < TRANSFER_BUFFER_SIZE ?
+                         size : TRANSFER_BUFFER_SIZE;
+        uint8_t *buffer = malloc(chunk ? chunk : 1);
+        uint32_t bytes_read = 0;
+        result = 0;
+        while (buffer) {
+            uint32_t want = size - bytes_read < chunk ?
+                            size - bytes_read : chunk;
+            result = fat32_read(fs, fd, buffer, want);
+            if (result <= 0) {
+                break;
+            }
+            fwrite(buffer, 1, result, fs->out);
+            bytes_read += result;
+            if (bytes_read == size) {
+                break;
+            }
+        }
         free(buffer);
-        free(entry);
-        return;
     }
 
-    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
-                                  fs->boot_sector.BPB_SecPerClus;
-    uint32_t cluster_num = current_offset / bytes_per_cluster;
-    uint32_t offset_in_cluster = current_offset % bytes_per_cluster;
-
-    /* Navigate to starting cluster */
-    uint32_t current_cluster = first_cluster;
-    for (uint32_t i = 0; i < cluster_num && is_valid_cluster(fs, current_cluster);
-         i++) {
-        current_cluster = get_fat_entry(fs, current_cluster);
+    if (result == FAT32_ERR_ACCESS) {
+        fprintf(fs->out, "Error: File is not open for reading\n");
     }
+}
 
-    /* Read data cluster by cluster */
-    while (bytes_read < bytes_to_read && is_valid_cluster(fs, current_cluster)) {
-        uint32_t sector = get_first_sector_of_cluster(fs, current_cluster);
-        uint32_t bytes_in_cluster = bytes_per_cluster - offset_in_cluster;
-        if (bytes_read + bytes_in_cluster > bytes_to_read) {
-            bytes_in_cluster = bytes_to_read - bytes_read;
+/* write command */
+void cmd_write(FileSystem *fs, const char *filename, const char *string) {
+    int fd = shell_fd(fs, filename, "write to");
+    if (fd < 0) {
+        return;
+    }
+
+    ssize_t result = fat32_write(fs, fd, string, strlen(string));
+    switch (result) {
+    case FAT32_ERR_ACCESS:
+        fprintf(fs->out, "Error: File is not open for writing\n");
+        break;
+    case FAT32_ERR_CORRUPT:
+        fprintf(fs->out, "Error: Corrupt cluster chain\n");
+        break;
+    case FAT32_ERR_NO_SPACE:
+        fprintf(fs->out, "Error: No free clusters available\n");
+        break;
+    case FAT32_ERR_IO:
+        fprintf(fs->out, "Error: Failed to write file data\n");
+        break;
+    default:
+        if (result < 0) {
+            fprintf(fs->out, "Error: %s\n", fat32_strerror(result));
         }
-
-        fseek(fs->image, sector * fs->boot_sector.BPB_BytsPerSec +
-              offset_in_cluster, SEEK_SET);
-        fread(buffer + bytes_read, 1, bytes_in_cluster, fs->image);
-
-        bytes_read += bytes_in_cluster;
-        offset_in_cluster = 0;
-        current_cluster = get_fat_entry(fs, current_cluster);
+        break;
     }
+}
 
-    /* Print data */
-    for (uint32_t i = 0; i < bytes_read; i++) {
-        printf("%c", buffer[i]);
+/* mv command */
+void cmd_mv(FileSystem *fs, const char *source, const char *dest) {
+    int result = fat32_rename(fs, source, dest);
+    switch (result) {
+    case FAT32_OK:
+        break;
+    case FAT32_ERR_NOT_FOUND:
+        fprintf(fs->out, "Error: Source does not exist\n");
+        break;
+    case FAT32_ERR_OPEN:
+        fprintf(fs->out, "Error: File must be closed\n");
+        break;
+    case FAT32_ERR_NO_PARENT:
+        fprintf(fs->out, "Error: Destination does not exist\n");
+        break;
+    case FAT32_ERR_NOT_DIR:
+        fprintf(fs->out, "Error: Destination is a file\n");
+        break;
+    case FAT32_ERR_EXISTS:
+        fprintf(fs->out, "Error: File already exists in destination\n");
+        break;
+    case FAT32_ERR_LOOP:
+        fprintf(fs->out, "Error: Cannot move a directory into itself\n");
+        break;
+    case FAT32_ERR_INVALID_NAME:
+        fprintf(fs->out, "Error: Invalid name\n");
+        break;
+    case FAT32_ERR_IO:
+        fprintf(fs->out, "Error: Failed to rename entry\n");
+        break;
+    default:
+        fprintf(fs->out, "Error: %s\n", fat32_strerror(result));
+        break;
     }
-
-    /* Update offset */
-    file->offset += bytes_read;
-
-    free(buffer);
-    free(entry);
 }
 
-/* write command */
-void cmd_write(FileSystem *fs, const char *filename, const char *string) {
-    /* Check if file exists */
-    DirEntry *entry = find_entry(fs, fs->current_cluster, filename);
-    if (!entry) {
-        printf("Error: File does not exist\n");
-        return;
+/* rm command */
+void cmd_rm(FileSystem *fs, const char *filename) {
+    int result = fat32_unlink(fs, filename);
+    switch (result) {
+    case FAT32_OK:
+        break;
+    case FAT32_ERR_NOT_FOUND:
+        fprintf(fs->out, "Error: File does not exist\n");
+        break;
+    case FAT32_ERR_IS_DIR:
+        fprintf(fs->out, "Error: Cannot remove a directory\n");
+        break;
+    case FAT32_ERR_OPEN:
+        fprintf(fs->out, "Error: File is open\n");
+        break;
+    default:
+        fprintf(fs->out, "Error: %s\n", fat32_strerror(result));
+        break;
     }
+}
 
-    if (entry->DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: Cannot write to a directory\n");
-        free(entry);
-        return;
+/* rmdir command */
+void cmd_rmdir(FileSystem *fs, const char *dirname) {
+    Fat32Stat st;
+    int result = fat32_rmdir(fs, dirname);
+    switch (result) {
+    case FAT32_OK:
+        break;
+    case FAT32_ERR_NOT_FOUND:
+        fprintf(fs->out, "Error: Directory does not exist\n");
+        break;
+    case FAT32_ERR_NOT_DIR:
+        fprintf(fs->out, "Error: Not a directory\n");
+        break;
+    case FAT32_ERR_NOT_EMPTY:
+        fprintf(fs->out, "Error: Directory is not empty\n");
+        break;
+    case FAT32_ERR_BUSY:
+        if (fat32_stat(fs, dirname, &st) == FAT32_OK &&
+            st.cluster == fs->current_cluster) {
+            fprintf(fs->out, "Error: Cannot remove the current directory\n");
+        } else {
+            fprintf(fs->out, "Error: Directory is in use by another client\n");
+        }
+        break;
+    case FAT32_ERR_OPEN:
+        fprintf(fs->out, "Error: A file is open in this directory\n");
+        break;
+    default:
+        fprintf(fs->out, "Error: %s\n", fat32_strerror(result));
+        break;
     }
+}
 
-    OpenFile *file = find_open_file(fs, filename);
-    if (!file) {
-        printf("Error: File is not open\n");
-        free(entry);
+/* compact command */
+void cmd_compact(FileSystem *fs, const char *dirname) {
+    uint32_t freed;
+    int reclaimed = fat32_compact(fs, dirname, &freed);
+    switch (reclaimed) {
+    case FAT32_ERR_NOT_FOUND:
+        fprintf(fs->out, "Error: Directory does not exist\n");
+        return;
+    case FAT32_ERR_NOT_DIR:
+        fprintf(fs->out, "Error: Not a directory\n");
         return;
     }
-
-    if (strchr(file->mode, 'w') == NULL) {
-        printf("Error: File is not open for writing\n");
-        free(entry);
+    if (reclaimed < 0) {
+        fprintf(fs->out, "Error: Failed to compact directory\n");
         return;
     }
+    fprintf(fs->out, "%d slots reclaimed, %u clusters freed\n", reclaimed,
+            freed);
+}
 
-    uint32_t string_len = strlen(string);
-    uint32_t new_size = file->offset + string_len;
-    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
-                                  fs->boot_sector.BPB_SecPerClus;
-
-    uint32_t first_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) |
-                             entry->DIR_FstClusLO;
+/* Print a one-line fragmentation summary */
+static void print_defrag_stats(FILE *out, const char *label,
+                               const DefragStats *stats) {
+    fprintf(out, "%s%u files, %u fragmented, %u extents (ideal %u), "
+            "%u clusters\n", label, stats->chains, stats->fragmented,
+            stats->extents, stats->chains, stats->clusters);
+}
 
-    /* Allocate first cluster if needed */
-    if (first_cluster == 0 && string_len > 0) {
-        first_cluster = allocate_cluster(fs);
-        if (first_cluster == 0) {
-            printf("Error: No free clusters available\n");
-            free(entry);
+/* defrag command */
+void cmd_defrag(FileSystem *fs, const char *option) {
+    int analyze = 0;
+    if (option) {
+        if (strcmp(option, "-a") != 0) {
+            fprintf(fs->out, "Error: Invalid option\n");
             return;
         }
-        entry->DIR_FstClusHI = (first_cluster >> 16) & 0xFFFF;
-        entry->DIR_FstClusLO = first_cluster & 0xFFFF;
+        analyze = 1;
     }
 
-    /* Calculate clusters needed */
-    uint32_t clusters_needed = (new_size + bytes_per_cluster - 1) /
-                               bytes_per_cluster;
-    uint32_t clusters_allocated = 0;
-
-    /* Count current clusters */
-    if (first_cluster != 0) {
-        uint32_t temp = first_cluster;
-        while (is_valid_cluster(fs, temp)) {
-            clusters_allocated++;
-            temp = get_fat_entry(fs, temp);
-        }
+    DefragPlan plan;
+    DefragStats before, after;
+    if (defrag_scan(fs, &plan) < 0) {
+        fprintf(fs->out, "Error: Failed to scan file system\n");
+        return;
     }
+    defrag_stats(&plan, &before);
 
-    /* Allocate more clusters if needed */
-    if (clusters_needed > clusters_allocated) {
-        uint32_t last_cluster = first_cluster;
-        if (last_cluster != 0) {
-            uint32_t temp = get_fat_entry(fs, last_cluster);
-            while (is_valid_cluster(fs, temp)) {
-                last_cluster = temp;
-                temp = get_fat_entry(fs, last_cluster);
-            }
-        }
-
-        for (uint32_t i = clusters_allocated; i < clusters_needed; i++) {
-            uint32_t new_cluster = allocate_cluster(fs);
-            if (new_cluster == 0) {
-                printf("Error: No free clusters available\n");
-                free(entry);
-                return;
-            }
-            if (last_cluster != 0) {
-                set_fat_entry(fs, last_cluster, new_cluster);
+    if (analyze) {
+        for (uint32_t i = 0; i < plan.count; i++) {
+            DefragChain *chain = &plan.chains[i];
+            if (chain->extents > 1 || chain->fixed) {
+                fprintf(fs->out, "%s\t%u clusters\t%u extents%s\n", chain->path,
+                        chain->clusters, chain->extents,
+                        chain->fixed ? "\tcross-linked" : "");
             }
-            last_cluster = new_cluster;
         }
+        print_defrag_stats(fs->out, "", &before);
+        defrag_free(&plan);
+        return;
     }
 
-    /* Write data */
-    uint32_t bytes_written = 0;
-    uint32_t current_offset = file->offset;
-    uint32_t cluster_num = current_offset / bytes_per_cluster;
-    uint32_t offset_in_cluster = current_offset % bytes_per_cluster;
-
-    /* Navigate to starting cluster */
-    uint32_t current_cluster = first_cluster;
-    for (uint32_t i = 0; i < cluster_num && is_valid_cluster(fs, current_cluster);
-         i++) {
-        current_cluster = get_fat_entry(fs, current_cluster);
+    uint32_t moved;
+    int result = defrag_run(fs, &plan, &moved);
+    defrag_free(&plan);
+    if (result < 0) {
+        fprintf(fs->out, "Error: Failed to defragment file system\n");
+        return;
     }
 
-    /* Write data cluster by cluster */
-    while (bytes_written < string_len && is_valid_cluster(fs, current_cluster)) {
-        uint32_t sector = get_first_sector_of_cluster(fs, current_cluster);
-        uint32_t bytes_in_cluster = bytes_per_cluster - offset_in_cluster;
-        if (bytes_written + bytes_in_cluster > string_len) {
-            bytes_in_cluster = string_len - bytes_written;
-        }
-
-        fseek(fs->image, sector * fs->boot_sector.BPB_BytsPerSec +
-              offset_in_cluster, SEEK_SET);
-        fwrite(string + bytes_written, 1, bytes_in_cluster, fs->image);
-
-        bytes_written += bytes_in_cluster;
-        offset_in_cluster = 0;
-        current_cluster = get_fat_entry(fs, current_cluster);
+    /* Measure the result from the image rather than the plan */
+    if (defrag_scan(fs, &plan) < 0) {
+        fprintf(fs->out, "Error: Failed to scan file system\n");
+        return;
     }
+    defrag_stats(&plan, &after);
+    defrag_free(&plan);
 
-    fflush(fs->image);
-
-    /* Update file size if needed */
-    if (new_size > entry->DIR_FileSize) {
-        entry->DIR_FileSize = new_size;
-        file->size = new_size;
-
-        /* Update directory entry */
-        char formatted_name[12];
-        format_filename(filename, formatted_name);
+    print_defrag_stats(fs->out, "Before: ", &before);
+    print_defrag_stats(fs->out, "After:  ", &after);
+    fprintf(fs->out, "%u clusters moved\n", moved);
+    if (after.fixed) {
+        fprintf(fs->out, "%u cross-linked chains left in place\n", after.fixed);
+    }
+}
 
-        int num_entries;
-        DirEntry *entries = read_directory(fs, fs->current_cluster, &num_entries);
-        for (int i = 0; i < num_entries; i++) {
-            if (memcmp(entries[i].DIR_Name, formatted_name, 11) == 0) {
-                entries[i].DIR_FileSize = new_size;
-                entries[i].DIR_FstClusHI = (first_cluster >> 16) & 0xFFFF;
-                entries[i].DIR_FstClusLO = first_cluster & 0xFFFF;
-                write_directory_entry(fs, fs->current_cluster, &entries[i], i);
-                break;
-            }
-        }
-        free(entries);
+/* put command: copy a host file into the image */
+void cmd_put(FileSystem *fs, const char *host_path, const char *filename) {
+    Fat32Stat st;
+    if (fat32_stat(fs, filename, &st) == FAT32_OK) {
+        fprintf(fs->out, "Error: Directory/file already exists\n");
+        return;
     }
 
-    /* Update offset */
-    file->offset += string_len;
+    int fd = open(host_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(fs->out, "Error: Cannot open host file\n");
+        return;
+    }
+    int result = fat32_import(fs, filename, fd);
+    close(fd);
 
-    free(entry);
+    switch (result) {
+    case FAT32_ERR_INVALID:
+        fprintf(fs->out, "Error: Cannot open host file\n");
+        break;
+    case FAT32_ERR_TOO_LARGE:
+        fprintf(fs->out, "Error: File too large for FAT32\n");
+        break;
+    case FAT32_ERR_IO:
+        fprintf(fs->out, "Error: Failed to copy file data\n");
+        break;
+    default:
+        print_create_error(fs, result, "file entry");
+        break;
+    }
 }
 
-/* mv command */
-void cmd_mv(FileSystem *fs, const char *source, const char *dest) {
-    /* Check if source exists */
-    DirEntry *src_entry = find_entry(fs, fs->current_cluster, source);
-    if (!src_entry) {
-        printf("Error: Source does not exist\n");
+/* get command: copy a file out of the image to the host */
+void cmd_get(FileSystem *fs, const char *filename, const char *host_path) {
+    Fat32Stat st;
+    if (fat32_stat(fs, filename, &st) != FAT32_OK) {
+        fprintf(fs->out, "Error: File does not exist\n");
+        return;
+    }
+    if (st.is_dir) {
+        fprintf(fs->out, "Error: Cannot read a directory\n");
         return;
     }
 
-    /* Check if file is open */
-    if (!(src_entry->DIR_Attr & ATTR_DIRECTORY)) {
-        if (find_open_file(fs, source)) {
-            printf("Error: File must be closed\n");
-            free(src_entry);
-            return;
-        }
+    int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(fs->out, "Error: Cannot create host file\n");
+        return;
     }
+    ssize_t result = fat32_export(fs, filename, fd);
+    if (result < 0 || (uint32_t)result < st.size) {
+        fprintf(fs->out, "Error: Failed to copy file data\n");
+    }
+    close(fd);
+}
 
-    /* Check if destination exists */
-    DirEntry *dest_entry = find_entry(fs, fs->current_cluster, dest);
+/* Helper: Print the error of truncate or fallocate */
+static void print_resize_error(FileSystem *fs, int result) {
+    switch (result) {
+    case FAT32_OK:
+        break;
+    case FAT32_ERR_NOT_FOUND:
+        fprintf(fs->out, "Error: File does not exist\n");
+        break;
+    case FAT32_ERR_IS_DIR:
+        fprintf(fs->out, "Error: Cannot resize a directory\n");
+        break;
+    case FAT32_ERR_BUSY:
+        fprintf(fs->out, "Error: File is open by another client\n");
+        break;
+    case FAT32_ERR_NO_SPACE:
+        fprintf(fs->out, "Error: No free clusters available\n");
+        break;
+    default:
+        fprintf(fs->out, "Error: %s\n", fat32_strerror(result));
+        break;
+    }
+}
 
-    if (dest_entry) {
-        /* Destination exists - check if it's a directory */
-        if (!(dest_entry->DIR_Attr & ATTR_DIRECTORY)) {
-            printf("Error: Destination is a file\n");
-            free(src_entry);
-            free(dest_entry);
-            return;
-        }
+/* truncate command */
+void cmd_truncate(FileSystem *fs, const char *filename, uint32_t size) {
+    print_resize_error(fs, fat32_truncate(fs, filename, size));
+}
 
-        /* Move into directory */
-        uint32_t dest_cluster = ((uint32_t)dest_entry->DIR_FstClusHI << 16) |
-                                dest_entry->DIR_FstClusLO;
-
-        /* Check if already exists in destination */
-        DirEntry *existing = find_entry(fs, dest_cluster, source);
-        if (existing) {
-            printf("Error: File already exists in destination\n");
-            free(src_entry);
-            free(dest_entry);
-            free(existing);
-            return;
+/* fallocate command */
+void cmd_fallocate(FileSystem *fs, const char *filename, uint32_t size) {
+    print_resize_error(fs, fat32_fallocate(fs, filename, size));
+}
+
+/* fsck command */
+void cmd_fsck(FileSystem *fs, int repair, int threads) {
+    FsckReport report;
+    if (fsck_check(fs, threads, &report) < 0) {
+        fprintf(fs->out, "Error: Failed to check file system\n");
+        fsck_free(&report);
+        return;
+    }
+
+    for (uint32_t i = 0; i < report.count; i++) {
+        FsckProblem *problem = &report.problems[i];
+        switch (problem->type) {
+        case FSCK_CROSS_LINK:
+            fprintf(fs->out, "%s: cross-linked at cluster %u\n", problem->path,
+                    problem->cluster);
+            break;
+        case FSCK_BAD_LINK:
+            fprintf(fs->out, "%s: invalid cluster %u in chain\n", problem->path,
+                    problem->cluster);
+            break;
+        case FSCK_SHORT_CHAIN:
+            fprintf(fs->out, "%s: size %u exceeds its %u clusters\n",
+                    problem->path, problem->entry.DIR_FileSize, problem->kept);
+            break;
         }
+    }
+    if (report.lost_clusters > 0) {
+        fprintf(fs->out, "%u lost clusters in %u chains\n",
+                report.lost_clusters, report.lost_chains);
+    }
 
-        /* Create entry in destination */
-        uint32_t src_cluster = ((uint32_t)src_entry->DIR_FstClusHI << 16) |
-                               src_entry->DIR_FstClusLO;
-        if (create_directory_entry(fs, dest_cluster, source,
-                                   src_entry->DIR_Attr, src_cluster,
-                                   src_entry->DIR_FileSize) < 0) {
-            printf("Error: Failed to create entry in destination\n");
-            free(src_entry);
-            free(dest_entry);
-            return;
+    uint32_t problems = report.count + (report.lost_clusters > 0);
+    fprintf(fs->out, "%u files, %u directories, %u clusters checked with %d "
+            "threads: %u problems\n", report.files, report.directories,
+            report.clusters, report.threads, problems);
+    if (repair && problems > 0) {
+        fprintf(fs->out, "%d problems repaired\n", fsck_repair(fs, &report));
+        if (report.recovered > 0) {
+            fprintf(fs->out, "%u lost chains saved as /FOUND.nnn\n",
+                    report.recovered);
         }
+        if (report.lost_left > 0) {
+            fprintf(fs->out, "Error: %u lost clusters could not be saved\n",
+                    report.lost_left);
+        }
+    }
+    fsck_free(&report);
+}
 
-        free(dest_entry);
+/* Resolve the directory a walk starts at (default: current), giving its
+ * path with the names ls shows rather than as typed, like the walk does
+ * for everything below it */
+static int resolve_walk_start(FileSystem *fs, const char *dirname,
+                              uint32_t *cluster, char *abs_path) {
+    char typed[MAX_PATH_LENGTH];
+    if (!dirname) {
+        *cluster = fs->current_cluster;
+        strcpy(typed, fs->current_path);
     } else {
-        /* Simple rename */
-        char formatted_dest[12];
-        format_filename(dest, formatted_dest);
-
-        char formatted_src[12];
-        format_filename(source, formatted_src);
-
-        int num_entries;
-        DirEntry *entries = read_directory(fs, fs->current_cluster, &num_entries);
-        for (int i = 0; i < num_entries; i++) {
-            if (memcmp(entries[i].DIR_Name, formatted_src, 11) == 0) {
-                memcpy(entries[i].DIR_Name, formatted_dest, 11);
-                write_directory_entry(fs, fs->current_cluster, &entries[i], i);
-                break;
-            }
+        int result = resolve_directory(fs, dirname, cluster, typed);
+        if (result == PATH_NOT_FOUND) {
+            fprintf(fs->out, "Error: Directory does not exist\n");
+            return -1;
         }
-        free(entries);
-        free(src_entry);
-        return;
+        if (result == PATH_NOT_DIR) {
+            fprintf(fs->out, "Error: Not a directory\n");
+            return -1;
+        }
+    }
+    if (display_path(fs, typed, abs_path) != PATH_OK) {
+        strcpy(abs_path, typed);
     }
+    return 0;
+}
 
-    /* Delete from source */
-    delete_directory_entry(fs, fs->current_cluster, source);
-    free(src_entry);
+/* du visitor: print each directory once its subtree is summed */
+static void du_visit(void *context, const WalkItem *item, int post) {
+    if (post) {
+        fprintf(context, "%llu\t%s\n", (unsigned long long)item->bytes,
+                item->path);
+    }
 }
 
-/* rm command */
-void cmd_rm(FileSystem *fs, const char *filename) {
-    /* Check if file exists */
-    DirEntry *entry = find_entry(fs, fs->current_cluster, filename);
-    if (!entry) {
-        printf("Error: File does not exist\n");
+/* du command */
+void cmd_du(FileSystem *fs, const char *dirname) {
+    uint32_t cluster;
+    char abs_path[MAX_PATH_LENGTH];
+    if (resolve_walk_start(fs, dirname, &cluster, abs_path) < 0) {
         return;
     }
+    if (walk_tree(fs, cluster, abs_path, 0, du_visit, fs->out) < 0) {
+        fprintf(fs->out, "Error: Failed to walk directory tree\n");
+    }
+}
 
-    if (entry->DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: Cannot remove a directory\n");
-        free(entry);
+/* State of a tree listing */
+typedef struct {
+    uint8_t *more;          /* more[d]: the ancestor at depth d has later siblings */
+    uint32_t capacity;
+    uint32_t files;
+    uint32_t directories;
+    FILE *out;
+} TreeListing;
+
+/* tree visitor: print each entry under its ancestors' branch lines */
+static void tree_visit(void *context, const WalkItem *item, int post) {
+    TreeListing *listing = context;
+    if (post) {
         return;
     }
-
-    /* Check if file is open */
-    if (find_open_file(fs, filename)) {
-        printf("Error: File is open\n");
-        free(entry);
+    if (item->depth == 0) {
+        fprintf(listing->out, "%s\n", item->path);
         return;
     }
 
-    /* Free cluster chain */
-    uint32_t first_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) |
-                             entry->DIR_FstClusLO;
-    if (first_cluster != 0) {
-        free_cluster_chain(fs, first_cluster);
+    if (item->depth >= listing->capacity) {
+        uint32_t capacity = listing->capacity ? listing->capacity * 2 : 32;
+        while (capacity <= item->depth) {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(listing->more, capacity);
+        if (!grown) {
+            return;
+        }
+        listing->more = grown;
+        listing->capacity = capacity;
     }
+    for (uint32_t d = 1; d < item->depth; d++) {
+        fputs(listing->more[d] ? "|   " : "    ", listing->out);
+    }
+    fprintf(listing->out, "%s%s\n", item->last ? "`-- " : "|-- ",
+            item->name);
+    listing->more[item->depth] = !item->last;
 
-    /* Delete directory entry */
-    delete_directory_entry(fs, fs->current_cluster, filename);
-
-    free(entry);
+    if (item->entry->DIR_Attr & ATTR_DIRECTORY) {
+        listing->directories++;
+    } else {
+        listing->files++;
+    }
 }
 
-/* rmdir command */
-void cmd_rmdir(FileSystem *fs, const char *dirname) {
-    /* Check if directory exists */
-    DirEntry *entry = find_entry(fs, fs->current_cluster, dirname);
-    if (!entry) {
-        printf("Error: Directory does not exist\n");
+/* tree command */
+void cmd_tree(FileSystem *fs, const char *dirname) {
+    uint32_t cluster;
+    char abs_path[MAX_PATH_LENGTH];
+    if (resolve_walk_start(fs, dirname, &cluster, abs_path) < 0) {
         return;
     }
 
-    if (!(entry->DIR_Attr & ATTR_DIRECTORY)) {
-        printf("Error: Not a directory\n");
-        free(entry);
+    TreeListing listing;
+    memset(&listing, 0, sizeof(TreeListing));
+    listing.out = fs->out;
+    int result = walk_tree(fs, cluster, abs_path, 0, tree_visit, &listing);
+    free(listing.more);
+    if (result < 0) {
+        fprintf(fs->out, "Error: Failed to walk directory tree\n");
         return;
     }
+    fprintf(fs->out, "\n%u directories, %u files\n", listing.directories,
+            listing.files);
+}
 
-    uint32_t dir_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) |
-                           entry->DIR_FstClusLO;
+/* State of a find */
+typedef struct {
+    const char *pattern;
+    FILE *out;
+} FindQuery;
 
-    /* Check if directory is empty */
-    if (!is_directory_empty(fs, dir_cluster)) {
-        printf("Error: Directory is not empty\n");
-        free(entry);
-        return;
+/* find visitor: print the path of every entry whose name matches */
+static void find_visit(void *context, const WalkItem *item, int post) {
+    FindQuery *query = context;
+    if (!post && item->depth > 0 && walk_match(query->pattern, item->name)) {
+        fprintf(query->out, "%s\n", item->path);
     }
+}
 
-    /* Check if any files are open in this directory */
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (fs->open_files[i].is_open) {
-            /* Build expected path */
-            char expected_path[MAX_PATH_LENGTH + 20];
-            if (strcmp(fs->current_path, "/") == 0) {
-                snprintf(expected_path, sizeof(expected_path), "/%s", dirname);
-            } else {
-                snprintf(expected_path, sizeof(expected_path), "%s/%s",
-                         fs->current_path, dirname);
-            }
-            if (strncmp(fs->open_files[i].path, expected_path,
-                       strlen(expected_path)) == 0) {
-                printf("Error: A file is open in this directory\n");
-                free(entry);
-                return;
-            }
-        }
+/* find command */
+void cmd_find(FileSystem *fs, const char *pattern, const char *dirname) {
+    uint32_t cluster;
+    char abs_path[MAX_PATH_LENGTH];
+    if (resolve_walk_start(fs, dirname, &cluster, abs_path) < 0) {
+        return;
     }
-
-    /* Free cluster chain */
-    if (dir_cluster != 0) {
-        free_cluster_chain(fs, dir_cluster);
+    FindQuery query = { pattern, fs->out };
+    if (walk_tree(fs, cluster, abs_path, 0, find_visit, &query) < 0) {
+        fprintf(fs->out, "Error: Failed to walk directory tree\n");
     }
-
-    /* Delete directory entry */
-    delete_directory_entry(fs, fs->current_cluster, dirname);
-
-    free(entry);
 }
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/defrag.h"
+#include "../include/dirindex.h"
+#include "../include/path.h"
+
+/* Append a chain to the plan; returns its index or -1 */
+static int plan_add(DefragPlan *plan, const char *parent_path,
+                    const char *name) {
+    if (plan->count == plan->capacity) {
+        uint32_t capacity = plan->capacity ? plan->capacity * 2 : 64;
+        DefragChain *chains = realloc(plan->chains,
+                                      capacity * sizeof(DefragChain));
+        if (!chains) {
+            return -1;
+        }
+        plan->chains = chains;
+        plan->capacity = capacity;
+    }
+
+    /* Join the parent's path and the name */
+    size_t parent_length = parent_path ? strlen(parent_path) : 0;
+    char *path = malloc(parent_length + strlen(name) + 2);
+    if (!path) {
+        return -1;
+    }
+    if (parent_length > 1) {
+        sprintf(path, "%s/%s", parent_path, name);
+    } else if (parent_path) {
+        sprintf(path, "/%s", name);
+    } else {
+        strcpy(path, name);
+    }
+
+    DefragChain *chain = &plan->chains[plan->count];
+    memset(chain, 0, sizeof(DefragChain));
+    chain->path = path;
+    chain->parent = -1;
+    return plan->count++;
+}
+
+/* Count a chain's clusters and extents and claim its clusters in the
+ * owner map. A chain running into clusters already claimed (by another
+ * chain or by itself) is marked fixed, as is the other owner. */
+static void chain_measure(FileSystem *fs, DefragPlan *plan, uint32_t *owner,
+                          uint32_t index) {
+    DefragChain *chain = &plan->chains[index];
+    uint32_t cluster = chain->first;
+    uint32_t previous = 0;
+
+    while (is_valid_cluster(fs, cluster)) {
+        if (owner[cluster]) {
+            plan->chains[owner[cluster] - 1].fixed = 1;
+            chain->fixed = 1;
+            return;
+        }
+        owner[cluster] = index + 1;
+        if (cluster != previous + 1) {
+            chain->extents++;
+        }
+        chain->clusters++;
+        previous = cluster;
+        cluster = get_fat_entry(fs, cluster);
+    }
+}
+
+/* Build a plan of every chain reachable from the root directory */
+int defrag_scan(FileSystem *fs, DefragPlan *plan) {
+    memset(plan, 0, sizeof(DefragPlan));
+
+    uint32_t *owner = calloc(fs->total_clusters + 2, sizeof(uint32_t));
+    if (!owner || plan_add(plan, NULL, "/") < 0) {
+        free(owner);
+        return -1;
+    }
+    plan->chains[0].first = fs->root_cluster;
+    plan->chains[0].is_dir = 1;
+    chain_measure(fs, plan, owner, 0);
+
+    /* Breadth-first, so a directory is always listed before its entries */
+    char name[MAX_NAME_LENGTH];
+    for (uint32_t i = 0; i < plan->count; i++) {
+        if (!plan->chains[i].is_dir || plan->chains[i].fixed) {
+            continue;
+        }
+
+        DirIterator it;
+        DirEntry *entry;
+        int slot;
+        dir_iter_open(fs, &it, plan->chains[i].first);
+        while ((entry = dir_iter_next_named(&it, &slot, name)) != NULL) {
+            uint32_t first = ((uint32_t)entry->DIR_FstClusHI << 16) |
+                             entry->DIR_FstClusLO;
+            if (entry->DIR_Name[0] == '.' || (entry->DIR_Attr & ATTR_VOLUME_ID) ||
+                first == 0) {
+                continue;
+            }
+
+            int index = plan_add(plan, plan->chains[i].path, name);
+            if (index < 0) {
+                dir_iter_close(&it);
+                free(owner);
+                defrag_free(plan);
+                return -1;
+            }
+            DefragChain *chain = &plan->chains[index];
+            chain->entry = *entry;
+            chain->parent = i;
+            chain->slot = slot;
+            chain->first = first;
+            chain->is_dir = (entry->DIR_Attr & ATTR_DIRECTORY) != 0;
+            chain_measure(fs, plan, owner, index);
+        }
+        dir_iter_close(&it);
+    }
+
+    free(owner);
+    return 0;
+}
+
+/* Summarize the fragmentation of a plan */
+void defrag_stats(const DefragPlan *plan, DefragStats *stats) {
+    memset(stats, 0, sizeof(DefragStats));
+    for (uint32_t i = 0; i < plan->count; i++) {
+        const DefragChain *chain = &plan->chains[i];
+        stats->chains++;
+        stats->extents += chain->extents;
+        stats->clusters += chain->clusters;
+        if (chain->extents > 1) {
+            stats->fragmented++;
+        }
+        if (chain->fixed) {
+            stats->fixed++;
+        }
+    }
+}
+
+/* Release a plan */
+void defrag_free(DefragPlan *plan) {
+    for (uint32_t i = 0; i < plan->count; i++) {
+        free(plan->chains[i].path);
+    }
+    free(plan->chains);
+    memset(plan, 0, sizeof(DefragPlan));
+}
+
+/* Number of clusters of a chain already in place if it were laid out
+ * from target on, or -1 if a cluster of that range belongs to something
+ * else */
+static int64_t target_fit(FileSystem *fs, const uint32_t *clusters,
+                          uint32_t count, uint32_t target) {
+    if (target < 2 || (uint64_t)target + count > fs->total_clusters + 2) {
+        return -1;
+    }
+
+    int64_t in_place = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (clusters[i] == target + i) {
+            in_place++;
+        } else if (get_fat_entry(fs, target + i) != 0) {
+            return -1;
+        }
+    }
+    return in_place;
+}
+
+/* Run of a chain, for ranking layout candidates (also used for ranking
+ * chains by size) */
+typedef struct {
+    uint32_t index;
+    uint32_t length;
+} ChainRun;
+
+/* Order runs longest first */
+static int run_compare(const void *a, const void *b) {
+    const ChainRun *x = a, *y = b;
+    return (x->length < y->length) - (x->length > y->length);
+}
+
+/* Pick the first cluster of a contiguous home for a chain: the layout
+ * that keeps the most clusters where they are (anchored on one of the
+ * chain's longest runs), else the first free run that is long enough.
+ * The root directory must keep its first cluster. Returns 0 if there is
+ * no such place. */
+static uint32_t choose_target(FileSystem *fs, const uint32_t *clusters,
+                              uint32_t count, int pinned, ChainRun *runs) {
+    if (pinned) {
+        return target_fit(fs, clusters, count, clusters[0]) >= 0 ?
+               clusters[0] : 0;
+    }
+
+    uint32_t num_runs = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i == 0 || clusters[i] != clusters[i - 1] + 1) {
+            runs[num_runs].index = i;
+            runs[num_runs].length = 0;
+            num_runs++;
+        }
+        runs[num_runs - 1].length++;
+    }
+    qsort(runs, num_runs, sizeof(ChainRun), run_compare);
+
+    uint32_t best = 0;
+    int64_t best_in_place = -1;
+    for (uint32_t r = 0; r < num_runs && r < DEFRAG_CANDIDATES; r++) {
+        uint32_t index = runs[r].index;
+        if (clusters[index] < index) {
+            continue;
+        }
+        uint32_t target = clusters[index] - index;
+        int64_t in_place = target_fit(fs, clusters, count, target);
+        if (in_place > best_in_place) {
+            best = target;
+            best_in_place = in_place;
+        }
+    }
+    if (best_in_place >= 0) {
+        return best;
+    }
+
+    uint32_t length;
+    uint32_t target = find_free_run(fs, 2, count, &length);
+    return length >= count ? target : 0;
+}
+
+/* Point one of a directory's "." or ".." entries at cluster */
+static void set_dot_entry(FileSystem *fs, uint32_t dir, uint32_t slot,
+                          uint32_t cluster) {
+    DirIterator it;
+    DirEntry *entry;
+    DirEntry dot;
+    int index;
+    int found = 0;
+
+    dir_iter_open(fs, &it, dir);
+    while ((entry = dir_iter_next_raw(&it, &index)) != NULL &&
+           (uint32_t)index <= slot) {
+        if ((uint32_t)index == slot && entry->DIR_Name[0] == '.') {
+            dot = *entry;
+            found = 1;
+        }
+    }
+    dir_iter_close(&it);
+
+    if (found) {
+        dot.DIR_FstClusHI = (cluster >> 16) & 0xFFFF;
+        dot.DIR_FstClusLO = cluster & 0xFFFF;
+        write_directory_entry(fs, dir, &dot, slot);
+    }
+}
+
+/* Repoint everything that refers to a chain by its first cluster */
+static void chain_rebase(FileSystem *fs, DefragPlan *plan, uint32_t index,
+                         uint32_t old_first) {
+    DefragChain *chain = &plan->chains[index];
+    uint32_t first = chain->first;
+
+    /* The entry naming the chain */
+    chain->entry.DIR_FstClusHI = (first >> 16) & 0xFFFF;
+    chain->entry.DIR_FstClusLO = first & 0xFFFF;
+    write_directory_entry(fs, plan->chains[chain->parent].first, &chain->entry,
+                          chain->slot);
+
+    /* Open files and current directories of every session */
+    pthread_mutex_lock(&fs->volume->session_lock);
+    for (FileSystem *session = fs->volume; session;
+         session = session->next_session) {
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            OpenFile *file = &session->open_files[i];
+            if (!file->is_open) {
+                continue;
+            }
+            if (!chain->is_dir && file->first_cluster == old_first) {
+                file->first_cluster = first;
+            }
+            if (chain->is_dir && file->dir_cluster == old_first) {
+                file->dir_cluster = first;
+            }
+        }
+        if (chain->is_dir && session->current_cluster == old_first) {
+            session->current_cluster = first;
+        }
+    }
+    pthread_mutex_unlock(&fs->volume->session_lock);
+
+    if (!chain->is_dir) {
+        return;
+    }
+
+    /* The directory's own "." and its subdirectories' ".." */
+    set_dot_entry(fs, first, 0, first);
+    for (uint32_t i = index + 1; i < plan->count; i++) {
+        if (plan->chains[i].parent == (int32_t)index && plan->chains[i].is_dir) {
+            set_dot_entry(fs, plan->chains[i].first, 1, first);
+        }
+    }
+    dcache_purge_cluster(fs, old_first);
+}
+
+/* Move a chain into one contiguous run. Only clusters not already at
+ * their place in the run are copied, and the FAT is not touched until
+ * all data is in place. Returns 1 if the chain was moved, 0 if there was
+ * no room for it, -1 on error. */
+static int chain_relocate(FileSystem *fs, DefragPlan *plan, uint32_t index,
+                          uint8_t *buffer, uint32_t batch, uint32_t *moved) {
+    DefragChain *chain = &plan->chains[index];
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t count = chain->clusters;
+    int result = -1;
+
+    uint32_t *clusters = malloc(count * sizeof(uint32_t));
+    ChainRun *runs = malloc(count * sizeof(ChainRun));
+    if (!clusters || !runs) {
+        goto out;
+    }
+
+    uint32_t cluster = chain->first;
+    for (uint32_t i = 0; i < count; i++) {
+        clusters[i] = cluster;
+        cluster = get_fat_entry(fs, cluster);
+    }
+
+    uint32_t target = choose_target(fs, clusters, count, index == 0, runs);
+    if (target == 0) {
+        result = 0;
+        goto out;
+    }
+
+    /* Copy the displaced clusters, a physically contiguous batch at a time */
+    for (uint32_t i = 0; i < count; ) {
+        if (clusters[i] == target + i) {
+            i++;
+            continue;
+        }
+        uint32_t length = 1;
+        while (i + length < count && length < batch &&
+               clusters[i + length] == clusters[i] + length &&
+               clusters[i + length] != target + i + length) {
+            length++;
+        }
+        size_t bytes = (size_t)length * bytes_per_cluster;
+        if (image_read(fs, sector_offset(fs, get_first_sector_of_cluster(fs, clusters[i])),
+                       buffer, bytes) < 0 ||
+            image_write(fs, sector_offset(fs, get_first_sector_of_cluster(fs, target + i)),
+                        buffer, bytes) < 0) {
+            goto out;
+        }
+        *moved += length;
+        i += length;
+    }
+
+    /* Link the new run, then release the clusters left outside it */
+    if (chain->is_dir) {
+        dir_index_drop(fs, chain->first);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        set_fat_entry(fs, target + i, i + 1 < count ? target + i + 1 : 0x0FFFFFFF);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (clusters[i] < target || clusters[i] >= target + count) {
+            set_fat_entry(fs, clusters[i], 0);
+        }
+    }
+
+    /* Open files cache the old layout */
+    pthread_mutex_lock(&fs->volume->session_lock);
+    for (FileSystem *session = fs->volume; session;
+         session = session->next_session) {
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            if (session->open_files[i].is_open &&
+                session->open_files[i].first_cluster == chain->first) {
+                free_extent_map(&session->open_files[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->volume->session_lock);
+
+    uint32_t old_first = chain->first;
+    chain->first = target;
+    chain->extents = 1;
+    if (target != old_first) {
+        chain_rebase(fs, plan, index, old_first);
+    }
+    result = 1;
+
+out:
+    free(clusters);
+    free(runs);
+    return result;
+}
+
+/* Make every fragmented chain of a plan contiguous where free space
+ * allows. Larger chains are placed first; chains that find no room are
+ * retried once others have moved out of the way. *moved receives the
+ * number of clusters copied. */
+int defrag_run(FileSystem *fs, DefragPlan *plan, uint32_t *moved) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t batch = DEFRAG_BATCH_BYTES / bytes_per_cluster;
+    if (batch == 0) {
+        batch = 1;
+    }
+
+    *moved = 0;
+
+    ChainRun *pending = malloc((plan->count ? plan->count : 1) * sizeof(ChainRun));
+    uint8_t *buffer = malloc((size_t)batch * bytes_per_cluster);
+    if (!pending || !buffer) {
+        free(pending);
+        free(buffer);
+        return -1;
+    }
+
+    uint32_t num_pending = 0;
+    for (uint32_t i = 0; i < plan->count; i++) {
+        if (plan->chains[i].extents > 1 && !plan->chains[i].fixed) {
+            pending[num_pending].index = i;
+            pending[num_pending].length = plan->chains[i].clusters;
+            num_pending++;
+        }
+    }
+    qsort(pending, num_pending, sizeof(ChainRun), run_compare);
+
+    int result = 0;
+    for (int pass = 0; pass < DEFRAG_PASSES && num_pending > 0; pass++) {
+        uint32_t left = 0;
+        for (uint32_t i = 0; i < num_pending; i++) {
+            int status = chain_relocate(fs, plan, pending[i].index, buffer,
+                                        batch, moved);
+            if (status < 0) {
+                result = -1;
+                goto out;
+            }
+            if (status == 0) {
+                pending[left++] = pending[i];
+            }
+        }
+        if (left == num_pending) {
+            break;
+        }
+        num_pending = left;
+    }
+
+out:
+    free(pending);
+    free(buffer);
+    return result;
+}
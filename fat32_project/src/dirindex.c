@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/dirindex.h"
+#include "../include/lfn.h"
+
+#define DIR_INDEX_MIN_BUCKETS 16
+
+/* FNV-1a hash of an 11-byte short name */
+static uint32_t name_hash(const uint8_t *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Check whether a raw directory slot holds a live short-name entry */
+static int entry_is_live(const DirEntry *entry) {
+    return entry->DIR_Name[0] != 0x00 && entry->DIR_Name[0] != 0xE5 &&
+           entry->DIR_Attr != ATTR_LONG_NAME;
+}
+
+/* Free an index and everything it owns */
+static void index_free(DirIndex *index) {
+    for (uint32_t r = 0; r < index->count; r++) {
+        free(index->records[r].long_name);
+    }
+    free(index->records);
+    free(index->buckets);
+    free(index->long_buckets);
+    free(index->slots);
+    free(index->free_slots);
+    free(index->chain);
+    free(index);
+}
+
+/* Link record r into the short-name and long-name buckets */
+static void index_link(DirIndex *index, int32_t r) {
+    DirIndexRecord *record = &index->records[r];
+    uint32_t b = name_hash(record->entry.DIR_Name) & index->bucket_mask;
+    record->next = index->buckets[b];
+    index->buckets[b] = r;
+    record->long_next = -1;
+    if (record->long_name) {
+        b = lfn_hash(record->long_name) & index->bucket_mask;
+        record->long_next = index->long_buckets[b];
+        index->long_buckets[b] = r;
+    }
+}
+
+/* Resize the name hashes to buckets entries and relink every record */
+static int index_rehash(DirIndex *index, uint32_t buckets) {
+    int32_t *table = malloc(buckets * sizeof(int32_t));
+    int32_t *long_table = malloc(buckets * sizeof(int32_t));
+    if (!table || !long_table) {
+        free(table);
+        free(long_table);
+        return -1;
+    }
+    for (uint32_t i = 0; i < buckets; i++) {
+        table[i] = -1;
+        long_table[i] = -1;
+    }
+    free(index->buckets);
+    free(index->long_buckets);
+    index->buckets = table;
+    index->long_buckets = long_table;
+    index->bucket_mask = buckets - 1;
+    for (uint32_t r = 0; r < index->count; r++) {
+        index_link(index, r);
+    }
+    return 0;
+}
+
+/* Make slot addressable in the slot and free-slot maps */
+static int index_reserve_slot(DirIndex *index, uint32_t slot) {
+    if (slot < index->num_slots) {
+        return 0;
+    }
+    uint32_t num_slots = index->num_slots ? index->num_slots : 64;
+    while (num_slots <= slot) {
+        num_slots *= 2;
+    }
+    int32_t *slots = realloc(index->slots, num_slots * sizeof(int32_t));
+    if (!slots) {
+        return -1;
+    }
+    index->slots = slots;
+    uint64_t *free_slots = realloc(index->free_slots,
+                                   num_slots / 64 * sizeof(uint64_t));
+    if (!free_slots) {
+        return -1;
+    }
+    index->free_slots = free_slots;
+
+    for (uint32_t i = index->num_slots; i < num_slots; i++) {
+        slots[i] = -1;
+    }
+    memset(free_slots + index->num_slots / 64, 0,
+           (num_slots - index->num_slots) / 64 * sizeof(uint64_t));
+    index->num_slots = num_slots;
+    return 0;
+}
+
+/* Mark a slot below the end marker as deleted or occupied */
+static void index_mark_free(DirIndex *index, uint32_t slot, int is_free) {
+    uint64_t bit = 1ULL << (slot % 64);
+    int was_free = (index->free_slots[slot / 64] & bit) != 0;
+    if (is_free) {
+        index->free_slots[slot / 64] |= bit;
+        index->free_count += !was_free;
+        if (slot < index->first_free) {
+            index->first_free = slot;
+        }
+    } else {
+        index->free_slots[slot / 64] &= ~bit;
+        index->free_count -= was_free;
+    }
+}
+
+/* Append a cluster to the index's copy of the directory chain */
+static int index_push_cluster(DirIndex *index, uint32_t cluster) {
+    if (index->num_clusters == index->chain_capacity) {
+        uint32_t capacity = index->chain_capacity ? index->chain_capacity * 2 : 4;
+        uint32_t *chain = realloc(index->chain, capacity * sizeof(uint32_t));
+        if (!chain) {
+            return -1;
+        }
+        index->chain = chain;
+        index->chain_capacity = capacity;
+    }
+    index->chain[index->num_clusters++] = cluster;
+    return 0;
+}
+
+/* Unlink record r from its name buckets */
+static void index_unlink(DirIndex *index, int32_t r) {
+    DirIndexRecord *record = &index->records[r];
+    uint32_t b = name_hash(record->entry.DIR_Name) & index->bucket_mask;
+    int32_t *link = &index->buckets[b];
+    while (*link != r) {
+        link = &index->records[*link].next;
+    }
+    *link = record->next;
+
+    if (record->long_name) {
+        b = lfn_hash(record->long_name) & index->bucket_mask;
+        link = &index->long_buckets[b];
+        while (*link != r) {
+            link = &index->records[*link].long_next;
+        }
+        *link = record->long_next;
+    }
+}
+
+/* Remove the record stored for slot, if any. The last record is moved
+ * into the hole so the record array stays dense. */
+static void index_remove_slot(DirIndex *index, uint32_t slot) {
+    if (slot >= index->num_slots || index->slots[slot] < 0) {
+        return;
+    }
+    int32_t r = index->slots[slot];
+    int32_t last = index->count - 1;
+    index_unlink(index, r);
+    free(index->records[r].long_name);
+    index->slots[slot] = -1;
+
+    if (r != last) {
+        index_unlink(index, last);
+        index->records[r] = index->records[last];
+        index_link(index, r);
+        index->slots[index->records[r].slot] = r;
+    }
+    index->count--;
+}
+
+/* Add or replace the live entry stored in slot, with its long name (if
+ * any) starting at first_slot */
+static int index_insert(DirIndex *index, const DirEntry *entry, uint32_t slot,
+                        const char *long_name, uint32_t first_slot) {
+    if (index_reserve_slot(index, slot) < 0) {
+        return -1;
+    }
+    index_remove_slot(index, slot);
+
+    if (index->count == index->capacity) {
+        uint32_t capacity = index->capacity ? index->capacity * 2 : 16;
+        DirIndexRecord *records = realloc(index->records,
+                                          capacity * sizeof(DirIndexRecord));
+        if (!records) {
+            return -1;
+        }
+        index->records = records;
+        index->capacity = capacity;
+    }
+    if (index->count + 1 > index->bucket_mask + 1 &&
+        index_rehash(index, (index->bucket_mask + 1) * 2) < 0) {
+        return -1;
+    }
+
+    char *name_copy = NULL;
+    if (long_name && (name_copy = strdup(long_name)) == NULL) {
+        return -1;
+    }
+
+    int32_t r = index->count++;
+    index->records[r].entry = *entry;
+    index->records[r].slot = slot;
+    index->records[r].first_slot = name_copy ? first_slot : slot;
+    index->records[r].long_name = name_copy;
+    index_link(index, r);
+    index->slots[slot] = r;
+    return 0;
+}
+
+/* Record the directory's chain, then index every live entry (with the
+ * long name of a valid sequence before it) and deleted slot up to its
+ * end marker */
+static int index_build(FileSystem *fs, DirIndex *index) {
+    uint32_t cluster = index->cluster;
+    while (is_valid_cluster(fs, cluster) &&
+           index->num_clusters < fs->total_clusters) {
+        if (index_push_cluster(index, cluster) < 0) {
+            return -1;
+        }
+        cluster = get_fat_entry(fs, cluster);
+    }
+
+    DirIterator it;
+    DirEntry *entry;
+    int entry_index;
+    int result = 0;
+
+    dir_iter_open(fs, &it, index->cluster);
+    while ((entry = dir_iter_next_raw(&it, &entry_index)) != NULL) {
+        if (index_reserve_slot(index, entry_index) < 0) {
+            result = -1;
+            break;
+        }
+        if (entry->DIR_Name[0] == 0xE5) {
+            index_mark_free(index, entry_index, 1);
+        }
+        if (!entry_is_live(entry)) {
+            lfn_feed(&index->pending, entry, entry_index);
+            continue;
+        }
+
+        char long_name[MAX_NAME_LENGTH];
+        uint32_t first_slot;
+        int has_long = lfn_finish(&index->pending, entry, entry_index,
+                                  long_name, sizeof(long_name), &first_slot);
+        if (index_insert(index, entry, entry_index,
+                         has_long ? long_name : NULL, first_slot) < 0) {
+            result = -1;
+            break;
+        }
+    }
+    index->end_slot = it.slot;
+    dir_iter_close(&it);
+    return result;
+}
+
+/* Unlink an index from the LRU list */
+static void lru_unlink(DirIndex *index) {
+    index->lru_prev->lru_next = index->lru_next;
+    index->lru_next->lru_prev = index->lru_prev;
+}
+
+/* Insert an index at the most recently used end */
+static void lru_push_front(struct DirCache *cache, DirIndex *index) {
+    index->lru_prev = &cache->lru;
+    index->lru_next = cache->lru.lru_next;
+    cache->lru.lru_next->lru_prev = index;
+    cache->lru.lru_next = index;
+}
+
+/* Find the cached index of a directory without building it */
+static DirIndex *cache_find(struct DirCache *cache, uint32_t cluster) {
+    DirIndex *index = cache->table[cluster & (DIR_CACHE_BUCKETS - 1)];
+    while (index && index->cluster != cluster) {
+        index = index->hash_next;
+    }
+    return index;
+}
+
+/* Remove an index from the cache and free it, or leave that to the last
+ * dir_index_put while it is in use */
+static void cache_remove(struct DirCache *cache, DirIndex *index) {
+    DirIndex **link = &cache->table[index->cluster & (DIR_CACHE_BUCKETS - 1)];
+    while (*link != index) {
+        link = &(*link)->hash_next;
+    }
+    *link = index->hash_next;
+    lru_unlink(index);
+    cache->count--;
+    if (index->users > 0) {
+        index->dropped = 1;
+    } else {
+        index_free(index);
+    }
+}
+
+/* Set up an empty directory index cache */
+int dir_cache_init(FileSystem *fs) {
+    fs->dirs = calloc(1, sizeof(struct DirCache));
+    if (!fs->dirs) {
+        return -1;
+    }
+    fs->dirs->lru.lru_next = &fs->dirs->lru;
+    fs->dirs->lru.lru_prev = &fs->dirs->lru;
+    pthread_mutex_init(&fs->dirs->lock, NULL);
+    return 0;
+}
+
+/* Free every cached directory index */
+void dir_cache_destroy(FileSystem *fs) {
+    if (!fs->dirs) {
+        return;
+    }
+    while (fs->dirs->lru.lru_next != &fs->dirs->lru) {
+        cache_remove(fs->dirs, fs->dirs->lru.lru_next);
+    }
+    pthread_mutex_destroy(&fs->dirs->lock);
+    free(fs->dirs);
+    fs->dirs = NULL;
+}
+
+/* Return the cached index of a directory without building or touching
+ * it. A returned index must be given back with dir_index_put. */
+DirIndex *dir_index_peek(FileSystem *fs, uint32_t cluster) {
+    if (!fs->dirs) {
+        return NULL;
+    }
+    pthread_mutex_lock(&fs->dirs->lock);
+    DirIndex *index = cache_find(fs->dirs, cluster);
+    if (index) {
+        index->users++;
+    }
+    pthread_mutex_unlock(&fs->dirs->lock);
+    return index;
+}
+
+/* Give back an index from dir_index_get or dir_index_peek */
+void dir_index_put(FileSystem *fs, DirIndex *index) {
+    pthread_mutex_lock(&fs->dirs->lock);
+    if (--index->users == 0 && index->dropped) {
+        index_free(index);
+    }
+    pthread_mutex_unlock(&fs->dirs->lock);
+}
+
+/* Return the index of the directory starting at cluster, building it on
+ * first access. Returns NULL if it cannot be built. The caller holds the
+ * directory lock and gives the index back with dir_index_put. */
+DirIndex *dir_index_get(FileSystem *fs, uint32_t cluster) {
+    struct DirCache *cache = fs->dirs;
+    pthread_mutex_lock(&cache->lock);
+    DirIndex *index = cache_find(cache, cluster);
+    if (index) {
+        cache->hits++;
+        lru_unlink(index);
+        lru_push_front(cache, index);
+        index->users++;
+        pthread_mutex_unlock(&cache->lock);
+        return index;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    index = calloc(1, sizeof(DirIndex));
+    if (!index) {
+        return NULL;
+    }
+    index->cluster = cluster;
+    index->first_free = UINT32_MAX;
+    lfn_reset(&index->pending);
+    if (index_rehash(index, DIR_INDEX_MIN_BUCKETS) < 0 ||
+        index_build(fs, index) < 0) {
+        index_free(index);
+        return NULL;
+    }
+
+    /* Readers of the same directory may have built it meanwhile */
+    pthread_mutex_lock(&cache->lock);
+    DirIndex *built = cache_find(cache, cluster);
+    if (built) {
+        index_free(index);
+        index = built;
+    } else {
+        if (cache->count >= DIR_CACHE_MAX_DIRS) {
+            cache_remove(cache, cache->lru.lru_prev);
+        }
+        DirIndex **bucket = &cache->table[cluster & (DIR_CACHE_BUCKETS - 1)];
+        index->hash_next = *bucket;
+        *bucket = index;
+        lru_push_front(cache, index);
+        cache->count++;
+    }
+    index->users++;
+    pthread_mutex_unlock(&cache->lock);
+    return index;
+}
+
+/* Look up an 11-byte short name. Duplicates resolve to the first one in
+ * directory order, as a linear scan would. */
+DirIndexRecord *dir_index_lookup(DirIndex *index, const char *formatted_name) {
+    DirIndexRecord *found = NULL;
+    uint32_t b = name_hash((const uint8_t *)formatted_name) & index->bucket_mask;
+    for (int32_t r = index->buckets[b]; r >= 0; r = index->records[r].next) {
+        DirIndexRecord *record = &index->records[r];
+        if (memcmp(record->entry.DIR_Name, formatted_name, 11) == 0 &&
+            (!found || record->slot < found->slot)) {
+            found = record;
+        }
+    }
+    return found;
+}
+
+/* Look up a name as typed: a matching long name first, then the short
+ * name if the name is a valid 8.3 name. Duplicates resolve to the first
+ * one in directory order, as a linear scan would. */
+DirIndexRecord *dir_index_find(DirIndex *index, const char *name) {
+    DirIndexRecord *found = NULL;
+    uint32_t b = lfn_hash(name) & index->bucket_mask;
+    for (int32_t r = index->long_buckets[b]; r >= 0;
+         r = index->records[r].long_next) {
+        DirIndexRecord *record = &index->records[r];
+        if (lfn_name_equal(record->long_name, name) &&
+            (!found || record->slot < found->slot)) {
+            found = record;
+        }
+    }
+    if (found || lfn_needed(name)) {
+        return found;
+    }
+
+    char formatted_name[12];
+    format_filename(name, formatted_name);
+    return dir_index_lookup(index, formatted_name);
+}
+
+/* Check whether slot lies inside the long-name sequence of a live entry;
+ * sequences are at most LFN_MAX_ENTRIES slots long and end at their
+ * entry, so only the first live entry after slot can own it */
+static int index_slot_owned(DirIndex *index, uint32_t slot) {
+    for (uint32_t s = slot + 1; s <= slot + LFN_MAX_ENTRIES &&
+                                s < index->end_slot; s++) {
+        if (index->slots[s] >= 0) {
+            return index->records[index->slots[s]].first_slot <= slot;
+        }
+    }
+    return 0;
+}
+
+/* Mirror a slot write into an index. Long-name slots written just before
+ * a short entry (in increasing slot order, as creating an entry does)
+ * give it its long name. */
+static void index_update(FileSystem *fs, DirIndex *index,
+                         const DirEntry *entry, int entry_index) {
+    uint32_t slot = entry_index;
+
+    /* Writing the end marker, or past it, changes which slots count, and
+     * overwriting part of a long name changes an entry's name; rebuild on
+     * next use */
+    if (entry->DIR_Name[0] == 0x00 || slot > index->end_slot ||
+        index_reserve_slot(index, slot) < 0 ||
+        index_slot_owned(index, slot)) {
+        cache_remove(fs->dirs, index);
+        return;
+    }
+    if (slot == index->end_slot) {
+        index->end_slot++;
+    }
+    index_mark_free(index, slot, entry->DIR_Name[0] == 0xE5);
+
+    if (!entry_is_live(entry)) {
+        index_remove_slot(index, slot);
+        lfn_feed(&index->pending, entry, slot);
+        return;
+    }
+
+    /* A rewritten entry keeps its long name while the checksum matches */
+    char long_name[MAX_NAME_LENGTH];
+    uint32_t first_slot = slot;
+    int has_long = lfn_finish(&index->pending, entry, slot, long_name,
+                              sizeof(long_name), &first_slot);
+    int32_t r = index->slots[slot];
+    if (!has_long && r >= 0 && index->records[r].long_name &&
+        lfn_checksum(index->records[r].entry.DIR_Name) ==
+        lfn_checksum(entry->DIR_Name)) {
+        strcpy(long_name, index->records[r].long_name);
+        first_slot = index->records[r].first_slot;
+        has_long = 1;
+    }
+    if (index_insert(index, entry, slot, has_long ? long_name : NULL,
+                     first_slot) < 0) {
+        cache_remove(fs->dirs, index);
+    }
+}
+
+/* Mirror a slot write into the directory's index, if it has one */
+void dir_index_update(FileSystem *fs, uint32_t cluster, const DirEntry *entry,
+                      int entry_index) {
+    if (!fs->dirs) {
+        return;
+    }
+    pthread_mutex_lock(&fs->dirs->lock);
+    DirIndex *index = cache_find(fs->dirs, cluster);
+    if (index) {
+        index_update(fs, index, entry, entry_index);
+    }
+    pthread_mutex_unlock(&fs->dirs->lock);
+}
+
+/* Forget the index of a directory whose clusters are being freed */
+void dir_index_drop(FileSystem *fs, uint32_t cluster) {
+    if (!fs->dirs) {
+        return;
+    }
+    pthread_mutex_lock(&fs->dirs->lock);
+    DirIndex *index = cache_find(fs->dirs, cluster);
+    if (index) {
+        cache_remove(fs->dirs, index);
+    }
+    pthread_mutex_unlock(&fs->dirs->lock);
+}
+
+/* Pick where count consecutive new slots (a long name and its entry)
+ * should go: the lowest run of deleted slots long enough, possibly running
+ * into the end marker, or the end marker itself. The directory grows by
+ * whole clusters when the run reaches past its chain. Runs in constant
+ * time for directories without holes. */
+int dir_index_free_run(FileSystem *fs, DirIndex *index, uint32_t count) {
+    uint32_t start = index->end_slot;
+    uint32_t run = 0, run_start = 0;
+    uint32_t slot = index->first_free;
+    int seen_free = 0;
+
+    while (slot < index->end_slot) {
+        uint64_t bits = index->free_slots[slot / 64] >> (slot % 64);
+        if (bits & 1) {
+            if (!seen_free) {
+                index->first_free = slot;
+                seen_free = 1;
+            }
+            if (run++ == 0) {
+                run_start = slot;
+            }
+            if (run == count) {
+                start = run_start;
+                break;
+            }
+            slot++;
+        } else {
+            run = 0;
+            slot += bits ? (uint32_t)__builtin_ctzll(bits) : 64 - slot % 64;
+        }
+    }
+    if (!seen_free) {
+        index->first_free = index->end_slot;
+    }
+    /* A run of holes just before the end marker continues past it */
+    if (slot >= index->end_slot && run > 0) {
+        start = run_start;
+    }
+
+    /* Extend the chain until it holds the whole run */
+    uint32_t per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                           fs->boot_sector.BPB_SecPerClus / DIR_ENTRY_SIZE;
+    while (start + count > index->num_clusters * per_cluster) {
+        uint32_t new_cluster = allocate_cluster(fs);
+        if (new_cluster == 0) {
+            return -1;
+        }
+        if (index->num_clusters > 0) {
+            set_fat_entry(fs, index->chain[index->num_clusters - 1],
+                          new_cluster);
+        }
+        if (index_push_cluster(index, new_cluster) < 0) {
+            pthread_mutex_lock(&fs->dirs->lock);
+            if (!index->dropped) {
+                cache_remove(fs->dirs, index);
+            }
+            pthread_mutex_unlock(&fs->dirs->lock);
+            return -1;
+        }
+    }
+    return start;
+}
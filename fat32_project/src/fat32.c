@@ -3,20 +3,92 @@
 #include <string.h>
 #include <ctype.h>
 #include "../include/fat32.h"
+#include "../include/dirindex.h"
+#include "../include/path.h"
+#include "../include/lfn.h"
+
+/* Candidate "~N" aliases tried before creating a long name fails */
+#define MAX_ALIAS_ATTEMPTS 999999
 
 /* Mount the FAT32 image */
-int mount_image(FileSystem *fs, const char *image_path) {
-    fs->image = fopen(image_path, "r+b");
-    if (!fs->image) {
+int mount_image(FileSystem *fs, const char *image_path,
+                const MountOptions *options) {
+    int backend = options ? options->backend : BACKEND_PREAD;
+    uint32_t cache_sectors = options ? options->cache_sectors :
+                                       DEFAULT_CACHE_SECTORS;
+
+    fs->dev = NULL;
+    fs->fat = NULL;
+    fs->cache = NULL;
+    fs->dirs = NULL;
+    fs->dentries = NULL;
+    fs->out = stdout;
+    fs->volume = fs;
+    fs->next_session = NULL;
+    pthread_mutex_init(&fs->session_lock, NULL);
+    pthread_mutex_init(&fs->open_lock, NULL);
+
+    /* Initialize open files */
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_file_init(&fs->open_files[i]);
+    }
+
+    fs->dir_locks = malloc(sizeof(DirLockTable));
+    if (!fs->dir_locks) {
+        close_image(fs);
+        return -1;
+    }
+    dir_locks_init(fs->dir_locks);
+
+    fs->dev = malloc(sizeof(BlockDevice));
+    if (!fs->dev) {
+        close_image(fs);
+        return -1;
+    }
+    if (bdev_open(fs->dev, image_path, backend) < 0) {
+        free(fs->dev);
+        fs->dev = NULL;
+        close_image(fs);
         return -1;
     }
 
     /* Read boot sector */
-    fseek(fs->image, 0, SEEK_SET);
-    if (fread(&fs->boot_sector, sizeof(BootSector), 1, fs->image) != 1) {
-        fclose(fs->image);
+    uint8_t sector[DEFAULT_SECTOR_SIZE];
+    if (bdev_read(fs->dev, 0, 1, sector) < 0) {
+        close_image(fs);
+        return -1;
+    }
+    memcpy(&fs->boot_sector, sector, sizeof(BootSector));
+
+    uint32_t bytes_per_sector = fs->boot_sector.BPB_BytsPerSec;
+    if (bytes_per_sector < DEFAULT_SECTOR_SIZE ||
+        bytes_per_sector > MAX_SECTOR_SIZE ||
+        (bytes_per_sector & (bytes_per_sector - 1)) != 0 ||
+        fs->boot_sector.BPB_SecPerClus == 0) {
+        close_image(fs);
+        return -1;
+    }
+    fs->dev->sector_size = bytes_per_sector;
+
+    /* Fall back to synchronous I/O quietly if io_uring is unavailable */
+    if (options && options->io_engine != IO_ENGINE_SYNC) {
+        bdev_set_io_engine(fs->dev, options->io_engine);
+    }
+
+    /* The mapping already serves every access from memory */
+    if (backend == BACKEND_MMAP) {
+        cache_sectors = 0;
+    }
+    fs->cache = malloc(sizeof(BufferCache));
+    if (!fs->cache || cache_init(fs->cache, fs->dev, cache_sectors) < 0) {
+        free(fs->cache);
+        fs->cache = NULL;
+        close_image(fs);
         return -1;
     }
+    cache_set_write_back(fs->cache, options ? options->write_back : 0,
+                         DEFAULT_DIRTY_LIMIT);
+    fs->compact_threshold = options ? options->compact_threshold : 0;
 
     /* Calculate important values */
     fs->fat_start_sector = fs->boot_sector.BPB_RsvdSecCnt;
@@ -27,369 +99,2092 @@ int mount_image(FileSystem *fs, const char *image_path) {
     fs->current_cluster = fs->root_cluster;
     
     uint32_t total_sectors = fs->boot_sector.BPB_TotSec32;
+    uint64_t fat_sectors = (uint64_t)fs->boot_sector.BPB_NumFATs *
+                           fs->boot_sector.BPB_FATSz32;
+
+    /* A FAT too small for the two reserved entries, or no room left for
+     * data, is not a FAT32 volume */
+    if (fat_sectors == 0 ||
+        (uint64_t)fs->boot_sector.BPB_FATSz32 * bytes_per_sector / 4 < 2 ||
+        fs->boot_sector.BPB_RsvdSecCnt + fat_sectors >= total_sectors) {
+        close_image(fs);
+        return -1;
+    }
     uint32_t data_sectors = total_sectors - fs->data_start_sector;
     fs->total_clusters = data_sectors / fs->boot_sector.BPB_SecPerClus;
 
+    /* Load the FAT into memory */
+    if (load_fat(fs) < 0) {
+        close_image(fs);
+        return -1;
+    }
+    if (fs->total_clusters + 2 > fs->fat->num_entries) {
+        fs->total_clusters = fs->fat->num_entries - 2;
+    }
+
+    /* Build the free-cluster bitmap */
+    if (build_free_map(fs) < 0) {
+        close_image(fs);
+        return -1;
+    }
+
+    if (dir_cache_init(fs) < 0 || dcache_init(fs) < 0) {
+        close_image(fs);
+        return -1;
+    }
+
     strcpy(fs->current_path, "/");
     
     /* Extract image name from path */
     const char *slash = strrchr(image_path, '/');
     strcpy(fs->image_name, slash ? slash + 1 : image_path);
 
-    /* Initialize open files */
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        fs->open_files[i].is_open = 0;
-    }
-
     return 0;
 }
 
 /* Close the image */
 void close_image(FileSystem *fs) {
-    if (fs->image) {
-        fclose(fs->image);
-        fs->image = NULL;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_file_destroy(&fs->open_files[i]);
+    }
+    if (fs->fat && fs->fat->free_map) {
+        fs_sync(fs);
     }
+    dir_cache_destroy(fs);
+    dcache_destroy(fs);
+    if (fs->fat) {
+        if (!fs->fat->mapped) {
+            free(fs->fat->entries);
+        }
+        free(fs->fat->dirty);
+        free(fs->fat->free_map);
+        pthread_mutex_destroy(&fs->fat->lock);
+        free(fs->fat);
+        fs->fat = NULL;
+    }
+    if (fs->cache) {
+        cache_destroy(fs->cache);
+        free(fs->cache);
+        fs->cache = NULL;
+    }
+    if (fs->dev) {
+        bdev_close(fs->dev);
+        free(fs->dev);
+        fs->dev = NULL;
+    }
+    if (fs->dir_locks) {
+        dir_locks_destroy(fs->dir_locks);
+        free(fs->dir_locks);
+        fs->dir_locks = NULL;
+    }
+    pthread_mutex_destroy(&fs->open_lock);
+    pthread_mutex_destroy(&fs->session_lock);
 }
 
-/* Get FAT entry for a cluster */
-uint32_t get_fat_entry(FileSystem *fs, uint32_t cluster) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fs->fat_start_sector + 
-                          (fat_offset / fs->boot_sector.BPB_BytsPerSec);
-    uint32_t entry_offset = fat_offset % fs->boot_sector.BPB_BytsPerSec;
+/* Attach a session to a mounted file system: it shares the image and
+ * every cache, and starts at the root with no open files, printing to
+ * stdout. Only the shared pointers and the geometry, which do not change
+ * once mounted, are copied from the volume. */
+void session_open(FileSystem *volume, FileSystem *session) {
+    memset(session, 0, sizeof(FileSystem));
+    session->dev = volume->dev;
+    session->cache = volume->cache;
+    session->fat = volume->fat;
+    session->dirs = volume->dirs;
+    session->dentries = volume->dentries;
+    session->dir_locks = volume->dir_locks;
+    session->boot_sector = volume->boot_sector;
+    memcpy(session->image_name, volume->image_name,
+           sizeof(session->image_name));
+    session->data_start_sector = volume->data_start_sector;
+    session->fat_start_sector = volume->fat_start_sector;
+    session->root_cluster = volume->root_cluster;
+    session->total_clusters = volume->total_clusters;
+    session->compact_threshold = volume->compact_threshold;
+    session->volume = volume;
+    session->current_cluster = volume->root_cluster;
+    strcpy(session->current_path, "/");
+    session->out = stdout;
+    pthread_mutex_init(&session->open_lock, NULL);
+    pthread_mutex_init(&session->session_lock, NULL);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_file_init(&session->open_files[i]);
+    }
 
-    fseek(fs->image, fat_sector * fs->boot_sector.BPB_BytsPerSec + entry_offset,
-          SEEK_SET);
-    uint32_t entry;
-    fread(&entry, 4, 1, fs->image);
-    return entry & 0x0FFFFFFF;
+    /* Other sessions may look at it as soon as it is linked */
+    pthread_mutex_lock(&volume->session_lock);
+    session->next_session = volume->next_session;
+    volume->next_session = session;
+    pthread_mutex_unlock(&volume->session_lock);
 }
 
-/* Set FAT entry for a cluster */
-void set_fat_entry(FileSystem *fs, uint32_t cluster, uint32_t value) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t entry_offset = fat_offset % fs->boot_sector.BPB_BytsPerSec;
-
-    value = value & 0x0FFFFFFF;
-    
-    /* Write to both FATs */
-    for (int i = 0; i < fs->boot_sector.BPB_NumFATs; i++) {
-        uint32_t fat_base = fs->fat_start_sector + 
-                            (i * fs->boot_sector.BPB_FATSz32);
-        fseek(fs->image, 
-              (fat_base + (fat_offset / fs->boot_sector.BPB_BytsPerSec)) * 
-              fs->boot_sector.BPB_BytsPerSec + entry_offset, SEEK_SET);
-        fwrite(&value, 4, 1, fs->image);
+/* Detach a session from its file system, closing its open files */
+void session_close(FileSystem *session) {
+    FileSystem *volume = session->volume;
+    pthread_mutex_lock(&volume->session_lock);
+    FileSystem **link = &volume->next_session;
+    while (*link && *link != session) {
+        link = &(*link)->next_session;
     }
-    fflush(fs->image);
-}
-
-/* Get first sector of a cluster */
-uint32_t get_first_sector_of_cluster(FileSystem *fs, uint32_t cluster) {
-    return ((cluster - 2) * fs->boot_sector.BPB_SecPerClus) + 
-           fs->data_start_sector;
-}
+    if (*link) {
+        *link = session->next_session;
+    }
+    pthread_mutex_unlock(&volume->session_lock);
 
-/* Check if cluster is valid */
-int is_valid_cluster(FileSystem *fs, uint32_t cluster) {
-    return cluster >= 2 && cluster < (fs->total_clusters + 2) &&
-           cluster < 0x0FFFFFF8;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_file_destroy(&session->open_files[i]);
+    }
+    pthread_mutex_destroy(&session->open_lock);
+    pthread_mutex_destroy(&session->session_lock);
 }
 
-/* Read directory entries from a cluster */
-DirEntry *read_directory(FileSystem *fs, uint32_t cluster, int *num_entries) {
-    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec * 
-                                  fs->boot_sector.BPB_SecPerClus;
-    int max_entries = bytes_per_cluster / DIR_ENTRY_SIZE;
-    DirEntry *entries = malloc(max_entries * sizeof(DirEntry) * 16);
-    int entry_count = 0;
+/* Read len bytes at a byte offset in the image */
+int image_read(FileSystem *fs, uint64_t offset, void *buffer, size_t len) {
+    uint32_t sector_size = fs->dev->sector_size;
+    uint8_t *out = buffer;
 
-    uint32_t current_cluster = cluster;
-    while (is_valid_cluster(fs, current_cluster)) {
-        uint32_t sector = get_first_sector_of_cluster(fs, current_cluster);
-        fseek(fs->image, sector * fs->boot_sector.BPB_BytsPerSec, SEEK_SET);
+    if (offset + len > fs->dev->size) {
+        return -1;
+    }
+    if (fs->dev->map) {
+        memcpy(buffer, fs->dev->map + offset, len);
+        return 0;
+    }
 
-        for (int i = 0; i < max_entries; i++) {
-            DirEntry entry;
-            fread(&entry, sizeof(DirEntry), 1, fs->image);
+    while (len > 0) {
+        uint64_t sector = offset / sector_size;
+        uint32_t skip = offset % sector_size;
+        size_t n;
 
-            if (entry.DIR_Name[0] == 0x00) {
-                *num_entries = entry_count;
-                return entries;
+        if (skip == 0 && len >= sector_size) {
+            /* Whole sectors go straight into the caller's buffer */
+            uint32_t count = (len / sector_size > 65536) ?
+                             65536 : len / sector_size;
+            if (cache_read(fs->cache, sector, count, out) < 0) {
+                return -1;
             }
-
-            if (entry.DIR_Name[0] == 0xE5) {
-                continue;
+            n = (size_t)count * sector_size;
+        } else {
+            uint8_t bounce[MAX_SECTOR_SIZE];
+            if (cache_read(fs->cache, sector, 1, bounce) < 0) {
+                return -1;
             }
-
-            if (entry.DIR_Attr == ATTR_LONG_NAME) {
-                continue;
+            n = sector_size - skip;
+            if (n > len) {
+                n = len;
             }
-
-            entries[entry_count++] = entry;
+            memcpy(out, bounce + skip, n);
         }
 
-        current_cluster = get_fat_entry(fs, current_cluster);
+        out += n;
+        offset += n;
+        len -= n;
     }
-
-    *num_entries = entry_count;
-    return entries;
+    return 0;
 }
 
-/* Find directory entry by name */
-DirEntry *find_entry(FileSystem *fs, uint32_t cluster, const char *name) {
-    char formatted_name[12];
-    format_filename(name, formatted_name);
-
-    int num_entries;
-    DirEntry *entries = read_directory(fs, cluster, &num_entries);
+/* Write len bytes at a byte offset in the image */
+int image_write(FileSystem *fs, uint64_t offset, const void *buffer,
+                size_t len) {
+    uint32_t sector_size = fs->dev->sector_size;
+    const uint8_t *in = buffer;
 
-    for (int i = 0; i < num_entries; i++) {
-        if (memcmp(entries[i].DIR_Name, formatted_name, 11) == 0) {
-            DirEntry *result = malloc(sizeof(DirEntry));
-            *result = entries[i];
-            free(entries);
-            return result;
-        }
+    if (offset + len > fs->dev->size) {
+        return -1;
+    }
+    if (fs->dev->map) {
+        memcpy(fs->dev->map + offset, buffer, len);
+        return 0;
     }
 
-    free(entries);
-    return NULL;
-}
+    while (len > 0) {
+        uint64_t sector = offset / sector_size;
+        uint32_t skip = offset % sector_size;
+        size_t n;
 
-/* Format filename to FAT32 11-byte format */
-void format_filename(const char *input, char *output) {
-    memset(output, ' ', 11);
-    output[11] = '\0';
+        if (skip == 0 && len >= sector_size) {
+            uint32_t count = (len / sector_size > 65536) ?
+                             65536 : len / sector_size;
+            if (cache_write(fs->cache, sector, count, in) < 0) {
+                return -1;
+            }
+            n = (size_t)count * sector_size;
+        } else {
+            /* Partial sector: read-modify-write */
+            uint8_t bounce[MAX_SECTOR_SIZE];
+            if (cache_read(fs->cache, sector, 1, bounce) < 0) {
+                return -1;
+            }
+            n = sector_size - skip;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(bounce + skip, in, n);
+            if (cache_write(fs->cache, sector, 1, bounce) < 0) {
+                return -1;
+            }
+        }
 
-    if (strcmp(input, ".") == 0) {
-        output[0] = '.';
-        return;
-    }
-    if (strcmp(input, "..") == 0) {
-        output[0] = '.';
-        output[1] = '.';
-        return;
+        in += n;
+        offset += n;
+        len -= n;
     }
+    return 0;
+}
 
-    int i = 0, o = 0;
-    while (input[i] && input[i] != '.' && o < 8) {
-        output[o++] = toupper(input[i++]);
+/* Perform a batch of byte-range transfers, keeping the cache coherent */
+int image_submit(FileSystem *fs, IoRequest *requests, int count, int write) {
+    /* Write-back mode buffers data writes in the cache like metadata */
+    if (write && fs->cache->write_back) {
+        for (int i = 0; i < count; i++) {
+            if (image_write(fs, requests[i].offset, requests[i].buffer,
+                            requests[i].length) < 0) {
+                return -1;
+            }
+        }
+        return 0;
     }
 
-    if (input[i] == '.') {
-        i++;
-        o = 8;
-        while (input[i] && o < 11) {
-            output[o++] = toupper(input[i++]);
+    /* Another thread may write dirty sectors back while the device is
+     * read, leaving nothing to overlay on the stale copy; read again */
+    for (;;) {
+        uint64_t writebacks = cache_writebacks(fs->cache);
+        if (bdev_submit(fs->dev, requests, count, write) < 0) {
+            return -1;
+        }
+        int stale = 0;
+        for (int i = 0; i < count && !stale; i++) {
+            if (write) {
+                cache_patch(fs->cache, requests[i].offset, requests[i].buffer,
+                            requests[i].length);
+            } else {
+                stale = cache_overlay(fs->cache, requests[i].offset,
+                                      requests[i].buffer, requests[i].length,
+                                      writebacks) < 0;
+            }
+        }
+        if (!stale) {
+            return 0;
         }
     }
 }
 
-/* Parse FAT32 filename to readable format */
-void parse_filename(const char *formatted, char *output) {
-    int i = 0, o = 0;
-
-    /* Handle special cases */
-    if (formatted[0] == '.' && formatted[1] == ' ') {
-        output[0] = '.';
-        output[1] = '\0';
-        return;
+/* Write every buffered FAT, FSInfo and cached sector back to the image */
+int fs_flush(FileSystem *fs) {
+    int result = 0;
+    if (sync_fat(fs) < 0) {
+        result = -1;
     }
-    if (formatted[0] == '.' && formatted[1] == '.') {
-        output[0] = '.';
-        output[1] = '.';
-        output[2] = '\0';
-        return;
+    if (sync_fsinfo(fs) < 0) {
+        result = -1;
+    }
+    if (cache_flush(fs->cache) < 0) {
+        result = -1;
     }
+    return result;
+}
 
-    /* Copy name part */
-    for (i = 0; i < 8 && formatted[i] != ' '; i++) {
-        output[o++] = formatted[i];
+/* Flush everything and make it durable */
+int fs_sync(FileSystem *fs) {
+    int result = fs_flush(fs);
+    if (image_sync(fs) < 0) {
+        result = -1;
     }
+    return result;
+}
 
-    /* Copy extension part */
-    int has_ext = 0;
-    for (i = 8; i < 11 && formatted[i] != ' '; i++) {
-        if (!has_ext) {
-            output[o++] = '.';
-            has_ext = 1;
-        }
-        output[o++] = formatted[i];
+/* Finish a command: write-through mode flushes immediately, write-back
+ * mode only once the buffered dirty bytes reach the limit */
+int fs_commit(FileSystem *fs) {
+    BufferCache *cache = fs->cache;
+    if (!cache->write_back) {
+        return fs_flush(fs);
     }
 
-    output[o] = '\0';
+    pthread_mutex_lock(&fs->fat->lock);
+    uint32_t pending = fs->fat->dirty_count;
+    pthread_mutex_unlock(&fs->fat->lock);
+    pthread_mutex_lock(&cache->lock);
+    int full = cache->dirty_count + pending >= cache->dirty_limit;
+    pthread_mutex_unlock(&cache->lock);
+    return full ? fs_flush(fs) : 0;
 }
 
-/* Allocate a new cluster */
-uint32_t allocate_cluster(FileSystem *fs) {
-    for (uint32_t cluster = 2; cluster < fs->total_clusters + 2; cluster++) {
-        uint32_t entry = get_fat_entry(fs, cluster);
-        if (entry == 0) {
-            set_fat_entry(fs, cluster, 0x0FFFFFFF);
-            
-            /* Zero out the cluster */
-            uint32_t sector = get_first_sector_of_cluster(fs, cluster);
-            uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
-                                         fs->boot_sector.BPB_SecPerClus;
-            uint8_t *zero_buffer = calloc(bytes_per_cluster, 1);
-            fseek(fs->image, sector * fs->boot_sector.BPB_BytsPerSec, SEEK_SET);
-            fwrite(zero_buffer, bytes_per_cluster, 1, fs->image);
-            free(zero_buffer);
-            fflush(fs->image);
-            
-            return cluster;
-        }
-    }
-    return 0;
+/* Make image writes durable (fsync, or msync for the mapping) */
+int image_sync(FileSystem *fs) {
+    return bdev_sync(fs->dev);
 }
 
-/* Free a cluster chain */
-void free_cluster_chain(FileSystem *fs, uint32_t cluster) {
-    while (is_valid_cluster(fs, cluster)) {
-        uint32_t next = get_fat_entry(fs, cluster);
-        set_fat_entry(fs, cluster, 0);
-        cluster = next;
+/* Direct pointer into the mapped image, or NULL when not memory mapped */
+uint8_t *image_map(FileSystem *fs, uint64_t offset, size_t len) {
+    if (!fs->dev->map || offset + len > fs->dev->size) {
+        return NULL;
     }
+    return fs->dev->map + offset;
 }
 
-/* Write a directory entry */
-void write_directory_entry(FileSystem *fs, uint32_t cluster, DirEntry *entry,
-                          int entry_index) {
-    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
-                                  fs->boot_sector.BPB_SecPerClus;
-    int entries_per_cluster = bytes_per_cluster / DIR_ENTRY_SIZE;
+/* Byte offset of a sector in the image */
+uint64_t sector_offset(FileSystem *fs, uint32_t sector) {
+    return (uint64_t)sector * fs->boot_sector.BPB_BytsPerSec;
+}
 
-    uint32_t current_cluster = cluster;
-    int current_index = entry_index;
+/* Load the first FAT into memory (mapped in place for the mmap backend) */
+int load_fat(FileSystem *fs) {
+    uint32_t bytes_per_sector = fs->boot_sector.BPB_BytsPerSec;
+    FatTable *fat = calloc(1, sizeof(FatTable));
+    if (!fat) {
+        return -1;
+    }
+    if (mutex_init_recursive(&fat->lock) < 0) {
+        free(fat);
+        return -1;
+    }
 
-    while (current_index >= entries_per_cluster) {
-        current_index -= entries_per_cluster;
-        current_cluster = get_fat_entry(fs, current_cluster);
-        if (!is_valid_cluster(fs, current_cluster)) {
-            return;
+    fat->num_sectors = fs->boot_sector.BPB_FATSz32;
+    fat->num_entries = fat->num_sectors * bytes_per_sector / 4;
+    size_t fat_bytes = (size_t)fat->num_sectors * bytes_per_sector;
+    uint64_t fat_offset = sector_offset(fs, fs->fat_start_sector);
+
+    fat->entries = (uint32_t *)image_map(fs, fat_offset, fat_bytes);
+    fat->mapped = fat->entries != NULL;
+    if (!fat->mapped) {
+        fat->entries = malloc(fat_bytes);
+    }
+    fat->dirty = calloc(fat->num_sectors, 1);
+    if (!fat->entries || !fat->dirty ||
+        (!fat->mapped &&
+         image_read(fs, fat_offset, fat->entries, fat_bytes) < 0)) {
+        if (!fat->mapped) {
+            free(fat->entries);
         }
+        free(fat->dirty);
+        pthread_mutex_destroy(&fat->lock);
+        free(fat);
+        return -1;
     }
 
-    uint32_t sector = get_first_sector_of_cluster(fs, current_cluster);
-    uint32_t offset = sector * fs->boot_sector.BPB_BytsPerSec +
-                      current_index * DIR_ENTRY_SIZE;
-
-    fseek(fs->image, offset, SEEK_SET);
-    fwrite(entry, sizeof(DirEntry), 1, fs->image);
-    fflush(fs->image);
+    fs->fat = fat;
+    return 0;
 }
 
-/* Find free entry index in directory */
-int find_free_entry_index(FileSystem *fs, uint32_t cluster) {
-    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
-                                  fs->boot_sector.BPB_SecPerClus;
-    int max_entries = bytes_per_cluster / DIR_ENTRY_SIZE;
-    int entry_index = 0;
+/* Write dirty FAT sectors back to every FAT copy */
+static int sync_fat_locked(FileSystem *fs) {
+    FatTable *fat = fs->fat;
+    uint32_t bytes_per_sector = fs->boot_sector.BPB_BytsPerSec;
+    int result = 0;
 
-    uint32_t current_cluster = cluster;
-    while (is_valid_cluster(fs, current_cluster)) {
-        uint32_t sector = get_first_sector_of_cluster(fs, current_cluster);
-        fseek(fs->image, sector * fs->boot_sector.BPB_BytsPerSec, SEEK_SET);
+    if (fat->dirty_count == 0) {
+        return 0;
+    }
 
-        for (int i = 0; i < max_entries; i++) {
-            DirEntry entry;
-            fread(&entry, sizeof(DirEntry), 1, fs->image);
+    uint32_t sector = 0;
+    while (sector < fat->num_sectors) {
+        if (!fat->dirty[sector]) {
+            sector++;
+            continue;
+        }
 
-            if (entry.DIR_Name[0] == 0x00 || entry.DIR_Name[0] == 0xE5) {
-                return entry_index + i;
-            }
+        /* Coalesce a run of consecutive dirty sectors */
+        uint32_t run_start = sector;
+        while (sector < fat->num_sectors && fat->dirty[sector]) {
+            fat->dirty[sector++] = 0;
         }
+        uint32_t run_length = sector - run_start;
+        uint8_t *data = (uint8_t *)fat->entries +
+                        (size_t)run_start * bytes_per_sector;
 
-        entry_index += max_entries;
-        uint32_t next_cluster = get_fat_entry(fs, current_cluster);
-        if (!is_valid_cluster(fs, next_cluster)) {
-            /* Need to allocate new cluster */
-            next_cluster = allocate_cluster(fs);
-            if (next_cluster == 0) {
-                return -1;
+        /* A mapped first FAT is already up to date in place */
+        for (int i = fat->mapped ? 1 : 0;
+             i < fs->boot_sector.BPB_NumFATs; i++) {
+            uint32_t fat_base = fs->fat_start_sector +
+                                (i * fs->boot_sector.BPB_FATSz32);
+            if (image_write(fs, sector_offset(fs, fat_base + run_start), data,
+                            (size_t)run_length * bytes_per_sector) < 0) {
+                result = -1;
             }
-            set_fat_entry(fs, current_cluster, next_cluster);
         }
-        current_cluster = next_cluster;
     }
 
-    return entry_index;
+    fat->dirty_count = 0;
+    return result;
 }
 
-/* Create a directory entry */
-int create_directory_entry(FileSystem *fs, uint32_t parent_cluster,
-                          const char *name, uint8_t attr,
-                          uint32_t first_cluster, uint32_t size) {
-    int entry_index = find_free_entry_index(fs, parent_cluster);
-    if (entry_index < 0) {
+/* sync_fat_locked under the FAT lock */
+int sync_fat(FileSystem *fs) {
+    pthread_mutex_lock(&fs->fat->lock);
+    int result = sync_fat_locked(fs);
+    pthread_mutex_unlock(&fs->fat->lock);
+    return result;
+}
+
+/* Build the free-cluster bitmap from the in-memory FAT */
+int build_free_map(FileSystem *fs) {
+    FatTable *fat = fs->fat;
+    uint32_t end = fs->total_clusters + 2;
+
+    fat->free_words = (end + 63) / 64;
+    fat->free_map = calloc(fat->free_words, sizeof(uint64_t));
+    if (!fat->free_map) {
         return -1;
     }
 
-    DirEntry entry;
-    memset(&entry, 0, sizeof(DirEntry));
-    format_filename(name, (char *)entry.DIR_Name);
-    entry.DIR_Attr = attr;
-    entry.DIR_FstClusHI = (first_cluster >> 16) & 0xFFFF;
-    entry.DIR_FstClusLO = first_cluster & 0xFFFF;
-    entry.DIR_FileSize = size;
+    fat->free_count = 0;
+    for (uint32_t cluster = 2; cluster < end; cluster++) {
+        if ((fat->entries[cluster] & 0x0FFFFFFF) == 0) {
+            fat->free_map[cluster / 64] |= 1ULL << (cluster % 64);
+            fat->free_count++;
+        }
+    }
+
+    /* Seed the allocation cursor from FSInfo when it looks trustworthy */
+    fat->next_free = 2;
+    FSInfo info;
+    if (fs->boot_sector.BPB_FSInfo != 0 &&
+        image_read(fs, sector_offset(fs, fs->boot_sector.BPB_FSInfo), &info,
+                   sizeof(FSInfo)) == 0 &&
+        info.FSI_LeadSig == FSI_LEAD_SIG &&
+        info.FSI_StrucSig == FSI_STRUC_SIG &&
+        info.FSI_TrailSig == FSI_TRAIL_SIG) {
+        if (info.FSI_Nxt_Free != FSI_UNKNOWN &&
+            is_valid_cluster(fs, info.FSI_Nxt_Free)) {
+            fat->next_free = info.FSI_Nxt_Free;
+        }
+        /* A stale free count is corrected on unmount */
+        fat->fsinfo_dirty = info.FSI_Free_Count != fat->free_count;
+    }
 
-    write_directory_entry(fs, parent_cluster, &entry, entry_index);
     return 0;
 }
 
-/* Delete a directory entry */
-int delete_directory_entry(FileSystem *fs, uint32_t cluster, const char *name) {
-    char formatted_name[12];
-    format_filename(name, formatted_name);
+/* Write the free count and next-free hint back to the FSInfo sector */
+static int sync_fsinfo_locked(FileSystem *fs) {
+    FatTable *fat = fs->fat;
+    if (!fat->fsinfo_dirty || fs->boot_sector.BPB_FSInfo == 0) {
+        return 0;
+    }
 
-    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
-                                  fs->boot_sector.BPB_SecPerClus;
-    int max_entries = bytes_per_cluster / DIR_ENTRY_SIZE;
-    int entry_index = 0;
+    FSInfo info;
+    uint64_t offset = sector_offset(fs, fs->boot_sector.BPB_FSInfo);
+    if (image_read(fs, offset, &info, sizeof(FSInfo)) < 0 ||
+        info.FSI_LeadSig != FSI_LEAD_SIG ||
+        info.FSI_StrucSig != FSI_STRUC_SIG) {
+        return -1;
+    }
 
-    uint32_t current_cluster = cluster;
-    while (is_valid_cluster(fs, current_cluster)) {
-        uint32_t sector = get_first_sector_of_cluster(fs, current_cluster);
-        fseek(fs->image, sector * fs->boot_sector.BPB_BytsPerSec, SEEK_SET);
+    info.FSI_Free_Count = fat->free_count;
+    info.FSI_Nxt_Free = fat->next_free;
+    if (image_write(fs, offset, &info, sizeof(FSInfo)) < 0) {
+        return -1;
+    }
+    fat->fsinfo_dirty = 0;
+    return 0;
+}
+
+/* sync_fsinfo_locked under the FAT lock */
+int sync_fsinfo(FileSystem *fs) {
+    pthread_mutex_lock(&fs->fat->lock);
+    int result = sync_fsinfo_locked(fs);
+    pthread_mutex_unlock(&fs->fat->lock);
+    return result;
+}
 
-        for (int i = 0; i < max_entries; i++) {
-            DirEntry entry;
-            fread(&entry, sizeof(DirEntry), 1, fs->image);
+/* Find the first free cluster in [from, limit), or limit if none */
+static uint32_t next_free_in_range(FileSystem *fs, uint32_t from,
+                                   uint32_t limit) {
+    if (from >= limit) {
+        return limit;
+    }
 
-            if (entry.DIR_Name[0] == 0x00) {
-                return -1;
-            }
+    uint64_t *map = fs->fat->free_map;
+    uint32_t word = from / 64;
+    uint64_t bits = map[word] & (~0ULL << (from % 64));
 
-            if (memcmp(entry.DIR_Name, formatted_name, 11) == 0) {
-                entry.DIR_Name[0] = 0xE5;
-                write_directory_entry(fs, cluster, &entry, entry_index + i);
-                return 0;
-            }
+    while (word * 64 < limit) {
+        if (bits) {
+            uint32_t cluster = word * 64 + __builtin_ctzll(bits);
+            return cluster < limit ? cluster : limit;
         }
+        if (++word >= fs->fat->free_words) {
+            break;
+        }
+        bits = map[word];
+    }
+    return limit;
+}
 
-        entry_index += max_entries;
-        current_cluster = get_fat_entry(fs, current_cluster);
+/* Find a free cluster at or after start, wrapping around (0 if none) */
+static uint32_t find_free_cluster_locked(FileSystem *fs, uint32_t start) {
+    uint32_t end = fs->total_clusters + 2;
+    if (fs->fat->free_count == 0) {
+        return 0;
+    }
+    if (!is_valid_cluster(fs, start)) {
+        start = 2;
     }
 
-    return -1;
+    uint32_t cluster = next_free_in_range(fs, start, end);
+    if (cluster < end) {
+        return cluster;
+    }
+    cluster = next_free_in_range(fs, 2, start);
+    return cluster < start ? cluster : 0;
 }
 
-/* Check if directory is empty (only has . and ..) */
-int is_directory_empty(FileSystem *fs, uint32_t cluster) {
-    int num_entries;
-    DirEntry *entries = read_directory(fs, cluster, &num_entries);
-    int count = 0;
+/* find_free_cluster_locked under the FAT lock */
+uint32_t find_free_cluster(FileSystem *fs, uint32_t start) {
+    pthread_mutex_lock(&fs->fat->lock);
+    uint32_t result = find_free_cluster_locked(fs, start);
+    pthread_mutex_unlock(&fs->fat->lock);
+    return result;
+}
 
-    for (int i = 0; i < num_entries; i++) {
-        if (entries[i].DIR_Name[0] != '.' &&
-            entries[i].DIR_Name[0] != 0x00 &&
-            entries[i].DIR_Name[0] != 0xE5) {
-            count++;
-        }
+/* Get FAT entry for a cluster */
+uint32_t get_fat_entry(FileSystem *fs, uint32_t cluster) {
+    if (cluster >= fs->fat->num_entries) {
+        return 0x0FFFFFFF;
+    }
+    return __atomic_load_n(&fs->fat->entries[cluster], __ATOMIC_RELAXED) &
+           0x0FFFFFFF;
+}
+
+/* Set FAT entry for a cluster (written back by sync_fat) */
+void set_fat_entry(FileSystem *fs, uint32_t cluster, uint32_t value) {
+    FatTable *fat = fs->fat;
+    if (cluster >= fat->num_entries) {
+        return;
     }
+    pthread_mutex_lock(&fat->lock);
+
+    /* Keep the free bitmap in step with the table */
+    uint32_t old_value = fat->entries[cluster] & 0x0FFFFFFF;
+    value &= 0x0FFFFFFF;
+    if (fat->free_map && cluster >= 2 && cluster < fs->total_clusters + 2 &&
+        (old_value == 0) != (value == 0)) {
+        if (value == 0) {
+            fat->free_map[cluster / 64] |= 1ULL << (cluster % 64);
+            fat->free_count++;
+        } else {
+            fat->free_map[cluster / 64] &= ~(1ULL << (cluster % 64));
+            fat->free_count--;
+        }
+        fat->fsinfo_dirty = 1;
+    }
+
+    /* The upper 4 bits are reserved and must be preserved; readers do
+     * not take the lock */
+    __atomic_store_n(&fat->entries[cluster],
+                     (fat->entries[cluster] & 0xF0000000) | value,
+                     __ATOMIC_RELAXED);
+
+    uint32_t sector = cluster * 4 / fs->boot_sector.BPB_BytsPerSec;
+    if (!fat->dirty[sector]) {
+        fat->dirty[sector] = 1;
+        fat->dirty_count++;
+    }
+    pthread_mutex_unlock(&fat->lock);
+}
+
+/* Get first sector of a cluster */
+uint32_t get_first_sector_of_cluster(FileSystem *fs, uint32_t cluster) {
+    return ((cluster - 2) * fs->boot_sector.BPB_SecPerClus) + 
+           fs->data_start_sector;
+}
+
+/* Check if cluster is valid */
+int is_valid_cluster(FileSystem *fs, uint32_t cluster) {
+    return cluster >= 2 && cluster < (fs->total_clusters + 2) &&
+           cluster < 0x0FFFFFF8;
+}
+
+/* Lock a directory against changes by other threads */
+void dir_lock_read(FileSystem *fs, uint32_t cluster) {
+    rwlock_read(dir_locks_get(fs->dir_locks, cluster));
+}
+
+/* Lock a directory for changing its entries or chain */
+void dir_lock_write(FileSystem *fs, uint32_t cluster) {
+    rwlock_write(dir_locks_get(fs->dir_locks, cluster));
+}
+
+/* Release a dir_lock_read or dir_lock_write */
+void dir_unlock(FileSystem *fs, uint32_t cluster) {
+    dir_locks_release(fs->dir_locks, cluster);
+}
+
+/* Start iterating over the directory whose chain begins at cluster */
+void dir_iter_open(FileSystem *fs, DirIterator *it, uint32_t cluster) {
+    it->fs = fs;
+    it->cluster = cluster;
+    it->chunk_offset = 0;
+    it->count = 0;
+    it->position = 0;
+    it->slot = 0;
+    it->visited = 0;
+    it->done = !is_valid_cluster(fs, cluster);
+    it->name_slot = 0;
+    lfn_reset(&it->lfn);
+}
+
+/* Fill the buffer with the next chunk of the chain; returns 0 at the end */
+static int dir_iter_fill(DirIterator *it) {
+    FileSystem *fs = it->fs;
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t chunk = bytes_per_cluster < DIR_ITER_BUFFER_SIZE ?
+                     bytes_per_cluster : DIR_ITER_BUFFER_SIZE;
+
+    /* Move on once the previous chunk consumed the cluster */
+    if (it->count > 0) {
+        it->chunk_offset += chunk;
+        if (it->chunk_offset >= bytes_per_cluster) {
+            it->chunk_offset = 0;
+            it->cluster = get_fat_entry(fs, it->cluster);
+            if (!is_valid_cluster(fs, it->cluster) ||
+                ++it->visited >= fs->total_clusters) {
+                return 0;
+            }
+        }
+    }
+
+    uint64_t offset = sector_offset(fs, get_first_sector_of_cluster(fs, it->cluster)) +
+                      it->chunk_offset;
+    if (image_read(fs, offset, it->buffer, chunk) < 0) {
+        return 0;
+    }
+    it->count = chunk / DIR_ENTRY_SIZE;
+    it->position = 0;
+    return 1;
+}
+
+/* Return the next slot before the end-of-directory marker, deleted and
+ * long-name slots included, with its physical index. Once it returns
+ * NULL, it->slot is the index of the marker. */
+DirEntry *dir_iter_next_raw(DirIterator *it, int *entry_index) {
+    if (it->done) {
+        return NULL;
+    }
+    if (it->position == it->count && !dir_iter_fill(it)) {
+        it->done = 1;
+        return NULL;
+    }
+
+    DirEntry *entry = &it->buffer[it->position];
+    if (entry->DIR_Name[0] == 0x00) {
+        it->done = 1;
+        return NULL;
+    }
+    it->position++;
+    if (entry_index) {
+        *entry_index = it->slot;
+    }
+    it->slot++;
+    return entry;
+}
+
+/* Return the next live short-name entry and its physical index, or NULL
+ * at the end-of-directory marker. The entry points into the iterator and
+ * is only valid until the next call. */
+DirEntry *dir_iter_next(DirIterator *it, int *entry_index) {
+    DirEntry *entry;
+    while ((entry = dir_iter_next_raw(it, entry_index)) != NULL) {
+        if (entry->DIR_Name[0] != 0xE5 && entry->DIR_Attr != ATTR_LONG_NAME) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Like dir_iter_next, but also return the entry's name for display: its
+ * long name if a valid long-name sequence precedes it, otherwise its
+ * short name. name must hold MAX_NAME_LENGTH bytes. it->name_slot is the
+ * first slot of the long name (the entry's own slot if it has none). */
+DirEntry *dir_iter_next_named(DirIterator *it, int *entry_index, char *name) {
+    DirEntry *entry;
+    int slot;
+    while ((entry = dir_iter_next_raw(it, &slot)) != NULL) {
+        if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Attr == ATTR_LONG_NAME) {
+            lfn_feed(&it->lfn, entry, slot);
+            continue;
+        }
+        it->name_slot = slot;
+        if (!lfn_finish(&it->lfn, entry, slot, name, MAX_NAME_LENGTH,
+                        &it->name_slot)) {
+            parse_filename((char *)entry->DIR_Name, name);
+        }
+        if (entry_index) {
+            *entry_index = slot;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/* Finish an iteration */
+void dir_iter_close(DirIterator *it) {
+    it->done = 1;
+}
+
+/* Read directory entries from a cluster */
+DirEntry *read_directory(FileSystem *fs, uint32_t cluster, int *num_entries) {
+    int capacity = 16;
+    DirEntry *entries = malloc(capacity * sizeof(DirEntry));
+    int entry_count = 0;
+
+    DirIterator it;
+    DirEntry *entry;
+    dir_lock_read(fs, cluster);
+    dir_iter_open(fs, &it, cluster);
+    while ((entry = dir_iter_next(&it, NULL)) != NULL) {
+        if (entry_count == capacity) {
+            capacity *= 2;
+            entries = realloc(entries, capacity * sizeof(DirEntry));
+        }
+        entries[entry_count++] = *entry;
+    }
+    dir_iter_close(&it);
+    dir_unlock(fs, cluster);
+
+    *num_entries = entry_count;
+    return entries;
+}
+
+/* Find the entry a name refers to: the entry with that long name (case
+ * ignored), or else the one with that short name if name is a valid 8.3
+ * name. Fills in the entry, its slot, the first slot of its long name and
+ * the long name itself ("" if none; long_name may be NULL). */
+static int locate_entry(FileSystem *fs, uint32_t cluster, const char *name,
+                        DirEntry *entry, uint32_t *slot, uint32_t *first_slot,
+                        char *long_name) {
+    DirIndex *index = dir_index_get(fs, cluster);
+    if (index) {
+        DirIndexRecord *record = dir_index_find(index, name);
+        if (record) {
+            *entry = record->entry;
+            *slot = record->slot;
+            *first_slot = record->first_slot;
+            if (long_name) {
+                strcpy(long_name, record->long_name ? record->long_name : "");
+            }
+        }
+        dir_index_put(fs, index);
+        return record ? 0 : -1;
+    }
+
+    /* Fall back to a scan if the index could not be built */
+    char formatted_name[12];
+    int short_valid = !lfn_needed(name);
+    format_filename(name, formatted_name);
+
+    DirIterator it;
+    DirEntry *current;
+    int current_slot;
+    char current_name[MAX_NAME_LENGTH];
+    int found = 0;
+    dir_iter_open(fs, &it, cluster);
+    while ((current = dir_iter_next_named(&it, &current_slot,
+                                          current_name)) != NULL) {
+        int has_long = it.name_slot != (uint32_t)current_slot;
+        int long_match = has_long && lfn_name_equal(current_name, name);
+        int short_match = !found && short_valid &&
+                          memcmp(current->DIR_Name, formatted_name, 11) == 0;
+        if (long_match || short_match) {
+            *entry = *current;
+            *slot = current_slot;
+            *first_slot = it.name_slot;
+            if (long_name) {
+                strcpy(long_name, has_long ? current_name : "");
+            }
+            found = 1;
+            if (long_match) {
+                break;
+            }
+        }
+    }
+    dir_iter_close(&it);
+    return found ? 0 : -1;
+}
+
+/* Find directory entry by long or short name */
+DirEntry *find_entry(FileSystem *fs, uint32_t cluster, const char *name) {
+    DirEntry entry;
+    uint32_t slot, first_slot;
+    dir_lock_read(fs, cluster);
+    int found = locate_entry(fs, cluster, name, &entry, &slot, &first_slot,
+                             NULL);
+    dir_unlock(fs, cluster);
+    if (found < 0) {
+        return NULL;
+    }
+    DirEntry *result = malloc(sizeof(DirEntry));
+    *result = entry;
+    return result;
+}
+
+/* Find an entry by name and copy out the name it is listed under: its
+ * long name, or its short name if it has none. Returns 0, or -1 if there
+ * is no such entry. shown must hold MAX_NAME_LENGTH bytes. */
+int find_entry_name(FileSystem *fs, uint32_t cluster, const char *name,
+                    char *shown) {
+    DirEntry entry;
+    uint32_t slot, first_slot;
+    dir_lock_read(fs, cluster);
+    int found = locate_entry(fs, cluster, name, &entry, &slot, &first_slot,
+                             shown);
+    dir_unlock(fs, cluster);
+    if (found < 0) {
+        return -1;
+    }
+    if (shown[0] == '\0') {
+        parse_filename((const char *)entry.DIR_Name, shown);
+    }
+    return 0;
+}
+
+/* Format filename to FAT32 11-byte format */
+void format_filename(const char *input, char *output) {
+    memset(output, ' ', 11);
+    output[11] = '\0';
+
+    if (strcmp(input, ".") == 0) {
+        output[0] = '.';
+        return;
+    }
+    if (strcmp(input, "..") == 0) {
+        output[0] = '.';
+        output[1] = '.';
+        return;
+    }
+
+    int i = 0, o = 0;
+    while (input[i] && input[i] != '.' && o < 8) {
+        output[o++] = toupper(input[i++]);
+    }
+
+    if (input[i] == '.') {
+        i++;
+        o = 8;
+        while (input[i] && o < 11) {
+            output[o++] = toupper(input[i++]);
+        }
+    }
+}
+
+/* Parse FAT32 filename to readable format */
+void parse_filename(const char *formatted, char *output) {
+    int i = 0, o = 0;
+
+    /* Handle special cases */
+    if (formatted[0] == '.' && formatted[1] == ' ') {
+        output[0] = '.';
+        output[1] = '\0';
+        return;
+    }
+    if (formatted[0] == '.' && formatted[1] == '.') {
+        output[0] = '.';
+        output[1] = '.';
+        output[2] = '\0';
+        return;
+    }
+
+    /* Copy name part */
+    for (i = 0; i < 8 && formatted[i] != ' '; i++) {
+        output[o++] = formatted[i];
+    }
+
+    /* Copy extension part */
+    int has_ext = 0;
+    for (i = 8; i < 11 && formatted[i] != ' '; i++) {
+        if (!has_ext) {
+            output[o++] = '.';
+            has_ext = 1;
+        }
+        output[o++] = formatted[i];
+    }
+
+    output[o] = '\0';
+}
+
+/* Check whether a cluster is marked free in the bitmap */
+static int cluster_is_free(FileSystem *fs, uint32_t cluster) {
+    return is_valid_cluster(fs, cluster) &&
+           (fs->fat->free_map[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+/* Length of the free run starting at cluster, capped at limit */
+static uint32_t free_run_length(FileSystem *fs, uint32_t cluster,
+                                uint32_t limit) {
+    uint32_t length = 0;
+    while (length < limit && cluster_is_free(fs, cluster + length)) {
+        uint32_t bit = (cluster + length) % 64;
+        if (bit == 0 && limit - length >= 64 &&
+            fs->fat->free_map[(cluster + length) / 64] == ~0ULL) {
+            length += 64;
+        } else {
+            length++;
+        }
+    }
+    return length;
+}
+
+/* Find the first free run of at least count clusters at or after start,
+ * wrapping around. If none is long enough the longest run seen is
+ * returned instead; *run_length receives the usable length (0 if full). */
+static uint32_t find_free_run_locked(FileSystem *fs, uint32_t start,
+                                     uint32_t count, uint32_t *run_length) {
+    uint32_t end = fs->total_clusters + 2;
+    uint32_t best = 0, best_length = 0;
+
+    if (!is_valid_cluster(fs, start)) {
+        start = 2;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t cluster = (pass == 0) ? start : 2;
+        uint32_t limit = (pass == 0) ? end : start;
+
+        while ((cluster = next_free_in_range(fs, cluster, limit)) < limit) {
+            uint32_t length = free_run_length(fs, cluster, count);
+            if (length >= count) {
+                *run_length = count;
+                return cluster;
+            }
+            if (length > best_length) {
+                best = cluster;
+                best_length = length;
+            }
+            cluster += length;
+        }
+    }
+
+    *run_length = best_length;
+    return best;
+}
+
+/* find_free_run_locked under the FAT lock */
+uint32_t find_free_run(FileSystem *fs, uint32_t start, uint32_t count,
+                       uint32_t *run_length) {
+    pthread_mutex_lock(&fs->fat->lock);
+    uint32_t result = find_free_run_locked(fs, start, count, run_length);
+    pthread_mutex_unlock(&fs->fat->lock);
+    return result;
+}
+
+static void release_chain(FileSystem *fs, uint32_t cluster);
+
+/* Shared source of zeros for clearing newly allocated clusters */
+#define ZERO_BUFFER_SIZE 65536
+static const uint8_t zero_buffer[ZERO_BUFFER_SIZE];
+
+/* Write zeros over a byte range of the image */
+static void zero_range(FileSystem *fs, uint64_t offset, uint64_t length) {
+    while (length > 0) {
+        uint32_t chunk = length < ZERO_BUFFER_SIZE ? (uint32_t)length :
+                                                     ZERO_BUFFER_SIZE;
+        image_write(fs, offset, zero_buffer, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+/* Allocate a zeroed cluster for directory entries */
+uint32_t allocate_cluster(FileSystem *fs) {
+    return allocate_clusters(fs, 1, 0, 0);
+}
+
+/* Allocate a chain of count clusters, preferring one contiguous run that
+ * starts at hint (e.g. just past a file's tail). The chain is linked and
+ * terminated in a single pass; returns its first cluster or 0 if the
+ * volume does not have count free clusters. Its clusters are not zeroed
+ * yet. */
+static uint32_t allocate_clusters_locked(FileSystem *fs, uint32_t count,
+                                         uint32_t hint) {
+    FatTable *fat = fs->fat;
+    if (count == 0 || fat->free_count < count) {
+        return 0;
+    }
+
+    uint32_t first = 0, previous = 0;
+    uint32_t remaining = count;
+
+    while (remaining > 0) {
+        uint32_t run = 0, length = 0;
+
+        /* Extend contiguously from the hint when possible */
+        if (cluster_is_free(fs, hint)) {
+            run = hint;
+            length = free_run_length(fs, hint, remaining);
+        }
+        if (length < remaining) {
+            uint32_t other_length;
+            uint32_t other = find_free_run(fs, fat->next_free, remaining,
+                                           &other_length);
+            if (other_length > length) {
+                run = other;
+                length = other_length;
+            }
+        }
+        if (length == 0) {
+            /* Only reachable if free_count disagrees with the bitmap */
+            if (first != 0) {
+                release_chain(fs, first);
+            }
+            return 0;
+        }
+
+        /* Link the run onto the chain */
+        for (uint32_t cluster = run; cluster < run + length; cluster++) {
+            if (previous != 0) {
+                set_fat_entry(fs, previous, cluster);
+            } else {
+                first = cluster;
+            }
+            previous = cluster;
+        }
+        set_fat_entry(fs, previous, 0x0FFFFFFF);
+
+        remaining -= length;
+        hint = run + length;
+    }
+
+    /* Wrap past the last data cluster so FSInfo never holds an
+     * out-of-range hint */
+    fat->next_free = previous + 1;
+    if (fat->next_free >= fs->total_clusters + 2) {
+        fat->next_free = 2;
+    }
+    return first;
+}
+
+/* Zero a new chain after its first data_bytes bytes, one write per
+ * contiguous run. No other thread knows the chain yet, so its FAT entries
+ * are read without the FAT lock. */
+static void zero_new_chain(FileSystem *fs, uint32_t first,
+                           uint32_t data_bytes) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t run = first;
+    while (is_valid_cluster(fs, run)) {
+        uint32_t length = 1;
+        uint32_t next = get_fat_entry(fs, run);
+        while (next == run + length) {
+            length++;
+            next = get_fat_entry(fs, next);
+        }
+
+        /* Zero the part of the run the caller will not overwrite */
+        uint64_t run_bytes = (uint64_t)length * bytes_per_cluster;
+        uint64_t skip = data_bytes < run_bytes ? data_bytes : run_bytes;
+        if (skip < run_bytes) {
+            zero_range(fs, sector_offset(fs, get_first_sector_of_cluster(fs, run)) +
+                           skip, run_bytes - skip);
+        }
+        data_bytes -= (uint32_t)skip;
+        run = next;
+    }
+}
+
+/* allocate_clusters_locked under the FAT lock. The caller promises to
+ * write the first data_bytes bytes of the chain itself, so only the rest
+ * is zeroed (data_bytes is 0 for directory clusters), after the lock is
+ * released so other allocations do not wait on the writes. */
+uint32_t allocate_clusters(FileSystem *fs, uint32_t count, uint32_t hint,
+                           uint32_t data_bytes) {
+    pthread_mutex_lock(&fs->fat->lock);
+    uint32_t result = allocate_clusters_locked(fs, count, hint);
+    pthread_mutex_unlock(&fs->fat->lock);
+    if (result != 0) {
+        zero_new_chain(fs, result, data_bytes);
+    }
+    return result;
+}
+
+/* Return a chain's clusters to the free map */
+static void release_chain(FileSystem *fs, uint32_t cluster) {
+    pthread_mutex_lock(&fs->fat->lock);
+    while (is_valid_cluster(fs, cluster)) {
+        uint32_t next = get_fat_entry(fs, cluster);
+        set_fat_entry(fs, cluster, 0);
+        cluster = next;
+    }
+    pthread_mutex_unlock(&fs->fat->lock);
+}
+
+/* Free a cluster chain */
+void free_cluster_chain(FileSystem *fs, uint32_t cluster) {
+    /* The chain may have held a directory; its index goes first, since
+     * the directory cache is locked before the FAT */
+    dir_index_drop(fs, cluster);
+    release_chain(fs, cluster);
+}
+
+/* Byte offset of slot entry_index of a directory in the image, or 0 if
+ * the slot lies past the end of its chain */
+static uint64_t directory_slot_offset(FileSystem *fs, uint32_t cluster,
+                                      uint32_t entry_index) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                  fs->boot_sector.BPB_SecPerClus;
+    uint32_t entries_per_cluster = bytes_per_cluster / DIR_ENTRY_SIZE;
+
+    uint32_t current_cluster = cluster;
+    uint32_t current_index = entry_index;
+
+    /* The directory's index knows its chain; otherwise walk the FAT */
+    DirIndex *index = dir_index_peek(fs, cluster);
+    if (index) {
+        if (current_index / entries_per_cluster < index->num_clusters) {
+            current_cluster = index->chain[current_index / entries_per_cluster];
+            current_index %= entries_per_cluster;
+        }
+        dir_index_put(fs, index);
+    }
+    while (current_index >= entries_per_cluster) {
+        current_index -= entries_per_cluster;
+        current_cluster = get_fat_entry(fs, current_cluster);
+        if (!is_valid_cluster(fs, current_cluster)) {
+            return 0;
+        }
+    }
+
+    uint32_t sector = get_first_sector_of_cluster(fs, current_cluster);
+    return sector_offset(fs, sector) + current_index * DIR_ENTRY_SIZE;
+}
+
+/* Write a directory entry */
+static void write_directory_entry_locked(FileSystem *fs, uint32_t cluster,
+                                         DirEntry *entry, int entry_index) {
+    uint64_t offset = directory_slot_offset(fs, cluster, entry_index);
+    if (offset == 0) {
+        return;
+    }
+    if (image_write(fs, offset, entry, sizeof(DirEntry)) == 0) {
+        dir_index_update(fs, cluster, entry, entry_index);
+    }
+}
+
+/* write_directory_entry_locked with the directory locked for writing */
+void write_directory_entry(FileSystem *fs, uint32_t cluster, DirEntry *entry,
+                           int entry_index) {
+    dir_lock_write(fs, cluster);
+    write_directory_entry_locked(fs, cluster, entry, entry_index);
+    dir_unlock(fs, cluster);
+}
+
+/* Find the first slot of count consecutive free slots in a directory,
+ * extending its chain when they do not fit */
+static int find_free_entries_locked(FileSystem *fs, uint32_t cluster,
+                                    uint32_t count) {
+    DirIndex *index = dir_index_get(fs, cluster);
+    if (index) {
+        int start = dir_index_free_run(fs, index, count);
+        dir_index_put(fs, index);
+        return start;
+    }
+
+    /* Fall back to a scan for a run of deleted slots */
+    DirIterator it;
+    DirEntry *entry;
+    int entry_index;
+    uint32_t run = 0, run_start = 0;
+    dir_iter_open(fs, &it, cluster);
+    while (run < count &&
+           (entry = dir_iter_next_raw(&it, &entry_index)) != NULL) {
+        if (entry->DIR_Name[0] != 0xE5) {
+            run = 0;
+        } else if (run++ == 0) {
+            run_start = entry_index;
+        }
+    }
+    dir_iter_close(&it);
+    uint32_t start = run > 0 ? run_start : it.slot;
+
+    /* Allocate clusters until the chain holds the run */
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                  fs->boot_sector.BPB_SecPerClus;
+    uint32_t max_entries = bytes_per_cluster / DIR_ENTRY_SIZE;
+    uint32_t capacity = max_entries;
+    uint32_t current_cluster = cluster;
+    while (capacity < start + count) {
+        uint32_t next_cluster = get_fat_entry(fs, current_cluster);
+        if (!is_valid_cluster(fs, next_cluster)) {
+            /* Need to allocate new cluster */
+            next_cluster = allocate_cluster(fs);
+            if (next_cluster == 0) {
+                return -1;
+            }
+            set_fat_entry(fs, current_cluster, next_cluster);
+        }
+        current_cluster = next_cluster;
+        capacity += max_entries;
+    }
+
+    return start;
+}
+
+/* find_free_entries_locked with the directory locked for writing */
+int find_free_entries(FileSystem *fs, uint32_t cluster, uint32_t count) {
+    dir_lock_write(fs, cluster);
+    int result = find_free_entries_locked(fs, cluster, count);
+    dir_unlock(fs, cluster);
+    return result;
+}
+
+/* Check whether a formatted short name is taken in a directory */
+static int short_name_in_use(FileSystem *fs, uint32_t cluster,
+                             const char *short_name) {
+    DirIndex *index = dir_index_get(fs, cluster);
+    if (index) {
+        int in_use = dir_index_lookup(index, short_name) != NULL;
+        dir_index_put(fs, index);
+        return in_use;
+    }
+
+    DirIterator it;
+    DirEntry *entry;
+    int in_use = 0;
+    dir_iter_open(fs, &it, cluster);
+    while ((entry = dir_iter_next(&it, NULL)) != NULL) {
+        if (memcmp(entry->DIR_Name, short_name, 11) == 0) {
+            in_use = 1;
+            break;
+        }
+    }
+    dir_iter_close(&it);
+    return in_use;
+}
+
+/* Give entry the short name for name. Names that are not valid 8.3 names
+ * get a unique "~N" alias and long-name entries in lfn; returns how many
+ * long-name entries there are, or -1 if name cannot be stored. */
+static int name_entry_group(FileSystem *fs, uint32_t cluster, const char *name,
+                            DirEntry *entry, LfnEntry *lfn) {
+    char short_name[12];
+    if (!lfn_valid_name(name)) {
+        return -1;
+    }
+    if (!lfn_needed(name)) {
+        format_filename(name, short_name);
+        memcpy(entry->DIR_Name, short_name, 11);
+        return 0;
+    }
+
+    char basis[12];
+    lfn_short_basis(name, basis);
+    for (uint32_t attempt = 1; attempt <= MAX_ALIAS_ATTEMPTS; attempt++) {
+        lfn_short_alias(basis, name, attempt, short_name);
+        if (!short_name_in_use(fs, cluster, short_name)) {
+            memcpy(entry->DIR_Name, short_name, 11);
+            return lfn_build_entries(name, entry->DIR_Name, lfn);
+        }
+    }
+    return -1;
+}
+
+/* Write a long name's entries and its short entry into consecutive slots */
+static void write_entry_group(FileSystem *fs, uint32_t cluster, uint32_t slot,
+                              LfnEntry *lfn, int lfn_count, DirEntry *entry) {
+    for (int i = 0; i < lfn_count; i++) {
+        write_directory_entry(fs, cluster, (DirEntry *)&lfn[i], slot + i);
+    }
+    write_directory_entry(fs, cluster, entry, slot + lfn_count);
+}
+
+/* Mark an entry and the long-name slots before it deleted */
+static void delete_entry_group(FileSystem *fs, uint32_t cluster,
+                               const DirEntry *entry, uint32_t slot,
+                               uint32_t first_slot) {
+    DirEntry deleted = *entry;
+    deleted.DIR_Name[0] = 0xE5;
+    write_directory_entry(fs, cluster, &deleted, slot);
+
+    for (uint32_t s = first_slot; s < slot; s++) {
+        uint64_t offset = directory_slot_offset(fs, cluster, s);
+        if (offset != 0 &&
+            image_read(fs, offset, &deleted, sizeof(DirEntry)) == 0) {
+            deleted.DIR_Name[0] = 0xE5;
+            write_directory_entry(fs, cluster, &deleted, s);
+        }
+    }
+}
+
+/* Drop cached lookups of an entry under its short and long names */
+static void invalidate_names(FileSystem *fs, uint32_t cluster,
+                             const DirEntry *entry, const char *long_name) {
+    char short_name[13];
+    parse_filename((const char *)entry->DIR_Name, short_name);
+    dcache_invalidate(fs, cluster, short_name);
+    if (long_name && long_name[0]) {
+        dcache_invalidate(fs, cluster, long_name);
+    }
+}
+
+/* Create a directory entry, with long-name entries if name needs them */
+static int create_directory_entry_locked(FileSystem *fs,
+                                         uint32_t parent_cluster,
+                                         const char *name, uint8_t attr,
+                                         uint32_t first_cluster,
+                                         uint32_t size) {
+    DirEntry entry;
+    LfnEntry lfn[LFN_MAX_ENTRIES];
+    uint32_t slot, first_slot;
+
+    /* Another thread may have created the name since the caller looked */
+    if (locate_entry(fs, parent_cluster, name, &entry, &slot, &first_slot,
+                     NULL) == 0) {
+        return -1;
+    }
+    memset(&entry, 0, sizeof(DirEntry));
+
+    int lfn_count = name_entry_group(fs, parent_cluster, name, &entry, lfn);
+    if (lfn_count < 0) {
+        return -1;
+    }
+    int entry_index = find_free_entries(fs, parent_cluster, lfn_count + 1);
+    if (entry_index < 0) {
+        return -1;
+    }
+
+    entry.DIR_Attr = attr;
+    entry.DIR_FstClusHI = (first_cluster >> 16) & 0xFFFF;
+    entry.DIR_FstClusLO = first_cluster & 0xFFFF;
+    entry.DIR_FileSize = size;
+
+    write_entry_group(fs, parent_cluster, entry_index, lfn, lfn_count, &entry);
+    invalidate_names(fs, parent_cluster, &entry, name);
+    return 0;
+}
+
+/* create_directory_entry_locked with the directory locked for writing */
+int create_directory_entry(FileSystem *fs, uint32_t parent_cluster,
+                           const char *name, uint8_t attr,
+                           uint32_t first_cluster, uint32_t size) {
+    dir_lock_write(fs, parent_cluster);
+    int result = create_directory_entry_locked(fs, parent_cluster, name, attr,
+                                               first_cluster, size);
+    dir_unlock(fs, parent_cluster);
+    return result;
+}
+
+/* Delete a directory entry and its long name */
+static int delete_directory_entry_locked(FileSystem *fs, uint32_t cluster,
+                                         const char *name) {
+    DirEntry entry;
+    uint32_t slot, first_slot;
+    char long_name[MAX_NAME_LENGTH];
+    if (locate_entry(fs, cluster, name, &entry, &slot, &first_slot,
+                     long_name) < 0) {
+        return -1;
+    }
+
+    delete_entry_group(fs, cluster, &entry, slot, first_slot);
+    invalidate_names(fs, cluster, &entry, long_name);
+
+    /* Squeeze the holes out once they make up too much of the directory */
+    DirIndex *index = fs->compact_threshold ? dir_index_peek(fs, cluster) :
+                                              NULL;
+    if (index) {
+        int sparse = index->num_clusters > 1 &&
+                     (uint64_t)index->free_count * 100 >
+                     (uint64_t)index->end_slot * fs->compact_threshold;
+        dir_index_put(fs, index);
+        if (sparse) {
+            compact_directory(fs, cluster, NULL);
+        }
+    }
+    return 0;
+}
+
+/* delete_directory_entry_locked with the directory locked for writing */
+int delete_directory_entry(FileSystem *fs, uint32_t cluster, const char *name) {
+    dir_lock_write(fs, cluster);
+    int result = delete_directory_entry_locked(fs, cluster, name);
+    dir_unlock(fs, cluster);
+    return result;
+}
+
+/* Rename an entry within its directory. The new name is written over the
+ * old one's slots when it fits, so the entry keeps its place. */
+static int rename_directory_entry_locked(FileSystem *fs, uint32_t cluster,
+                                         const char *old_name,
+                                         const char *new_name) {
+    DirEntry old_entry;
+    uint32_t slot, first_slot;
+    char long_name[MAX_NAME_LENGTH];
+    if (locate_entry(fs, cluster, old_name, &old_entry, &slot, &first_slot,
+                     long_name) < 0) {
+        return -1;
+    }
+
+    DirEntry entry = old_entry;
+    LfnEntry lfn[LFN_MAX_ENTRIES];
+    int lfn_count = name_entry_group(fs, cluster, new_name, &entry, lfn);
+    if (lfn_count < 0) {
+        return -1;
+    }
+
+    int start;
+    if ((uint32_t)lfn_count <= slot - first_slot) {
+        start = slot - lfn_count;
+    } else {
+        start = find_free_entries(fs, cluster, lfn_count + 1);
+        if (start < 0) {
+            return -1;
+        }
+    }
+
+    delete_entry_group(fs, cluster, &old_entry, slot, first_slot);
+    write_entry_group(fs, cluster, start, lfn, lfn_count, &entry);
+    invalidate_names(fs, cluster, &old_entry, long_name);
+    invalidate_names(fs, cluster, &entry, new_name);
+    return 0;
+}
+
+/* rename_directory_entry_locked with the directory locked for writing */
+int rename_directory_entry(FileSystem *fs, uint32_t cluster,
+                           const char *old_name, const char *new_name) {
+    dir_lock_write(fs, cluster);
+    int result = rename_directory_entry_locked(fs, cluster, old_name, new_name);
+    dir_unlock(fs, cluster);
+    return result;
+}
+
+/* Check if directory is empty (only has . and ..) */
+int is_directory_empty(FileSystem *fs, uint32_t cluster) {
+    DirIterator it;
+    DirEntry *entry;
+    int empty = 1;
+
+    dir_lock_read(fs, cluster);
+    dir_iter_open(fs, &it, cluster);
+    while ((entry = dir_iter_next(&it, NULL)) != NULL) {
+        if (entry->DIR_Name[0] != '.') {
+            empty = 0;
+            break;
+        }
+    }
+    dir_iter_close(&it);
+    dir_unlock(fs, cluster);
+    return empty;
+}
+
+/* Check that the directory at cluster still exists: the root, or one
+ * whose "." entry names it. remove_directory clears that entry before it
+ * frees the chain, so a caller that resolved the directory earlier and
+ * now holds its lock finds it gone, even if the cluster was reused. */
+int directory_exists(FileSystem *fs, uint32_t cluster) {
+    if (cluster == fs->root_cluster) {
+        return 1;
+    }
+    if (!is_valid_cluster(fs, cluster)) {
+        return 0;
+    }
+    DirEntry dot;
+    uint64_t offset = sector_offset(fs, get_first_sector_of_cluster(fs,
+                                                                    cluster));
+    if (image_read(fs, offset, &dot, sizeof(DirEntry)) < 0) {
+        return 0;
+    }
+    uint32_t self = ((uint32_t)dot.DIR_FstClusHI << 16) | dot.DIR_FstClusLO;
+    return memcmp(dot.DIR_Name, ".          ", 11) == 0 &&
+           (dot.DIR_Attr & ATTR_DIRECTORY) && self == cluster;
+}
+
+/* Free an empty directory's chain after clearing its "." entry (see
+ * directory_exists). The caller holds the directory's write lock and
+ * deletes its entry in the parent. */
+void remove_directory(FileSystem *fs, uint32_t cluster) {
+    DirEntry dot;
+    memset(&dot, 0, sizeof(DirEntry));
+    dot.DIR_Name[0] = 0xE5;
+    write_directory_entry(fs, cluster, &dot, 0);
+    dcache_purge_dir(fs, cluster);
+    free_cluster_chain(fs, cluster);
+}
+
+/* Rewrite a directory's live entries, each with its long-name entries,
+ * densely from the first slot, dropping deleted slots and stray long-name
+ * entries, and free the clusters this empties at the end of its chain.
+ * Returns the number of slots reclaimed (freed, if non-NULL, receives the
+ * number of clusters released) or -1 on error. */
+static int compact_directory_locked(FileSystem *fs, uint32_t cluster,
+                                    uint32_t *freed) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t per_cluster = bytes_per_cluster / DIR_ENTRY_SIZE;
+    uint32_t *chain = NULL;
+    uint32_t num_clusters = 0, chain_capacity = 0;
+    DirEntry *slots = NULL;
+    uint32_t count = 0, capacity = 0;
+    int result = -1;
+
+    if (freed) {
+        *freed = 0;
+    }
+
+    /* Record the chain */
+    uint32_t current = cluster;
+    while (is_valid_cluster(fs, current) && num_clusters < fs->total_clusters) {
+        if (num_clusters == chain_capacity) {
+            chain_capacity = chain_capacity ? chain_capacity * 2 : 8;
+            uint32_t *grown = realloc(chain, chain_capacity * sizeof(uint32_t));
+            if (!grown) {
+                goto out;
+            }
+            chain = grown;
+        }
+        chain[num_clusters++] = current;
+        current = get_fat_entry(fs, current);
+    }
+    if (num_clusters == 0) {
+        goto out;
+    }
+
+    /* Read every slot up to the end marker */
+    DirIterator it;
+    DirEntry *entry;
+    dir_iter_open(fs, &it, cluster);
+    while ((entry = dir_iter_next_raw(&it, NULL)) != NULL) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : per_cluster;
+            DirEntry *grown = realloc(slots, capacity * sizeof(DirEntry));
+            if (!grown) {
+                dir_iter_close(&it);
+                goto out;
+            }
+            slots = grown;
+        }
+        slots[count++] = *entry;
+    }
+    dir_iter_close(&it);
+
+    /* Slide each live entry and its long name down over the holes */
+    LfnAssembler lfn;
+    char name[MAX_NAME_LENGTH];
+    uint32_t kept = 0, first_moved = count;
+    lfn_reset(&lfn);
+    for (uint32_t slot = 0; slot < count; slot++) {
+        entry = &slots[slot];
+        if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Attr == ATTR_LONG_NAME) {
+            lfn_feed(&lfn, entry, slot);
+            continue;
+        }
+        uint32_t first_slot = slot;
+        lfn_finish(&lfn, entry, slot, name, sizeof(name), &first_slot);
+        uint32_t length = slot - first_slot + 1;
+        if (first_slot != kept && first_moved == count) {
+            first_moved = kept;
+        }
+        memmove(&slots[kept], &slots[first_slot], length * sizeof(DirEntry));
+        kept += length;
+    }
+
+    /* Keep enough clusters for the entries, at least one */
+    uint32_t needed = (kept + per_cluster - 1) / per_cluster;
+    if (needed == 0) {
+        needed = 1;
+    }
+
+    /* Rewrite from the first moved slot; the rest of the last cluster is
+     * zeroed so the end marker follows the last entry */
+    if (kept < count) {
+        if (first_moved > kept) {
+            first_moved = kept;
+        }
+        uint8_t *buffer = malloc(bytes_per_cluster);
+        if (!buffer) {
+            goto out;
+        }
+        for (uint32_t c = first_moved / per_cluster; c < needed; c++) {
+            uint32_t first = c * per_cluster;
+            uint32_t in_cluster = kept - first < per_cluster ? kept - first :
+                                                               per_cluster;
+            memset(buffer, 0, bytes_per_cluster);
+            memcpy(buffer, &slots[first], in_cluster * sizeof(DirEntry));
+            image_write(fs, sector_offset(fs, get_first_sector_of_cluster(fs, chain[c])),
+                        buffer, bytes_per_cluster);
+        }
+        free(buffer);
+        dir_index_drop(fs, cluster);
+    }
+
+    /* Release the clusters past the last one still needed */
+    if (needed < num_clusters) {
+        dir_index_drop(fs, cluster);
+        set_fat_entry(fs, chain[needed - 1], 0x0FFFFFFF);
+        free_cluster_chain(fs, chain[needed]);
+        if (freed) {
+            *freed = num_clusters - needed;
+        }
+    }
+    result = count - kept;
+
+out:
+    free(chain);
+    free(slots);
+    return result;
+}
+
+/* compact_directory_locked with the directory locked for writing */
+int compact_directory(FileSystem *fs, uint32_t cluster, uint32_t *freed) {
+    dir_lock_write(fs, cluster);
+    int result = compact_directory_locked(fs, cluster, freed);
+    dir_unlock(fs, cluster);
+    return result;
+}
+
+/* Add a cluster to the end of a file's extent map */
+static int extent_map_push(OpenFile *file, uint32_t cluster) {
+    if (file->num_extents > 0) {
+        ClusterExtent *last = &file->extents[file->num_extents - 1];
+        if (last->start + last->length == cluster) {
+            last->length++;
+            file->num_clusters++;
+            file->tail_cluster = cluster;
+            return 0;
+        }
+    }
+
+    if (file->num_extents == file->extent_capacity) {
+        uint32_t capacity = file->extent_capacity ? file->extent_capacity * 2 : 8;
+        ClusterExtent *extents = realloc(file->extents,
+                                         capacity * sizeof(ClusterExtent));
+        if (!extents) {
+            return -1;
+        }
+        file->extents = extents;
+        file->extent_capacity = capacity;
+    }
+
+    ClusterExtent *extent = &file->extents[file->num_extents++];
+    extent->file_index = file->num_clusters;
+    extent->start = cluster;
+    extent->length = 1;
+    file->num_clusters++;
+    file->tail_cluster = cluster;
+    return 0;
+}
+
+/* Walk a file's cluster chain once and record it as extents */
+int build_extent_map(FileSystem *fs, OpenFile *file) {
+    file->num_extents = 0;
+    file->num_clusters = 0;
+    file->tail_cluster = 0;
+    file->extents_valid = 0;
+
+    if (extent_map_append(fs, file, file->first_cluster) < 0) {
+        return -1;
+    }
+
+    file->extents_valid = 1;
+    return 0;
+}
+
+/* Append a newly linked chain to a file's extent map */
+int extent_map_append(FileSystem *fs, OpenFile *file, uint32_t first_cluster) {
+    uint32_t cluster = first_cluster;
+    while (is_valid_cluster(fs, cluster)) {
+        if (extent_map_push(file, cluster) < 0) {
+            file->extents_valid = 0;
+            return -1;
+        }
+        /* Guard against cyclic chains on a damaged image */
+        if (file->num_clusters > fs->total_clusters) {
+            file->extents_valid = 0;
+            return -1;
+        }
+        cluster = get_fat_entry(fs, cluster);
+    }
+    return 0;
+}
+
+/* Get the cluster holding the index-th cluster of a file (0 if past the
+ * end). If contiguous is non-NULL it receives the number of physically
+ * contiguous clusters from there to the end of the extent. */
+uint32_t file_cluster_at(FileSystem *fs, OpenFile *file, uint32_t index,
+                         uint32_t *contiguous) {
+    if (!file->extents_valid && build_extent_map(fs, file) < 0) {
+        return 0;
+    }
+    if (index >= file->num_clusters) {
+        return 0;
+    }
+
+    /* Binary search for the extent containing index */
+    uint32_t low = 0, high = file->num_extents - 1;
+    while (low < high) {
+        uint32_t mid = (low + high + 1) / 2;
+        if (file->extents[mid].file_index <= index) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    ClusterExtent *extent = &file->extents[low];
+    uint32_t delta = index - extent->file_index;
+    if (contiguous) {
+        *contiguous = extent->length - delta;
+    }
+    return extent->start + delta;
+}
+
+/* Set up an empty open file slot */
+void open_file_init(OpenFile *file) {
+    memset(file, 0, sizeof(OpenFile));
+    pthread_mutex_init(&file->lock, NULL);
+}
+
+/* Release an open file slot set up by open_file_init */
+void open_file_destroy(OpenFile *file) {
+    release_open_file(file);
+    pthread_mutex_destroy(&file->lock);
+}
+
+/* Release the extent map and readahead buffer of an open file slot */
+void release_open_file(OpenFile *file) {
+    free_extent_map(file);
+    free(file->ra_buffer);
+    file->ra_buffer = NULL;
+    file->ra_capacity = 0;
+    file->ra_start = 0;
+    file->ra_length = 0;
+    file->ra_window = 0;
+    file->ra_next = 0;
+}
+
+/* Release a file's extent map */
+void free_extent_map(OpenFile *file) {
+    free(file->extents);
+    file->extents = NULL;
+    file->num_extents = 0;
+    file->extent_capacity = 0;
+    file->num_clusters = 0;
+    file->tail_cluster = 0;
+    file->extents_valid = 0;
+}
+
+/* Transfer part of an open file as one batch with a request per extent;
+ * returns the bytes transferred, which may exceed INT_MAX */
+static ssize_t file_transfer(FileSystem *fs, OpenFile *file, uint32_t offset,
+                             uint8_t *buffer, uint32_t len, int write) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    IoRequest local[16];
+    IoRequest *requests = local;
+    int capacity = 16, count = 0;
+    uint32_t done = 0;
+
+    while (done < len) {
+        uint32_t contiguous;
+        uint32_t position = offset + done;
+        uint32_t cluster = file_cluster_at(fs, file, position / bytes_per_cluster,
+                                           &contiguous);
+        if (cluster == 0) {
+            break;
+        }
+
+        uint32_t offset_in_cluster = position % bytes_per_cluster;
+        uint64_t available = (uint64_t)contiguous * bytes_per_cluster -
+                             offset_in_cluster;
+        uint32_t chunk = len - done;
+        if (available < chunk) {
+            chunk = available;
+        }
+
+        if (count == capacity) {
+            IoRequest *grown = malloc(capacity * 2 * sizeof(IoRequest));
+            if (!grown) {
+                break;
+            }
+            memcpy(grown, requests, count * sizeof(IoRequest));
+            if (requests != local) {
+                free(requests);
+            }
+            requests = grown;
+            capacity *= 2;
+        }
+
+        requests[count].offset = sector_offset(fs,
+                                               get_first_sector_of_cluster(fs, cluster)) +
+                                 offset_in_cluster;
+        requests[count].buffer = buffer + done;
+        requests[count].length = chunk;
+        count++;
+        done += chunk;
+    }
+
+    int result = image_submit(fs, requests, count, write);
+    if (requests != local) {
+        free(requests);
+    }
+    return result < 0 ? -1 : (ssize_t)done;
+}
+
+/* Read from an open file's allocated clusters; returns bytes read */
+ssize_t file_read(FileSystem *fs, OpenFile *file, uint32_t offset,
+                  void *buffer, uint32_t len) {
+    pthread_mutex_lock(&file->lock);
+    ssize_t result = file_transfer(fs, file, offset, buffer, len, 0);
+    pthread_mutex_unlock(&file->lock);
+    return result;
+}
+
+/* Write into an open file's allocated clusters; returns bytes written */
+ssize_t file_write(FileSystem *fs, OpenFile *file, uint32_t offset,
+                   const void *buffer, uint32_t len) {
+    pthread_mutex_lock(&file->lock);
+    /* Buffered readahead data may now be stale */
+    file->ra_length = 0;
+    ssize_t result = file_transfer(fs, file, offset, (uint8_t *)buffer, len, 1);
+    pthread_mutex_unlock(&file->lock);
+    return result;
+}
+
+/* Copy part of a file straight to a host file descriptor, one kernel
+ * copy per extent; returns bytes copied or -1 */
+static ssize_t file_export_locked(FileSystem *fs, OpenFile *file,
+                                  uint32_t offset, uint32_t len, int out_fd) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t done = 0;
+
+    /* The copy reads the image file, not the cache */
+    if (fs->cache->write_back && cache_flush(fs->cache) < 0) {
+        return -1;
+    }
+
+    while (done < len) {
+        uint32_t contiguous;
+        uint32_t position = offset + done;
+        uint32_t cluster = file_cluster_at(fs, file, position / bytes_per_cluster,
+                                           &contiguous);
+        if (cluster == 0) {
+            break;
+        }
+
+        uint32_t offset_in_cluster = position % bytes_per_cluster;
+        uint64_t available = (uint64_t)contiguous * bytes_per_cluster -
+                             offset_in_cluster;
+        uint32_t chunk = len - done;
+        if (available < chunk) {
+            chunk = available;
+        }
+
+        uint64_t image_offset = sector_offset(fs, get_first_sector_of_cluster(fs, cluster)) +
+                                offset_in_cluster;
+        if (bdev_copy_out(fs->dev, image_offset, chunk, out_fd) < 0) {
+            return -1;
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+/* file_export_locked under the file's lock */
+ssize_t file_export(FileSystem *fs, OpenFile *file, uint32_t offset,
+                    uint32_t len, int out_fd) {
+    pthread_mutex_lock(&file->lock);
+    ssize_t result = file_export_locked(fs, file, offset, len, out_fd);
+    pthread_mutex_unlock(&file->lock);
+    return result;
+}
+
+/* Grow a file's chain to count clusters with one allocation after its
+ * tail. The caller will write the first data_bytes bytes of the new
+ * clusters; the rest are zeroed. */
+static int file_grow_chain(FileSystem *fs, OpenFile *file, uint32_t count,
+                           uint32_t data_bytes) {
+    if (!file->extents_valid && build_extent_map(fs, file) < 0) {
+        return -1;
+    }
+    if (count <= file->num_clusters) {
+        return 0;
+    }
+
+    uint32_t tail = file->tail_cluster;
+    uint32_t chain = allocate_clusters(fs, count - file->num_clusters,
+                                       tail ? tail + 1 : 0, data_bytes);
+    if (chain == 0) {
+        return -1;
+    }
+    if (tail != 0) {
+        set_fat_entry(fs, tail, chain);
+    } else {
+        file->first_cluster = chain;
+    }
+    return extent_map_append(fs, file, chain);
+}
+
+/* Set a file's size. Shrinking (or truncating to the current size)
+ * releases every cluster past the new end, including reserved ones;
+ * growing zeroes the bytes between the old and new end, allocating
+ * zeroed clusters where the chain is too short. */
+static int file_truncate_locked(FileSystem *fs, OpenFile *file, uint32_t size) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t needed = (uint32_t)(((uint64_t)size + bytes_per_cluster - 1) /
+                                 bytes_per_cluster);
+
+    if (!file->extents_valid && build_extent_map(fs, file) < 0) {
+        return -1;
+    }
+
+    if (size <= file->size) {
+        if (needed == 0) {
+            free_cluster_chain(fs, file->first_cluster);
+            file->first_cluster = 0;
+        } else if (needed < file->num_clusters) {
+            uint32_t last = file_cluster_at(fs, file, needed - 1, NULL);
+            uint32_t rest = get_fat_entry(fs, last);
+            set_fat_entry(fs, last, 0x0FFFFFFF);
+            free_cluster_chain(fs, rest);
+        }
+        free_extent_map(file);
+    } else {
+        /* Bytes past the old end in allocated clusters may be stale */
+        uint64_t allocated = (uint64_t)file->num_clusters * bytes_per_cluster;
+        uint32_t zero_end = size < allocated ? size : (uint32_t)allocated;
+        for (uint32_t offset = file->size; offset < zero_end; ) {
+            uint32_t chunk = zero_end - offset < ZERO_BUFFER_SIZE ?
+                             zero_end - offset : ZERO_BUFFER_SIZE;
+            if (file_transfer(fs, file, offset, (uint8_t *)zero_buffer,
+                              chunk, 1) < 0) {
+                return -1;
+            }
+            offset += chunk;
+        }
+        if (file_grow_chain(fs, file, needed, 0) < 0) {
+            return -1;
+        }
+    }
+
+    file->size = size;
+    file->ra_length = 0;
+    return 0;
+}
+
+/* file_truncate_locked under the file's lock */
+int file_truncate(FileSystem *fs, OpenFile *file, uint32_t size) {
+    pthread_mutex_lock(&file->lock);
+    int result = file_truncate_locked(fs, file, size);
+    pthread_mutex_unlock(&file->lock);
+    return result;
+}
+
+/* Reserve clusters for the first size bytes of a file without changing
+ * its size or writing anything: the missing clusters are appended as one
+ * contiguous run where free space allows, and later writes up to size
+ * need no allocation */
+int file_reserve(FileSystem *fs, OpenFile *file, uint32_t size) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t needed = (uint32_t)(((uint64_t)size + bytes_per_cluster - 1) /
+                                 bytes_per_cluster);
+
+    /* Reserved clusters lie past the end of the file, so none is zeroed */
+    pthread_mutex_lock(&file->lock);
+    int result = file_grow_chain(fs, file, needed, 0xFFFFFFFF);
+    pthread_mutex_unlock(&file->lock);
+    return result;
+}
+
+/* Fill the readahead buffer with up to len bytes starting at offset */
+static int readahead_fill(FileSystem *fs, OpenFile *file, uint32_t offset,
+                          uint32_t len) {
+    file->ra_length = 0;
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (len > file->size - offset) {
+        len = file->size - offset;
+    }
+
+    if (len > file->ra_capacity) {
+        uint8_t *grown = realloc(file->ra_buffer, len);
+        if (!grown) {
+            return -1;
+        }
+        file->ra_buffer = grown;
+        file->ra_capacity = len;
+    }
+
+    ssize_t result = file_transfer(fs, file, offset, file->ra_buffer, len, 0);
+    if (result < 0) {
+        return -1;
+    }
+    file->ra_start = offset;
+    file->ra_length = result;
+    return 0;
+}
+
+/* Read from an open file, detecting sequential access. Each sequential
+ * read that misses the readahead buffer also prefetches the next
+ * ra_window clusters, and the window doubles up to RA_MAX_CLUSTERS while
+ * the pattern continues. Returns bytes read. */
+static ssize_t file_read_ahead_locked(FileSystem *fs, OpenFile *file,
+                                      uint32_t offset, void *buffer,
+                                      uint32_t len) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint8_t *out = buffer;
+    uint32_t done = 0;
+    int sequential = (offset == file->ra_next);
+
+    /* Serve what we can from the readahead buffer */
+    if (file->ra_length > 0 && offset >= file->ra_start &&
+        offset < file->ra_start + file->ra_length) {
+        uint32_t available = file->ra_start + file->ra_length - offset;
+        done = available < len ? available : len;
+        memcpy(out, file->ra_buffer + (offset - file->ra_start), done);
+    }
+
+    if (done < len) {
+        uint32_t position = offset + done;
+        uint32_t rest = len - done;
+
+        if (!sequential) {
+            /* Random access: read directly and reset the window */
+            file->ra_window = 0;
+            file->ra_length = 0;
+            ssize_t result = file_transfer(fs, file, position, out + done,
+                                           rest, 0);
+            if (result < 0) {
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            done += result;
+        } else {
+            file->ra_window = file->ra_window ? file->ra_window * 2 :
+                                                RA_MIN_CLUSTERS;
+            if (file->ra_window > RA_MAX_CLUSTERS) {
+                file->ra_window = RA_MAX_CLUSTERS;
+            }
+            uint32_t ahead = file->ra_window * bytes_per_cluster;
+
+            if (rest > ahead) {
+                /* Large reads go straight to the caller's buffer */
+                ssize_t result = file_transfer(fs, file, position,
+                                               out + done, rest, 0);
+                if (result < 0) {
+                    return done > 0 ? (ssize_t)done : -1;
+                }
+                done += result;
+                readahead_fill(fs, file, position + result, ahead);
+            } else if (readahead_fill(fs, file, position, rest + ahead) == 0) {
+                uint32_t n = file->ra_length < rest ? file->ra_length : rest;
+                memcpy(out + done, file->ra_buffer, n);
+                done += n;
+            }
+        }
+    }
+
+    file->ra_next = offset + done;
+    return done;
+}
 
-    free(entries);
-    return count == 0;
+/* file_read_ahead_locked under the file's lock */
+ssize_t file_read_ahead(FileSystem *fs, OpenFile *file, uint32_t offset,
+                        void *buffer, uint32_t len) {
+    pthread_mutex_lock(&file->lock);
+    ssize_t result = file_read_ahead_locked(fs, file, offset, buffer, len);
+    pthread_mutex_unlock(&file->lock);
+    return result;
 }
@@ -0,0 +1,826 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../include/fsck.h"
+#include "../include/dirindex.h"
+#include "../include/path.h"
+#include "../include/lfn.h"
+
+/* Directory chain waiting to be read */
+typedef struct FsckRead {
+    uint32_t first;
+    struct FsckRead *next;
+} FsckRead;
+
+/* Directory cluster kept from the read pass */
+typedef struct {
+    uint32_t cluster;
+    uint8_t *data;
+} FsckCluster;
+
+/* Directory waiting to be checked */
+typedef struct FsckDir {
+    char *path;
+    uint32_t *clusters;
+    uint32_t count;
+    struct FsckDir *next;
+} FsckDir;
+
+/* State of one check. The read pass fills clusters from several threads;
+ * the check pass that follows runs on one. */
+typedef struct {
+    FileSystem *fs;
+    FsckReport *report;
+    uint64_t *read;         /* Set atomically for every directory cluster read */
+    uint64_t *claimed;      /* Clusters owned by a chain of the check pass */
+    pthread_mutex_t lock;   /* Protects the read queue and the kept clusters */
+    pthread_cond_t ready;
+    FsckRead *queue;
+    int busy;               /* Workers reading a directory */
+    FsckCluster *clusters;  /* Directory clusters read, then hashed */
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t mask;          /* Hash table size - 1 */
+    FsckDir *head;          /* Directories waiting to be checked, in order */
+    FsckDir *tail;
+    int failed;
+} FsckState;
+
+/* Mark a directory cluster as read; 0 if another thread got there first */
+static int mark_read(FsckState *state, uint32_t cluster) {
+    uint64_t bit = 1ULL << (cluster % 64);
+    return !(__atomic_fetch_or(&state->read[cluster / 64], bit,
+                               __ATOMIC_RELAXED) & bit);
+}
+
+/* Claim a cluster for the chain being walked; 0 if already claimed */
+static int claim(FsckState *state, uint32_t cluster) {
+    uint64_t bit = 1ULL << (cluster % 64);
+    if (state->claimed[cluster / 64] & bit) {
+        return 0;
+    }
+    state->claimed[cluster / 64] |= bit;
+    return 1;
+}
+
+/* Join a directory path and a name */
+static char *join_path(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path) {
+        sprintf(path, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    }
+    return path;
+}
+
+/* Queue a directory chain for the readers unless it was read already */
+static void push_read(FsckState *state, uint32_t first) {
+    if (__atomic_load_n(&state->read[first / 64], __ATOMIC_RELAXED) >>
+        (first % 64) & 1) {
+        return;
+    }
+    FsckRead *task = malloc(sizeof(FsckRead));
+    if (!task) {
+        __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    task->first = first;
+
+    pthread_mutex_lock(&state->lock);
+    task->next = state->queue;
+    state->queue = task;
+    pthread_cond_signal(&state->ready);
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Keep the clusters one reader collected */
+static void keep_clusters(FsckState *state, FsckCluster *clusters,
+                          uint32_t count) {
+    pthread_mutex_lock(&state->lock);
+    if (state->count + count > state->capacity) {
+        uint32_t capacity = state->capacity ? state->capacity : 64;
+        while (capacity < state->count + count) {
+            capacity *= 2;
+        }
+        FsckCluster *grown = realloc(state->clusters,
+                                     capacity * sizeof(FsckCluster));
+        if (!grown) {
+            pthread_mutex_unlock(&state->lock);
+            for (uint32_t i = 0; i < count; i++) {
+                free(clusters[i].data);
+            }
+            __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        state->clusters = grown;
+        state->capacity = capacity;
+    }
+    memcpy(&state->clusters[state->count], clusters,
+           count * sizeof(FsckCluster));
+    state->count += count;
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Read a directory chain straight from the device, queueing every
+ * subdirectory it names. Stops at the end of the directory, at a cluster
+ * a chain cannot use, or at one some reader has already taken, whose
+ * reader carries on from there, so each cluster is read once. */
+static void read_dir_chain(FsckState *state, uint32_t first) {
+    FileSystem *fs = state->fs;
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t per_cluster = bytes_per_cluster / DIR_ENTRY_SIZE;
+    FsckCluster *kept = NULL;
+    uint32_t count = 0, capacity = 0;
+    uint32_t cluster = first;
+
+    for (;;) {
+        uint32_t next = get_fat_entry(fs, cluster);
+        if (!is_valid_cluster(fs, cluster) || next == 0 || next == 0x0FFFFFF7 ||
+            !mark_read(state, cluster)) {
+            break;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            FsckCluster *grown = realloc(kept, capacity * sizeof(FsckCluster));
+            if (!grown) {
+                __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            kept = grown;
+        }
+        uint8_t *data = malloc(bytes_per_cluster);
+        if (!data || bdev_read(fs->dev, get_first_sector_of_cluster(fs, cluster),
+                               fs->boot_sector.BPB_SecPerClus, data) < 0) {
+            free(data);
+            __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        kept[count].cluster = cluster;
+        kept[count].data = data;
+        count++;
+
+        int end = 0;
+        DirEntry *entries = (DirEntry *)data;
+        for (uint32_t i = 0; i < per_cluster; i++) {
+            DirEntry *entry = &entries[i];
+            if (entry->DIR_Name[0] == 0x00) {
+                end = 1;
+                break;
+            }
+            if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Name[0] == '.' ||
+                entry->DIR_Attr == ATTR_LONG_NAME ||
+                !(entry->DIR_Attr & ATTR_DIRECTORY)) {
+                continue;
+            }
+            uint32_t sub = ((uint32_t)entry->DIR_FstClusHI << 16) |
+                           entry->DIR_FstClusLO;
+            if (is_valid_cluster(fs, sub)) {
+                push_read(state, sub);
+            }
+        }
+        if (end || next >= 0x0FFFFFF8) {
+            break;
+        }
+        cluster = next;
+    }
+
+    if (count > 0) {
+        keep_clusters(state, kept, count);
+    }
+    free(kept);
+}
+
+/* Reader: take directory chains off the queue until none is left and no
+ * other reader can add more */
+static void *fsck_worker(void *arg) {
+    FsckState *state = arg;
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        while (!state->queue && state->busy > 0) {
+            pthread_cond_wait(&state->ready, &state->lock);
+        }
+        FsckRead *task = state->queue;
+        if (!task) {
+            pthread_cond_broadcast(&state->ready);
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+        state->queue = task->next;
+        state->busy++;
+        pthread_mutex_unlock(&state->lock);
+
+        read_dir_chain(state, task->first);
+        free(task);
+
+        pthread_mutex_lock(&state->lock);
+        if (--state->busy == 0 && !state->queue) {
+            pthread_cond_broadcast(&state->ready);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return NULL;
+}
+
+/* Hash the kept clusters by cluster number for the check pass */
+static int hash_clusters(FsckState *state) {
+    uint32_t size = 64;
+    while (size < state->count * 2) {
+        size *= 2;
+    }
+    FsckCluster *table = calloc(size, sizeof(FsckCluster));
+    if (!table) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < state->count; i++) {
+        uint32_t h = (state->clusters[i].cluster * 2654435761u) & (size - 1);
+        while (table[h].data) {
+            h = (h + 1) & (size - 1);
+        }
+        table[h] = state->clusters[i];
+    }
+    free(state->clusters);
+    state->clusters = table;
+    state->mask = size - 1;
+    return 0;
+}
+
+/* Data of a directory cluster the read pass kept, NULL if it was not read */
+static const uint8_t *find_cluster(FsckState *state, uint32_t cluster) {
+    uint32_t h = (cluster * 2654435761u) & state->mask;
+    while (state->clusters[h].data) {
+        if (state->clusters[h].cluster == cluster) {
+            return state->clusters[h].data;
+        }
+        h = (h + 1) & state->mask;
+    }
+    return NULL;
+}
+
+/* Record a problem; takes ownership of nothing */
+static void add_problem(FsckState *state, const FsckProblem *problem) {
+    FsckReport *report = state->report;
+    if (report->count == report->capacity) {
+        uint32_t capacity = report->capacity ? report->capacity * 2 : 16;
+        FsckProblem *grown = realloc(report->problems,
+                                     capacity * sizeof(FsckProblem));
+        if (!grown) {
+            state->failed = 1;
+            return;
+        }
+        report->problems = grown;
+        report->capacity = capacity;
+    }
+    FsckProblem *copy = &report->problems[report->count];
+    *copy = *problem;
+    copy->path = strdup(problem->path);
+    if (copy->path) {
+        report->count++;
+    } else {
+        state->failed = 1;
+    }
+}
+
+/* Walk and claim a chain. Directory chains are also collected into
+ * *clusters. Stops at the first cluster that is out of range, free or
+ * bad (FSCK_BAD_LINK) or already claimed (FSCK_CROSS_LINK, which also
+ * catches loops); returns that problem type, or 0 for a sound chain.
+ * problem->kept and problem->last describe the good part. */
+static int walk_chain(FsckState *state, uint32_t first, FsckProblem *problem,
+                      uint32_t **clusters) {
+    FileSystem *fs = state->fs;
+    uint32_t capacity = 0;
+    uint32_t cluster = first;
+
+    problem->kept = 0;
+    problem->last = 0;
+    for (;;) {
+        uint32_t next = get_fat_entry(fs, cluster);
+        if (!is_valid_cluster(fs, cluster) || next == 0 || next == 0x0FFFFFF7) {
+            problem->cluster = cluster;
+            return FSCK_BAD_LINK;
+        }
+        if (!claim(state, cluster)) {
+            problem->cluster = cluster;
+            return FSCK_CROSS_LINK;
+        }
+
+        if (clusters) {
+            if (problem->kept == capacity) {
+                capacity = capacity ? capacity * 2 : 8;
+                uint32_t *grown = realloc(*clusters, capacity * sizeof(uint32_t));
+                if (!grown) {
+                    state->failed = 1;
+                    return 0;
+                }
+                *clusters = grown;
+            }
+            (*clusters)[problem->kept] = cluster;
+        }
+        problem->kept++;
+        problem->last = cluster;
+
+        if (next >= 0x0FFFFFF8) {
+            return 0;
+        }
+        cluster = next;
+    }
+}
+
+/* Queue a directory to be checked after those already waiting */
+static void push_dir(FsckState *state, char *path, uint32_t *clusters,
+                     uint32_t count) {
+    FsckDir *dir = malloc(sizeof(FsckDir));
+    if (!dir) {
+        free(path);
+        free(clusters);
+        state->failed = 1;
+        return;
+    }
+    dir->path = path;
+    dir->clusters = clusters;
+    dir->count = count;
+    dir->next = NULL;
+    if (state->tail) {
+        state->tail->next = dir;
+    } else {
+        state->head = dir;
+    }
+    state->tail = dir;
+}
+
+/* Check one entry of a directory and its chain */
+static void check_entry(FsckState *state, FsckDir *dir, const DirEntry *entry,
+                        uint32_t slot, const char *name) {
+    uint32_t bytes_per_cluster = state->fs->boot_sector.BPB_BytsPerSec *
+                                 state->fs->boot_sector.BPB_SecPerClus;
+    uint32_t first = ((uint32_t)entry->DIR_FstClusHI << 16) |
+                     entry->DIR_FstClusLO;
+    int is_dir = (entry->DIR_Attr & ATTR_DIRECTORY) != 0;
+
+    FsckProblem problem;
+    memset(&problem, 0, sizeof(FsckProblem));
+    problem.entry = *entry;
+    problem.dir_cluster = dir->clusters[0];
+    problem.slot = slot;
+    problem.path = join_path(dir->path, name);
+    if (!problem.path) {
+        state->failed = 1;
+        return;
+    }
+
+    uint32_t *clusters = NULL;
+    if (is_dir) {
+        state->report->directories++;
+        problem.type = (first == 0) ? FSCK_BAD_LINK :
+                       walk_chain(state, first, &problem, &clusters);
+    } else {
+        state->report->files++;
+        if (first != 0) {
+            problem.type = walk_chain(state, first, &problem, NULL);
+        }
+        if (problem.type == 0 &&
+            entry->DIR_FileSize > (uint64_t)problem.kept * bytes_per_cluster) {
+            problem.type = FSCK_SHORT_CHAIN;
+        }
+    }
+
+    if (problem.type != 0) {
+        add_problem(state, &problem);
+    }
+    if (is_dir && problem.kept > 0) {
+        push_dir(state, problem.path, clusters, problem.kept);
+    } else {
+        free(problem.path);
+        free(clusters);
+    }
+}
+
+/* Check the subdirectories of a directory, or its files, from the
+ * clusters the read pass kept */
+static void check_dir(FsckState *state, FsckDir *dir, int files) {
+    FileSystem *fs = state->fs;
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t per_cluster = bytes_per_cluster / DIR_ENTRY_SIZE;
+    char name[MAX_NAME_LENGTH];
+    LfnAssembler lfn;
+    lfn_reset(&lfn);
+
+    for (uint32_t c = 0; c < dir->count; c++) {
+        /* Only clusters past the end of the directory go unread */
+        const DirEntry *entries = (const DirEntry *)find_cluster(state,
+                                                                 dir->clusters[c]);
+        if (!entries) {
+            break;
+        }
+
+        int end = 0;
+        for (uint32_t i = 0; i < per_cluster; i++) {
+            const DirEntry *entry = &entries[i];
+            uint32_t slot = c * per_cluster + i;
+            if (entry->DIR_Name[0] == 0x00) {
+                end = 1;
+                break;
+            }
+            if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Attr == ATTR_LONG_NAME) {
+                lfn_feed(&lfn, entry, slot);
+                continue;
+            }
+
+            uint32_t first_slot;
+            if (!lfn_finish(&lfn, entry, slot, name, sizeof(name),
+                            &first_slot)) {
+                parse_filename((char *)entry->DIR_Name, name);
+            }
+            if (entry->DIR_Name[0] == '.' ||
+                (entry->DIR_Attr & (ATTR_VOLUME_ID | ATTR_DIRECTORY)) ==
+                ATTR_VOLUME_ID ||
+                ((entry->DIR_Attr & ATTR_DIRECTORY) == 0) != files) {
+                continue;
+            }
+            check_entry(state, dir, entry, slot, name);
+        }
+        if (end) {
+            break;
+        }
+    }
+}
+
+/* Order problems by path */
+static int problem_compare(const void *a, const void *b) {
+    const FsckProblem *x = a, *y = b;
+    int order = strcmp(x->path, y->path);
+    return order ? order : x->type - y->type;
+}
+
+/* Mark the lost clusters no other lost cluster points to: the heads of
+ * the lost chains */
+static uint64_t *lost_heads(FileSystem *fs, const uint64_t *lost) {
+    uint32_t end = fs->total_clusters + 2;
+    uint32_t words = (end + 63) / 64;
+    uint64_t *heads = malloc(words * sizeof(uint64_t));
+    if (!heads) {
+        return NULL;
+    }
+    memcpy(heads, lost, words * sizeof(uint64_t));
+    for (uint32_t cluster = 2; cluster < end; cluster++) {
+        if (lost[cluster / 64] >> (cluster % 64) & 1) {
+            uint32_t value = get_fat_entry(fs, cluster);
+            if (is_valid_cluster(fs, value)) {
+                heads[value / 64] &= ~(1ULL << (value % 64));
+            }
+        }
+    }
+    return heads;
+}
+
+/* Find the allocated clusters no chain reached */
+static int find_lost(FileSystem *fs, FsckState *state) {
+    FsckReport *report = state->report;
+    uint32_t end = fs->total_clusters + 2;
+    uint32_t words = (end + 63) / 64;
+
+    report->lost = calloc(words, sizeof(uint64_t));
+    if (!report->lost) {
+        return -1;
+    }
+    for (uint32_t cluster = 2; cluster < end; cluster++) {
+        uint32_t value = get_fat_entry(fs, cluster);
+        if (value != 0 && value != 0x0FFFFFF7 &&
+            !(state->claimed[cluster / 64] >> (cluster % 64) & 1)) {
+            report->lost[cluster / 64] |= 1ULL << (cluster % 64);
+            report->lost_clusters++;
+        }
+    }
+    if (report->lost_clusters == 0) {
+        return 0;
+    }
+
+    uint64_t *heads = lost_heads(fs, report->lost);
+    if (!heads) {
+        return -1;
+    }
+    for (uint32_t word = 0; word < words; word++) {
+        report->lost_chains += __builtin_popcountll(heads[word]);
+    }
+    if (report->lost_chains == 0) {
+        report->lost_chains = 1;    /* Only loops */
+    }
+    free(heads);
+    return 0;
+}
+
+/* Check the whole tree. A pool of threads first reads every directory
+ * straight from the device, each cluster once. One thread then walks the
+ * tree breadth first in directory order, every directory chain claiming
+ * its clusters, and then the file chains in the same order, so which of
+ * two cross-linked chains owns a cluster does not depend on thread timing
+ * and a file running into a directory never cuts off its subtree.
+ * threads <= 0 uses one per online CPU. */
+int fsck_check(FileSystem *fs, int threads, FsckReport *report) {
+    memset(report, 0, sizeof(FsckReport));
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > FSCK_MAX_THREADS) {
+        threads = FSCK_MAX_THREADS;
+    }
+    report->threads = threads;
+
+    /* The readers bypass the cache, so the image must be current */
+    if (fs_flush(fs) < 0) {
+        return -1;
+    }
+
+    uint32_t words = (fs->total_clusters + 2 + 63) / 64;
+    FsckState state;
+    memset(&state, 0, sizeof(FsckState));
+    state.fs = fs;
+    state.report = report;
+    state.read = calloc(words, sizeof(uint64_t));
+    state.claimed = calloc(words, sizeof(uint64_t));
+    if (!state.read || !state.claimed) {
+        free(state.read);
+        free(state.claimed);
+        return -1;
+    }
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.ready, NULL);
+
+    /* Read pass, seeded with the root directory */
+    if (is_valid_cluster(fs, fs->root_cluster)) {
+        push_read(&state, fs->root_cluster);
+    }
+    pthread_t workers[FSCK_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, fsck_worker, &state) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        fsck_worker(&state);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    /* Check pass, from the root */
+    if (!state.failed && hash_clusters(&state) < 0) {
+        state.failed = 1;
+    }
+    if (!state.failed) {
+        FsckProblem root;
+        uint32_t *clusters = NULL;
+        memset(&root, 0, sizeof(FsckProblem));
+        root.path = "/";
+        root.type = walk_chain(&state, fs->root_cluster, &root, &clusters);
+        if (root.type != 0) {
+            add_problem(&state, &root);
+        }
+        if (root.kept > 0) {
+            push_dir(&state, strdup("/"), clusters, root.kept);
+        } else {
+            free(clusters);
+        }
+    }
+    FsckDir *done = NULL, **done_tail = &done;
+    while (state.head) {
+        FsckDir *dir = state.head;
+        state.head = dir->next;
+        if (!state.head) {
+            state.tail = NULL;
+        }
+        if (!state.failed && dir->path) {
+            check_dir(&state, dir, 0);
+        } else {
+            state.failed = 1;
+        }
+        dir->next = NULL;
+        *done_tail = dir;
+        done_tail = &dir->next;
+    }
+    while (done) {
+        FsckDir *dir = done;
+        done = dir->next;
+        if (!state.failed) {
+            check_dir(&state, dir, 1);
+        }
+        free(dir->path);
+        free(dir->clusters);
+        free(dir);
+    }
+
+    int result = state.failed ? -1 : 0;
+    if (result == 0) {
+        for (uint32_t word = 0; word < words; word++) {
+            report->clusters += __builtin_popcountll(state.claimed[word]);
+        }
+        result = find_lost(fs, &state);
+        if (report->count > 1) {
+            qsort(report->problems, report->count, sizeof(FsckProblem),
+                  problem_compare);
+        }
+    }
+
+    /* Before hashing the kept clusters are packed from the start */
+    uint32_t slots = state.mask ? state.mask + 1 : state.count;
+    for (uint32_t i = 0; i < slots; i++) {
+        free(state.clusters[i].data);
+    }
+    free(state.clusters);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.ready);
+    free(state.read);
+    free(state.claimed);
+    return result;
+}
+
+/* Follow a lost chain from start through lost clusters not yet recovered,
+ * marking them; returns its length and its last cluster in *last */
+static uint32_t follow_lost(FileSystem *fs, const uint64_t *lost,
+                            uint64_t *recovered, uint32_t start,
+                            uint32_t *last) {
+    uint32_t count = 0;
+    uint32_t cluster = start;
+    for (;;) {
+        recovered[cluster / 64] |= 1ULL << (cluster % 64);
+        count++;
+        uint32_t next = get_fat_entry(fs, cluster);
+        if (!is_valid_cluster(fs, next) ||
+            !(lost[next / 64] >> (next % 64) & 1) ||
+            (recovered[next / 64] >> (next % 64) & 1)) {
+            *last = cluster;
+            return count;
+        }
+        cluster = next;
+    }
+}
+
+/* Save one lost chain as a file FOUND.nnn in the root directory, ending
+ * the chain where it leaves the lost clusters. Returns 0, or -1 if no
+ * name is free or the entry cannot be written. */
+static int recover_chain(FileSystem *fs, const uint64_t *lost,
+                         uint64_t *recovered, uint32_t head,
+                         uint32_t *number) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    char name[16];
+    for (;; (*number)++) {
+        if (*number > 999) {
+            return -1;
+        }
+        snprintf(name, sizeof(name), "FOUND.%03u", *number);
+        DirEntry *existing = find_entry(fs, fs->root_cluster, name);
+        if (!existing) {
+            break;
+        }
+        free(existing);
+    }
+
+    uint32_t last;
+    uint32_t count = follow_lost(fs, lost, recovered, head, &last);
+    uint64_t size = (uint64_t)count * bytes_per_cluster;
+    if (size > 0xFFFFFFFFu) {
+        size = 0xFFFFFFFFu / bytes_per_cluster * bytes_per_cluster;
+    }
+    if (create_directory_entry(fs, fs->root_cluster, name, ATTR_ARCHIVE, head,
+                               (uint32_t)size) < 0) {
+        for (uint32_t cluster = head;; cluster = get_fat_entry(fs, cluster)) {
+            recovered[cluster / 64] &= ~(1ULL << (cluster % 64));
+            if (cluster == last) {
+                break;
+            }
+        }
+        return -1;
+    }
+    if (get_fat_entry(fs, last) < 0x0FFFFFF8) {
+        set_fat_entry(fs, last, 0x0FFFFFFF);
+    }
+    (*number)++;
+    return 0;
+}
+
+/* Save every lost chain as a file; chains that cannot be saved stay
+ * allocated and are counted in report->lost_left. Returns the number of
+ * files created. */
+static uint32_t recover_lost(FileSystem *fs, FsckReport *report) {
+    uint32_t end = fs->total_clusters + 2;
+    uint32_t words = (end + 63) / 64;
+    uint64_t *heads = lost_heads(fs, report->lost);
+    uint64_t *recovered = calloc(words, sizeof(uint64_t));
+    uint32_t files = 0, number = 0;
+    report->lost_left = report->lost_clusters;
+    if (!heads || !recovered) {
+        free(heads);
+        free(recovered);
+        return 0;
+    }
+
+    /* Chains with a head first, then whatever is left, which only loops */
+    for (int loops = 0; loops < 2; loops++) {
+        const uint64_t *starts = loops ? report->lost : heads;
+        for (uint32_t cluster = 2; cluster < end; cluster++) {
+            if ((starts[cluster / 64] >> (cluster % 64) & 1) &&
+                !(recovered[cluster / 64] >> (cluster % 64) & 1)) {
+                if (recover_chain(fs, report->lost, recovered, cluster,
+                                  &number) < 0) {
+                    loops = 2;
+                    break;
+                }
+                files++;
+            }
+        }
+    }
+    for (uint32_t word = 0; word < words; word++) {
+        report->lost_left -= __builtin_popcountll(recovered[word]);
+    }
+    free(heads);
+    free(recovered);
+    return files;
+}
+
+/* Fix what a check found: chains are cut after their last good cluster,
+ * sizes are reduced to what the remaining chain holds, entries of
+ * directories without a usable chain are deleted and lost chains are
+ * saved as files FOUND.nnn in the root directory, so nothing is freed.
+ * Returns the number of changes made. */
+int fsck_repair(FileSystem *fs, FsckReport *report) {
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    int repaired = 0;
+
+    for (uint32_t i = 0; i < report->count; i++) {
+        FsckProblem *problem = &report->problems[i];
+        DirEntry *entry = &problem->entry;
+        int is_dir = (entry->DIR_Attr & ATTR_DIRECTORY) != 0;
+
+        if (problem->type != FSCK_SHORT_CHAIN && problem->last != 0) {
+            set_fat_entry(fs, problem->last, 0x0FFFFFFF);
+        }
+        if (problem->dir_cluster == 0) {
+            /* The root directory has no entry */
+            dir_index_drop(fs, fs->root_cluster);
+            repaired++;
+            continue;
+        }
+
+        if (problem->kept == 0) {
+            if (is_dir) {
+                entry->DIR_Name[0] = 0xE5;
+            } else {
+                entry->DIR_FstClusHI = 0;
+                entry->DIR_FstClusLO = 0;
+            }
+        }
+        if (!is_dir &&
+            entry->DIR_FileSize > (uint64_t)problem->kept * bytes_per_cluster) {
+            entry->DIR_FileSize = problem->kept * bytes_per_cluster;
+        }
+        if (is_dir && problem->kept > 0) {
+            dir_index_drop(fs, ((uint32_t)entry->DIR_FstClusHI << 16) |
+                               entry->DIR_FstClusLO);
+        }
+        write_directory_entry(fs, problem->dir_cluster, entry, problem->slot);
+        dir_index_drop(fs, problem->dir_cluster);
+        dcache_purge_dir(fs, problem->dir_cluster);
+        repaired++;
+    }
+
+    if (report->lost_clusters > 0) {
+        report->recovered = recover_lost(fs, report);
+        if (report->recovered > 0) {
+            repaired++;
+        }
+    }
+
+    /* Open files of every session may cache chains that changed */
+    pthread_mutex_lock(&fs->volume->session_lock);
+    for (FileSystem *session = fs->volume; session;
+         session = session->next_session) {
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            if (session->open_files[i].is_open) {
+                free_extent_map(&session->open_files[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->volume->session_lock);
+    return repaired;
+}
+
+/* Release a report */
+void fsck_free(FsckReport *report) {
+    for (uint32_t i = 0; i < report->count; i++) {
+        free(report->problems[i].path);
+    }
+    free(report->problems);
+    free(report->lost);
+    memset(report, 0, sizeof(FsckReport));
+}
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "../include/lfn.h"
+
+/* Characters allowed in a short name besides letters and digits */
+static const char short_name_extra[] = "$%'-_@~`!(){}^#&";
+
+/* Characters never allowed in a long name */
+static const char long_name_invalid[] = "\"*/:<>?\\|";
+
+/* Offsets of the 13 UTF-16 characters within a long-name entry */
+static const uint8_t lfn_char_offsets[LFN_CHARS_PER_ENTRY] = {
+    1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+};
+
+/* Checksum of an 11-byte short name, stored in each of its long-name entries */
+uint8_t lfn_checksum(const uint8_t *short_name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+    }
+    return sum;
+}
+
+/* Smallest code point each sequence length may encode; anything below is
+ * an overlong form */
+static const uint32_t utf8_min_code[4] = { 0, 0x80, 0x800, 0x10000 };
+
+/* Decode UTF-8 into UTF-16; returns the number of units or -1 if the name
+ * is malformed, overlong or longer than a long name can be */
+static int utf8_to_utf16(const char *name, uint16_t *units) {
+    const uint8_t *p = (const uint8_t *)name;
+    int count = 0;
+
+    while (*p) {
+        uint32_t code;
+        int extra;
+        if (*p < 0x80) {
+            code = *p;
+            extra = 0;
+        } else if ((*p & 0xE0) == 0xC0) {
+            code = *p & 0x1F;
+            extra = 1;
+        } else if ((*p & 0xF0) == 0xE0) {
+            code = *p & 0x0F;
+            extra = 2;
+        } else if ((*p & 0xF8) == 0xF0) {
+            code = *p & 0x07;
+            extra = 3;
+        } else {
+            return -1;
+        }
+        p++;
+        for (int i = 0; i < extra; i++, p++) {
+            if ((*p & 0xC0) != 0x80) {
+                return -1;
+            }
+            code = (code << 6) | (*p & 0x3F);
+        }
+        if (code < utf8_min_code[extra] ||
+            (code >= 0xD800 && code <= 0xDFFF) || code > 0x10FFFF) {
+            return -1;
+        }
+
+        int needed = code > 0xFFFF ? 2 : 1;
+        if (count + needed > LFN_MAX_CHARS) {
+            return -1;
+        }
+        if (code > 0xFFFF) {
+            code -= 0x10000;
+            units[count++] = 0xD800 | (code >> 10);
+            units[count++] = 0xDC00 | (code & 0x3FF);
+        } else {
+            units[count++] = code;
+        }
+    }
+    return count;
+}
+
+/* Encode UTF-16 as NUL-terminated UTF-8 in a buffer of size bytes;
+ * unpaired surrogates become '_'. Returns -1 if it does not fit. */
+static int utf16_to_utf8(const uint16_t *units, int count, char *name,
+                         size_t size) {
+    uint8_t *out = (uint8_t *)name;
+    uint8_t *end = out + size;
+    for (int i = 0; i < count; i++) {
+        uint32_t code = units[i];
+        if (code >= 0xD800 && code <= 0xDBFF && i + 1 < count &&
+            units[i + 1] >= 0xDC00 && units[i + 1] <= 0xDFFF) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (units[++i] - 0xDC00);
+        } else if (code >= 0xD800 && code <= 0xDFFF) {
+            code = '_';
+        }
+
+        /* Room for the longest sequence and the terminator */
+        size_t needed = code < 0x80 ? 1 : code < 0x800 ? 2 :
+                        code < 0x10000 ? 3 : 4;
+        if ((size_t)(end - out) < needed + 1) {
+            return -1;
+        }
+        if (code < 0x80) {
+            *out++ = code;
+        } else if (code < 0x800) {
+            *out++ = 0xC0 | (code >> 6);
+            *out++ = 0x80 | (code & 0x3F);
+        } else if (code < 0x10000) {
+            *out++ = 0xE0 | (code >> 12);
+            *out++ = 0x80 | ((code >> 6) & 0x3F);
+            *out++ = 0x80 | (code & 0x3F);
+        } else {
+            *out++ = 0xF0 | (code >> 18);
+            *out++ = 0x80 | ((code >> 12) & 0x3F);
+            *out++ = 0x80 | ((code >> 6) & 0x3F);
+            *out++ = 0x80 | (code & 0x3F);
+        }
+    }
+    *out = '\0';
+    return 0;
+}
+
+/* Forget any partially collected sequence */
+void lfn_reset(LfnAssembler *lfn) {
+    lfn->count = 0;
+    lfn->expected = 0;
+}
+
+/* Collect one slot that precedes a short entry. Long-name entries must
+ * arrive in descending ordinal order in consecutive slots with the same
+ * checksum; anything else abandons the sequence. */
+void lfn_feed(LfnAssembler *lfn, const DirEntry *entry, uint32_t slot) {
+    const LfnEntry *long_entry = (const LfnEntry *)entry;
+    if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Attr != ATTR_LONG_NAME) {
+        lfn_reset(lfn);
+        return;
+    }
+
+    uint8_t ordinal = long_entry->LDIR_Ord & LFN_ORDINAL_MASK;
+    if (long_entry->LDIR_Ord & LFN_LAST_ENTRY) {
+        if (ordinal == 0 || ordinal > LFN_MAX_ENTRIES) {
+            lfn_reset(lfn);
+            return;
+        }
+        lfn->count = ordinal;
+        lfn->first_slot = slot;
+        lfn->checksum = long_entry->LDIR_Chksum;
+    } else if (lfn->count == 0 || ordinal == 0 || ordinal != lfn->expected ||
+               slot != lfn->next_slot ||
+               long_entry->LDIR_Chksum != lfn->checksum) {
+        lfn_reset(lfn);
+        return;
+    }
+
+    const uint8_t *raw = (const uint8_t *)entry;
+    uint16_t *chars = &lfn->chars[(ordinal - 1) * LFN_CHARS_PER_ENTRY];
+    for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+        chars[i] = raw[lfn_char_offsets[i]] | (raw[lfn_char_offsets[i] + 1] << 8);
+    }
+    lfn->expected = ordinal - 1;
+    lfn->next_slot = slot + 1;
+}
+
+/* Match the collected sequence against the short entry that follows it.
+ * Returns 1 and the UTF-8 long name (in a buffer of size bytes) if the
+ * sequence is complete, directly precedes slot and carries the entry's
+ * checksum; 0 otherwise, including when the name from the image is too long
+ * for the buffer, so the caller falls back to the short name. */
+int lfn_finish(LfnAssembler *lfn, const DirEntry *entry, uint32_t slot,
+               char *name, size_t size, uint32_t *first_slot) {
+    int valid = lfn->count > 0 && lfn->expected == 0 &&
+                slot == lfn->next_slot &&
+                lfn->checksum == lfn_checksum(entry->DIR_Name);
+    int length = 0;
+    if (valid) {
+        int limit = lfn->count * LFN_CHARS_PER_ENTRY;
+        while (length < limit && lfn->chars[length] != 0x0000 &&
+               lfn->chars[length] != 0xFFFF) {
+            length++;
+        }
+    }
+    lfn_reset(lfn);
+    if (length == 0 || utf16_to_utf8(lfn->chars, length, name, size) < 0) {
+        return 0;
+    }
+
+    if (first_slot) {
+        *first_slot = lfn->first_slot;
+    }
+    return 1;
+}
+
+/* Check whether a name can be stored as a long name */
+int lfn_valid_name(const char *name) {
+    uint16_t units[LFN_MAX_CHARS];
+    size_t len = strlen(name);
+    if (len == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    /* Trailing dots and spaces are not kept by other implementations */
+    if (name[len - 1] == '.' || name[len - 1] == ' ') {
+        return 0;
+    }
+
+    /* Check what the name decodes to, not its bytes */
+    int count = utf8_to_utf16(name, units);
+    if (count <= 0) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (units[i] < 0x20 ||
+            (units[i] < 0x80 && strchr(long_name_invalid, units[i]))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Check whether a character may appear in a short name */
+static int short_char_valid(char c) {
+    return isalnum((uint8_t)c) || (c && strchr(short_name_extra, c));
+}
+
+/* Check whether a name needs long-name entries, i.e. is not already a
+ * valid 8.3 name (case is not preserved for short names) */
+int lfn_needed(const char *name) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    const char *dot = strchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+
+    if (base == 0 || base > 8 || ext > 3 || (dot && ext == 0)) {
+        return 1;
+    }
+    for (const char *p = name; *p; p++) {
+        if (p != dot && !short_char_valid(*p)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Copy name characters into a short name field, upper-casing them and
+ * replacing characters a short name cannot hold with '_' */
+static int short_copy(const char *start, const char *end, char *out, int limit) {
+    int o = 0;
+    for (const uint8_t *p = (const uint8_t *)start;
+         p < (const uint8_t *)end && o < limit; p++) {
+        if (*p == ' ' || *p == '.' || (*p & 0xC0) == 0x80) {
+            continue;
+        }
+        out[o++] = short_char_valid(*p) ? toupper(*p) : '_';
+    }
+    return o;
+}
+
+/* Derive the 11-byte basis of a long name's short alias: leading dots and
+ * all spaces dropped, the base before the last dot, the first three
+ * characters of the extension after it */
+void lfn_short_basis(const char *name, char *basis) {
+    memset(basis, ' ', 11);
+    basis[11] = '\0';
+
+    while (*name == '.') {
+        name++;
+    }
+    const char *dot = strrchr(name, '.');
+    const char *end = dot ? dot : name + strlen(name);
+
+    if (short_copy(name, end, basis, 8) == 0) {
+        basis[0] = '_';
+    }
+    if (dot) {
+        short_copy(dot + 1, dot + strlen(dot), basis + 8, 3);
+    }
+}
+
+/* Build the attempt-th candidate alias from a basis: "~1" to "~4" tails on
+ * the basis itself, then the first two characters plus a hash of the long
+ * name so heavily shared prefixes do not need long probe sequences */
+void lfn_short_alias(const char *basis, const char *name, uint32_t attempt,
+                     char *alias) {
+    char base[9];
+    char tail[12];
+    int base_len = 0;
+
+    memcpy(alias, basis, 11);
+    alias[11] = '\0';
+    while (base_len < 8 && basis[base_len] != ' ') {
+        base_len++;
+    }
+    memcpy(base, basis, base_len);
+
+    if (attempt <= 4) {
+        snprintf(tail, sizeof(tail), "~%u", attempt);
+    } else {
+        if (base_len > 2) {
+            base_len = 2;
+        }
+        base_len += snprintf(base + base_len, sizeof(base) - base_len, "%04X",
+                             lfn_hash(name) & 0xFFFF);
+        snprintf(tail, sizeof(tail), "~%u", attempt - 4);
+    }
+
+    int tail_len = strlen(tail);
+    if (base_len > 8 - tail_len) {
+        base_len = 8 - tail_len;
+    }
+    memset(alias, ' ', 8);
+    memcpy(alias, base, base_len);
+    memcpy(alias + base_len, tail, tail_len);
+}
+
+/* Build the long-name entries for name in on-disk order (highest ordinal
+ * first); returns how many there are or -1 if name cannot be encoded */
+int lfn_build_entries(const char *name, const uint8_t *short_name,
+                      LfnEntry *entries) {
+    uint16_t units[LFN_MAX_CHARS];
+    int length = utf8_to_utf16(name, units);
+    if (length <= 0) {
+        return -1;
+    }
+
+    int count = (length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+    uint8_t checksum = lfn_checksum(short_name);
+
+    for (int n = 0; n < count; n++) {
+        LfnEntry *entry = &entries[count - 1 - n];
+        uint8_t *raw = (uint8_t *)entry;
+        memset(entry, 0, sizeof(LfnEntry));
+        entry->LDIR_Ord = (n + 1) | (n == count - 1 ? LFN_LAST_ENTRY : 0);
+        entry->LDIR_Attr = ATTR_LONG_NAME;
+        entry->LDIR_Chksum = checksum;
+
+        /* The name ends with one NUL, padded with 0xFFFF */
+        for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+            int position = n * LFN_CHARS_PER_ENTRY + i;
+            uint16_t unit = position < length ? units[position] :
+                            position == length ? 0x0000 : 0xFFFF;
+            raw[lfn_char_offsets[i]] = unit & 0xFF;
+            raw[lfn_char_offsets[i] + 1] = unit >> 8;
+        }
+    }
+    return count;
+}
+
+/* FNV-1a hash of a name with ASCII letters folded to lower case */
+uint32_t lfn_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const uint8_t *p = (const uint8_t *)name; *p; p++) {
+        hash ^= tolower(*p);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Compare two names ignoring the case of ASCII letters */
+int lfn_name_equal(const char *a, const char *b) {
+    return strcasecmp(a, b) == 0;
+}
@@ -0,0 +1,1297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../include/libfat32.h"
+#include "../include/fat32.h"
+#include "../include/dirindex.h"
+#include "../include/path.h"
+#include "../include/lfn.h"
+
+/* Open directory: a cursor over its entries */
+struct Fat32Dir {
+    FileSystem *fs;
+    uint32_t cluster;
+    DirIterator it;
+};
+
+/* fat32_strerror texts, by negated error code */
+static const char *error_messages[] = {
+    "Success",
+    "No such file or directory",
+    "Parent directory does not exist",
+    "Not a directory",
+    "Is a directory",
+    "File exists",
+    "Directory is not empty",
+    "Invalid name",
+    "Invalid argument",
+    "File is open",
+    "In use by another handle",
+    "File is already open",
+    "Too many open files",
+    "Bad file descriptor",
+    "File is not open for this access",
+    "No free clusters available",
+    "Corrupt cluster chain",
+    "Input/output error",
+    "Out of memory",
+    "Cannot move a directory into itself",
+    "File too large for FAT32",
+};
+
+/* Helper: First cluster stored in a directory entry */
+static uint32_t entry_cluster(const DirEntry *entry) {
+    return ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+}
+
+/* Helper: Describe a directory entry */
+static void fill_stat(FileSystem *fs, const DirEntry *entry, Fat32Stat *st) {
+    st->size = entry->DIR_FileSize;
+    st->cluster = entry_cluster(entry);
+    st->attr = entry->DIR_Attr;
+    st->is_dir = (entry->DIR_Attr & ATTR_DIRECTORY) != 0;
+
+    /* ".." entries store 0 for the root directory */
+    if (st->is_dir && st->cluster == 0) {
+        st->cluster = fs->root_cluster;
+    }
+}
+
+/* Helper: Finish a call that changed the image the way a shell command
+ * is finished; a failed write-out fails the call. result may be a byte
+ * count of 2 GiB or more. */
+static ssize_t commit(FileSystem *fs, ssize_t result) {
+    if (fs_commit(fs) < 0 && result >= 0) {
+        return FAT32_ERR_IO;
+    }
+    return result;
+}
+
+/* Helper: Find open file by the short name of its entry, which is unique
+ * within its directory whatever name it was opened by. The caller holds
+ * the open file table lock. */
+static OpenFile *find_open_file_locked(FileSystem *fs, uint32_t dir_cluster,
+                                       const uint8_t *short_name) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (fs->open_files[i].is_open &&
+            fs->open_files[i].dir_cluster == dir_cluster &&
+            memcmp(fs->open_files[i].short_name, short_name, 11) == 0) {
+            return &fs->open_files[i];
+        }
+    }
+    return NULL;
+}
+
+/* Helper: find_open_file_locked under the open file table lock */
+static OpenFile *find_open_file(FileSystem *fs, uint32_t dir_cluster,
+                                const uint8_t *short_name) {
+    pthread_mutex_lock(&fs->open_lock);
+    OpenFile *file = find_open_file_locked(fs, dir_cluster, short_name);
+    pthread_mutex_unlock(&fs->open_lock);
+    return file;
+}
+
+/* Helper: Check whether another session has the same entry open, and if
+ * writing is given whether for writing. A file may be open in several
+ * sessions only while none of them can write to it. */
+static int find_other_open_file(FileSystem *fs, uint32_t dir_cluster,
+                                const uint8_t *short_name, int *writing) {
+    int found = 0;
+    pthread_mutex_lock(&fs->volume->session_lock);
+    for (FileSystem *session = fs->volume; session && !found;
+         session = session->next_session) {
+        if (session == fs) {
+            continue;
+        }
+        pthread_mutex_lock(&session->open_lock);
+        OpenFile *file = find_open_file_locked(session, dir_cluster,
+                                               short_name);
+        if (file) {
+            found = 1;
+            if (writing) {
+                *writing = strchr(file->mode, 'w') != NULL;
+            }
+        }
+        pthread_mutex_unlock(&session->open_lock);
+    }
+    pthread_mutex_unlock(&fs->volume->session_lock);
+    return found;
+}
+
+/* Helper: Check whether any session has the file open; the caller holds
+ * the write lock of its directory, as add_open_file's caller does */
+static int file_in_use(FileSystem *fs, uint32_t dir_cluster,
+                       const uint8_t *short_name) {
+    return find_open_file(fs, dir_cluster, short_name) ||
+           find_other_open_file(fs, dir_cluster, short_name, NULL);
+}
+
+/* Helper: Take a free descriptor for a file not yet open in this session;
+ * the caller holds the write lock of its directory */
+static int add_open_file(FileSystem *fs, const char *filename,
+                         const char *mode, const char *path,
+                         uint32_t dir_cluster, const uint8_t *short_name,
+                         uint32_t first_cluster, uint32_t size) {
+    int fd = FAT32_ERR_TOO_MANY_OPEN;
+    pthread_mutex_lock(&fs->open_lock);
+    if (find_open_file_locked(fs, dir_cluster, short_name)) {
+        fd = FAT32_ERR_ALREADY_OPEN;
+    }
+    for (int i = 0; i < MAX_OPEN_FILES && fd == FAT32_ERR_TOO_MANY_OPEN;
+         i++) {
+        if (!fs->open_files[i].is_open) {
+            strncpy(fs->open_files[i].filename, filename, MAX_PATH_LENGTH - 1);
+            fs->open_files[i].filename[MAX_PATH_LENGTH - 1] = '\0';
+            memcpy(fs->open_files[i].short_name, short_name, 11);
+            strcpy(fs->open_files[i].mode, mode);
+            strncpy(fs->open_files[i].path, path, MAX_PATH_LENGTH - 1);
+            fs->open_files[i].path[MAX_PATH_LENGTH - 1] = '\0';
+            fs->open_files[i].offset = 0;
+            fs->open_files[i].dir_cluster = dir_cluster;
+            fs->open_files[i].first_cluster = first_cluster;
+            fs->open_files[i].size = size;
+            fs->open_files[i].is_open = 1;
+            release_open_file(&fs->open_files[i]);
+            fd = i;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    return fd;
+}
+
+/* Helper: Open file of a descriptor, NULL if it is not open */
+static OpenFile *descriptor(FileSystem *fs, int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !fs->open_files[fd].is_open) {
+        return NULL;
+    }
+    return &fs->open_files[fd];
+}
+
+/* Helper: Re-read an open file's directory entry, which calls on other
+ * descriptors or handles may have changed, into its first cluster and
+ * size. The entry is found by short name through the directory index. */
+static int refresh_open_file(FileSystem *fs, OpenFile *file,
+                             DirEntry *entry) {
+    DirEntry found;
+    int result = FAT32_ERR_NOT_FOUND;
+
+    dir_lock_read(fs, file->dir_cluster);
+    DirIndex *index = dir_index_get(fs, file->dir_cluster);
+    if (index) {
+        DirIndexRecord *record = dir_index_lookup(index,
+                                                  (const char *)file->short_name);
+        if (record) {
+            found = record->entry;
+            result = FAT32_OK;
+        }
+        dir_index_put(fs, index);
+    } else {
+        /* Fall back to a scan if the index could not be built */
+        DirIterator it;
+        DirEntry *current;
+        dir_iter_open(fs, &it, file->dir_cluster);
+        while ((current = dir_iter_next(&it, NULL)) != NULL) {
+            if (memcmp(current->DIR_Name, file->short_name, 11) == 0) {
+                found = *current;
+                result = FAT32_OK;
+                break;
+            }
+        }
+        dir_iter_close(&it);
+    }
+    dir_unlock(fs, file->dir_cluster);
+    if (result < 0) {
+        return result;
+    }
+
+    uint32_t first_cluster = entry_cluster(&found);
+    if (file->first_cluster != first_cluster) {
+        file->first_cluster = first_cluster;
+        file->extents_valid = 0;
+    }
+    file->size = found.DIR_FileSize;
+    if (entry) {
+        *entry = found;
+    }
+    return FAT32_OK;
+}
+
+/* Helper: Store a file's first cluster and size in its directory entry */
+static void update_file_entry(FileSystem *fs, uint32_t dir_cluster,
+                              const uint8_t *short_name, uint32_t first_cluster,
+                              uint32_t size) {
+    DirIterator it;
+    DirEntry *dir_entry;
+    int entry_index;
+    dir_lock_write(fs, dir_cluster);
+    dir_iter_open(fs, &it, dir_cluster);
+    while ((dir_entry = dir_iter_next(&it, &entry_index)) != NULL) {
+        if (memcmp(dir_entry->DIR_Name, short_name, 11) == 0) {
+            dir_entry->DIR_FileSize = size;
+            dir_entry->DIR_FstClusHI = (first_cluster >> 16) & 0xFFFF;
+            dir_entry->DIR_FstClusLO = first_cluster & 0xFFFF;
+            write_directory_entry(fs, dir_cluster, dir_entry, entry_index);
+            break;
+        }
+    }
+    dir_iter_close(&it);
+    dir_unlock(fs, dir_cluster);
+}
+
+/* Helper: Point a moved directory's ".." entry at its new parent */
+static void set_parent_link(FileSystem *fs, uint32_t dir_cluster,
+                            uint32_t parent) {
+    uint32_t value = (parent == fs->root_cluster) ? 0 : parent;
+    char formatted_name[12];
+    format_filename("..", formatted_name);
+
+    DirIterator it;
+    DirEntry *entry;
+    int entry_index;
+    dir_lock_write(fs, dir_cluster);
+    dir_iter_open(fs, &it, dir_cluster);
+    while ((entry = dir_iter_next(&it, &entry_index)) != NULL) {
+        if (memcmp(entry->DIR_Name, formatted_name, 11) == 0) {
+            entry->DIR_FstClusHI = (value >> 16) & 0xFFFF;
+            entry->DIR_FstClusLO = value & 0xFFFF;
+            write_directory_entry(fs, dir_cluster, entry, entry_index);
+            break;
+        }
+    }
+    dir_iter_close(&it);
+    dir_unlock(fs, dir_cluster);
+    dcache_invalidate(fs, dir_cluster, "..");
+}
+
+/* Helper: Rewrite path if it lies under old_prefix */
+static void rebase_path(char *path, const char *old_prefix,
+                        const char *new_prefix) {
+    size_t old_len = strlen(old_prefix);
+    if (strncmp(path, old_prefix, old_len) != 0 ||
+        (path[old_len] != '\0' && path[old_len] != '/')) {
+        return;
+    }
+
+    char rebased[MAX_PATH_LENGTH];
+    const char *rest = path + old_len;
+    if (strcmp(new_prefix, "/") == 0 && *rest == '/') {
+        new_prefix = "";
+    }
+    if (strlen(new_prefix) + strlen(rest) >= MAX_PATH_LENGTH) {
+        return;
+    }
+    snprintf(rebased, sizeof(rebased), "%s%s", new_prefix, rest);
+    strcpy(path, rebased[0] ? rebased : "/");
+}
+
+/* Helper: Lock the directory a resolved path lies in for writing, so a
+ * check and the change it allows cannot be split by another session.
+ * Fails, unlocked, if the directory was removed since it was resolved. */
+static int lock_parent(FileSystem *fs, const PathTarget *target) {
+    dir_lock_write(fs, target->parent);
+    if (!directory_exists(fs, target->parent)) {
+        dir_unlock(fs, target->parent);
+        return -1;
+    }
+    return 0;
+}
+
+/* Helper: Create an empty file with no clusters; the caller holds the
+ * lock_parent lock */
+static int create_file_locked(FileSystem *fs, const PathTarget *target) {
+    if (!lfn_valid_name(target->name)) {
+        return FAT32_ERR_INVALID_NAME;
+    }
+
+    DirEntry *existing = find_entry(fs, target->parent, target->name);
+    if (existing) {
+        free(existing);
+        return FAT32_ERR_EXISTS;
+    }
+
+    if (create_directory_entry(fs, target->parent, target->name,
+                               ATTR_ARCHIVE, 0, 0) < 0) {
+        return FAT32_ERR_IO;
+    }
+    return FAT32_OK;
+}
+
+/* Helper: Read up to count bytes of an open file at offset; stops at the
+ * end of the file */
+static ssize_t read_at(FileSystem *fs, OpenFile *file, void *buffer,
+                       size_t count, uint32_t offset) {
+    if (strchr(file->mode, 'r') == NULL) {
+        return FAT32_ERR_ACCESS;
+    }
+    int result = refresh_open_file(fs, file, NULL);
+    if (result < 0) {
+        return result;
+    }
+    if (offset >= file->size || file->first_cluster == 0) {
+        return 0;
+    }
+
+    uint32_t want = file->size - offset;
+    if (count < want) {
+        want = count;
+    }
+    uint32_t done = 0;
+    while (done < want) {
+        ssize_t n = file_read_ahead(fs, file, offset + done,
+                                    (uint8_t *)buffer + done, want - done);
+        if (n < 0) {
+            return done > 0 ? (ssize_t)done : FAT32_ERR_IO;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Helper: Write count bytes of an open file at offset, growing the file
+ * as needed */
+static ssize_t write_at(FileSystem *fs, OpenFile *file, const void *buffer,
+                        size_t count, uint32_t offset) {
+    if (strchr(file->mode, 'w') == NULL) {
+        return FAT32_ERR_ACCESS;
+    }
+    if ((uint64_t)offset + count > 0xFFFFFFFFULL) {
+        return FAT32_ERR_TOO_LARGE;
+    }
+    int result = refresh_open_file(fs, file, NULL);
+    if (result < 0) {
+        return result;
+    }
+
+    uint32_t length = (uint32_t)count;
+    uint32_t old_size = file->size;
+    uint32_t new_size = offset + length;
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+
+    /* A write past the end leaves zeroes in between, as truncate does */
+    if (offset > file->size && file_truncate(fs, file, offset) < 0) {
+        return commit(fs, FAT32_ERR_NO_SPACE);
+    }
+
+    /* Current cluster count and tail come from the extent map */
+    if (!file->extents_valid && build_extent_map(fs, file) < 0) {
+        return FAT32_ERR_CORRUPT;
+    }
+
+    uint32_t clusters_needed = (uint32_t)(((uint64_t)new_size +
+                                           bytes_per_cluster - 1) /
+                                          bytes_per_cluster);
+    uint32_t clusters_allocated = file->num_clusters;
+    uint32_t last_cluster = file->tail_cluster;
+
+    /* Allocate the missing clusters as one extent after the tail. The
+     * write below fills them up to new_size, so only the slack after it
+     * needs zeroing. */
+    if (clusters_needed > clusters_allocated) {
+        uint32_t allocated_bytes = clusters_allocated * bytes_per_cluster;
+        uint32_t data_bytes = offset <= allocated_bytes ?
+                              new_size - allocated_bytes : 0;
+        uint32_t new_chain = allocate_clusters(fs,
+                                               clusters_needed - clusters_allocated,
+                                               last_cluster + 1, data_bytes);
+        if (new_chain == 0) {
+            return commit(fs, FAT32_ERR_NO_SPACE);
+        }
+        if (last_cluster != 0) {
+            set_fat_entry(fs, last_cluster, new_chain);
+        } else {
+            file->first_cluster = new_chain;
+        }
+        extent_map_append(fs, file, new_chain);
+    }
+
+    /* Write all extents in one batch */
+    if (file_write(fs, file, offset, buffer, length) < 0) {
+        return commit(fs, FAT32_ERR_IO);
+    }
+
+    /* Update the directory entry if the file grew */
+    if (new_size > file->size) {
+        file->size = new_size;
+    }
+    if (file->size != old_size) {
+        update_file_entry(fs, file->dir_cluster, file->short_name,
+                          file->first_cluster, file->size);
+    }
+    return commit(fs, count);
+}
+
+/* Helper: Change a file's size (truncate) or reserve clusters for it
+ * without changing its size (fallocate), through its open descriptor if
+ * it has one */
+static int resize_file(FileSystem *fs, const char *path, uint32_t size,
+                       int reserve) {
+    PathTarget target;
+    DirEntry *entry = lookup_path(fs, path, &target);
+    if (!entry) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (entry->DIR_Attr & ATTR_DIRECTORY) {
+        free(entry);
+        return FAT32_ERR_IS_DIR;
+    }
+    if (find_other_open_file(fs, target.parent, entry->DIR_Name, NULL)) {
+        free(entry);
+        return FAT32_ERR_BUSY;
+    }
+
+    OpenFile scratch;
+    OpenFile *file = find_open_file(fs, target.parent, entry->DIR_Name);
+    if (!file) {
+        open_file_init(&scratch);
+        file = &scratch;
+    }
+    uint32_t first_cluster = entry_cluster(entry);
+    if (file->first_cluster != first_cluster) {
+        file->first_cluster = first_cluster;
+        file->extents_valid = 0;
+    }
+    file->size = entry->DIR_FileSize;
+
+    int result = reserve ? file_reserve(fs, file, size) :
+                           file_truncate(fs, file, size);
+    if (result < 0) {
+        result = FAT32_ERR_NO_SPACE;
+    } else {
+        update_file_entry(fs, target.parent, entry->DIR_Name,
+                          file->first_cluster, file->size);
+        if (file->offset > file->size) {
+            file->offset = file->size;
+        }
+    }
+
+    if (file == &scratch) {
+        open_file_destroy(&scratch);
+    }
+    free(entry);
+    return commit(fs, result);
+}
+
+/* Fill in the default mount options */
+void fat32_default_options(Fat32Options *options) {
+    memset(options, 0, sizeof(Fat32Options));
+    options->cache_sectors = DEFAULT_CACHE_SECTORS;
+}
+
+/* Mount an image; options may be NULL for the defaults */
+int fat32_mount(const char *image_path, const Fat32Options *options,
+                Fat32 **fs) {
+    Fat32Options defaults;
+    if (!options) {
+        fat32_default_options(&defaults);
+        options = &defaults;
+    }
+    MountOptions mount = {
+        options->mmap ? BACKEND_MMAP : BACKEND_PREAD,
+        options->cache_sectors,
+        options->io_uring ? IO_ENGINE_URING : IO_ENGINE_SYNC,
+        options->write_back,
+        options->compact_threshold
+    };
+
+    FileSystem *volume = malloc(sizeof(FileSystem));
+    if (!volume) {
+        return FAT32_ERR_NO_MEMORY;
+    }
+    if (mount_image(volume, image_path, &mount) < 0) {
+        free(volume);
+        return FAT32_ERR_IO;
+    }
+    *fs = volume;
+    return FAT32_OK;
+}
+
+/* Write everything back and release a handle from fat32_mount, once
+ * the sessions opened on it are closed */
+void fat32_unmount(Fat32 *fs) {
+    close_image(fs);
+    free(fs);
+}
+
+/* Open another handle on the mount fs belongs to: it shares the image
+ * and every cache, and starts at the root with no descriptors */
+int fat32_session_open(Fat32 *fs, Fat32 **session) {
+    FileSystem *handle = malloc(sizeof(FileSystem));
+    if (!handle) {
+        return FAT32_ERR_NO_MEMORY;
+    }
+    session_open(fs->volume, handle);
+    *session = handle;
+    return FAT32_OK;
+}
+
+/* Close a handle from fat32_session_open with its descriptors, writing
+ * back anything still buffered */
+void fat32_session_close(Fat32 *session) {
+    FileSystem *volume = session->volume;
+    session_close(session);
+    free(session);
+    fs_flush(volume);
+}
+
+/* Write everything back and make it durable */
+int fat32_sync(Fat32 *fs) {
+    return fs_sync(fs) < 0 ? FAT32_ERR_IO : FAT32_OK;
+}
+
+/* Describe an error code */
+const char *fat32_strerror(int error) {
+    int count = sizeof(error_messages) / sizeof(error_messages[0]);
+    if (error > 0 || -error >= count) {
+        return "Unknown error";
+    }
+    return error_messages[-error];
+}
+
+/* Open a file; returns its descriptor */
+int fat32_open(Fat32 *fs, const char *path, int flags) {
+    int access = flags & FAT32_O_RDWR;
+    if (access == 0 || (flags & ~(FAT32_O_RDWR | FAT32_O_CREAT |
+                                  FAT32_O_EXCL)) != 0) {
+        return FAT32_ERR_INVALID;
+    }
+
+    /* The entry is looked up and taken under its directory's lock, so an
+     * unlink in another session sees it open or does not leave it open */
+    PathTarget target;
+    int create = (flags & FAT32_O_CREAT) != 0;
+    if (resolve_path(fs, path, &target) != PATH_OK ||
+        lock_parent(fs, &target) < 0) {
+        return create ? FAT32_ERR_NO_PARENT : FAT32_ERR_NOT_FOUND;
+    }
+    if (create) {
+        int result = create_file_locked(fs, &target);
+        if (result == FAT32_OK) {
+            result = commit(fs, result);
+        }
+        if (result < 0 &&
+            (result != FAT32_ERR_EXISTS || (flags & FAT32_O_EXCL))) {
+            dir_unlock(fs, target.parent);
+            return result;
+        }
+    }
+    DirEntry *entry = find_entry(fs, target.parent, target.name);
+    if (!entry) {
+        dir_unlock(fs, target.parent);
+        return FAT32_ERR_NOT_FOUND;
+    }
+
+    int fd;
+    int writing = 0;
+    if (entry->DIR_Attr & ATTR_DIRECTORY) {
+        fd = FAT32_ERR_IS_DIR;
+    } else if (find_open_file(fs, target.parent, entry->DIR_Name)) {
+        fd = FAT32_ERR_ALREADY_OPEN;
+    } else if (find_other_open_file(fs, target.parent, entry->DIR_Name,
+                                    &writing) &&
+               ((access & FAT32_O_WRONLY) || writing)) {
+        fd = FAT32_ERR_BUSY;
+    } else {
+        const char *mode = access == FAT32_O_RDWR ? "rw" :
+                           access == FAT32_O_WRONLY ? "w" : "r";
+        fd = add_open_file(fs, target.name, mode, target.dir_path,
+                           target.parent, entry->DIR_Name, entry_cluster(entry),
+                           entry->DIR_FileSize);
+    }
+    dir_unlock(fs, target.parent);
+    free(entry);
+    return fd;
+}
+
+/* Close a descriptor, writing back anything still buffered */
+int fat32_close(Fat32 *fs, int fd) {
+    OpenFile *file = descriptor(fs, fd);
+    if (!file) {
+        return FAT32_ERR_BAD_FD;
+    }
+
+    pthread_mutex_lock(&fs->open_lock);
+    file->is_open = 0;
+    release_open_file(file);
+    pthread_mutex_unlock(&fs->open_lock);
+
+    return fs_flush(fs) < 0 ? FAT32_ERR_IO : FAT32_OK;
+}
+
+/* Descriptor this handle has open on path; FAT32_ERR_BAD_FD if the file
+ * exists but is not open */
+int fat32_find_fd(Fat32 *fs, const char *path) {
+    PathTarget target;
+    DirEntry *entry = lookup_path(fs, path, &target);
+    if (!entry) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (entry->DIR_Attr & ATTR_DIRECTORY) {
+        free(entry);
+        return FAT32_ERR_IS_DIR;
+    }
+    OpenFile *file = find_open_file(fs, target.parent, entry->DIR_Name);
+    free(entry);
+    return file ? (int)(file - fs->open_files) : FAT32_ERR_BAD_FD;
+}
+
+/* Read at an offset; returns the bytes read, 0 at the end of the file */
+ssize_t fat32_pread(Fat32 *fs, int fd, void *buffer, size_t count,
+                    uint32_t offset) {
+    OpenFile *file = descriptor(fs, fd);
+    if (!file) {
+        return FAT32_ERR_BAD_FD;
+    }
+    return read_at(fs, file, buffer, count, offset);
+}
+
+/* Write at an offset; returns the bytes written */
+ssize_t fat32_pwrite(Fat32 *fs, int fd, const void *buffer, size_t count,
+                     uint32_t offset) {
+    OpenFile *file = descriptor(fs, fd);
+    if (!file) {
+        return FAT32_ERR_BAD_FD;
+    }
+    return write_at(fs, file, buffer, count, offset);
+}
+
+/* Read at the descriptor's offset and advance it */
+ssize_t fat32_read(Fat32 *fs, int fd, void *buffer, size_t count) {
+    OpenFile *file = descriptor(fs, fd);
+    if (!file) {
+        return FAT32_ERR_BAD_FD;
+    }
+    ssize_t result = read_at(fs, file, buffer, count, file->offset);
+    if (result > 0) {
+        file->offset += result;
+    }
+    return result;
+}
+
+/* Write at the descriptor's offset and advance it */
+ssize_t fat32_write(Fat32 *fs, int fd, const void *buffer, size_t count) {
+    OpenFile *file = descriptor(fs, fd);
+    if (!file) {
+        return FAT32_ERR_BAD_FD;
+    }
+    ssize_t result = write_at(fs, file, buffer, count, file->offset);
+    if (result > 0) {
+        file->offset += result;
+    }
+    return result;
+}
+
+/* Copy up to count bytes from the descriptor's offset to a host file
+ * descriptor, handing the extents to the kernel, and advance the offset */
+ssize_t fat32_sendfile(Fat32 *fs, int out_fd, int fd, size_t count) {
+    OpenFile *file = descriptor(fs, fd);
+    if (!file) {
+        return FAT32_ERR_BAD_FD;
+    }
+    if (strchr(file->mode, 'r') == NULL) {
+        return FAT32_ERR_ACCESS;
+    }
+    int result = refresh_open_file(fs, file, NULL);
+    if (result < 0) {
+        return result;
+    }
+    if (file->offset >= file->size || file->first_cluster == 0) {
+        return 0;
+    }
+
+    uint32_t want = file->size - file->offset;
+    if (count < want) {
+        want = count;
+    }
+    ssize_t copied = file_export(fs, file, file->offset, want, out_fd);
+    if (copied < 0) {
+        return FAT32_ERR_IO;
+    }
+    file->offset += copied;
+    return copied;
+}
+
+/* Set the descriptor's offset, at most to the end of the file */
+int fat32_lseek(Fat32 *fs, int fd, uint32_t offset) {
+    OpenFile *file = descriptor(fs, fd);
+    if (!file) {
+        return FAT32_ERR_BAD_FD;
+    }
+    int result = refresh_open_file(fs, file, NULL);
+    if (result < 0) {
+        return result;
+    }
+    if (offset > file->size) {
+        return FAT32_ERR_INVALID;
+    }
+    file->offset = offset;
+    return FAT32_OK;
+}
+
+/* Describe an open file */
+int fat32_fstat(Fat32 *fs, int fd, Fat32Stat *st) {
+    OpenFile *file = descriptor(fs, fd);
+    if (!file) {
+        return FAT32_ERR_BAD_FD;
+    }
+    DirEntry entry;
+    int result = refresh_open_file(fs, file, &entry);
+    if (result == FAT32_OK) {
+        fill_stat(fs, &entry, st);
+    }
+    return result;
+}
+
+/* Create a file holding the contents of a regular host file, read
+ * from its start. The chain is allocated up front and the entry is
+ * written once the data is in, with its final size. */
+int fat32_import(Fat32 *fs, const char *path, int host_fd) {
+    PathTarget target;
+    if (resolve_path(fs, path, &target) != PATH_OK) {
+        return FAT32_ERR_NO_PARENT;
+    }
+    if (!lfn_valid_name(target.name)) {
+        return FAT32_ERR_INVALID_NAME;
+    }
+    DirEntry *existing = find_entry(fs, target.parent, target.name);
+    if (existing) {
+        free(existing);
+        return FAT32_ERR_EXISTS;
+    }
+
+    struct stat st;
+    if (fstat(host_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return FAT32_ERR_INVALID;
+    }
+    if ((uint64_t)st.st_size > 0xFFFFFFFFULL) {
+        return FAT32_ERR_TOO_LARGE;
+    }
+    posix_fadvise(host_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* The data fills the whole chain but the slack of the last cluster */
+    uint32_t size = (uint32_t)st.st_size;
+    uint32_t bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                                 fs->boot_sector.BPB_SecPerClus;
+    uint32_t clusters = (uint32_t)(((uint64_t)size + bytes_per_cluster - 1) /
+                                   bytes_per_cluster);
+    uint32_t first_cluster = 0;
+    if (clusters > 0) {
+        first_cluster = allocate_clusters(fs, clusters, 0, size);
+        if (first_cluster == 0) {
+            return FAT32_ERR_NO_SPACE;
+        }
+    }
+
+    /* Stream the file through in large sequential batches */
+    OpenFile file;
+    open_file_init(&file);
+    file.first_cluster = first_cluster;
+    file.size = size;
+
+    uint8_t *buffer = malloc(TRANSFER_BUFFER_SIZE);
+    uint32_t done = 0;
+    int result = buffer ? FAT32_OK : FAT32_ERR_NO_MEMORY;
+    while (result == FAT32_OK && done < size) {
+        uint32_t want = size - done < TRANSFER_BUFFER_SIZE ?
+                        size - done : TRANSFER_BUFFER_SIZE;
+        uint32_t have = 0;
+        while (have < want) {
+            ssize_t n = pread(host_fd, buffer + have, want - have,
+                              (off_t)done + have);
+            if (n <= 0) {
+                break;
+            }
+            have += n;
+        }
+        if (have < want || file_write(fs, &file, done, buffer, have) < 0) {
+            result = FAT32_ERR_IO;
+            break;
+        }
+        done += have;
+
+        /* Keep write-back mode from buffering the whole file */
+        fs_commit(fs);
+    }
+    free(buffer);
+    open_file_destroy(&file);
+
+    /* The name may have been taken, or the directory removed, meanwhile */
+    if (result == FAT32_OK) {
+        if (lock_parent(fs, &target) < 0) {
+            result = FAT32_ERR_NO_PARENT;
+        } else {
+            existing = find_entry(fs, target.parent, target.name);
+            if (existing) {
+                free(existing);
+                result = FAT32_ERR_EXISTS;
+            } else if (create_directory_entry(fs, target.parent, target.name,
+                                              ATTR_ARCHIVE, first_cluster,
+                                              size) < 0) {
+                result = FAT32_ERR_IO;
+            }
+            dir_unlock(fs, target.parent);
+        }
+    }
+    if (result < 0) {
+        free_cluster_chain(fs, first_cluster);
+    }
+    return commit(fs, result);
+}
+
+/* Copy a whole file to a host descriptor at its current position;
+ * returns the bytes copied */
+ssize_t fat32_export(Fat32 *fs, const char *path, int host_fd) {
+    PathTarget target;
+    DirEntry *entry = lookup_path(fs, path, &target);
+    if (!entry) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (entry->DIR_Attr & ATTR_DIRECTORY) {
+        free(entry);
+        return FAT32_ERR_IS_DIR;
+    }
+
+    OpenFile file;
+    open_file_init(&file);
+    file.first_cluster = entry_cluster(entry);
+    file.size = entry->DIR_FileSize;
+    free(entry);
+
+    ssize_t result = 0;
+    if (file.first_cluster != 0 && file.size > 0) {
+        result = file_export(fs, &file, 0, file.size, host_fd);
+    }
+    open_file_destroy(&file);
+    return result < 0 ? FAT32_ERR_IO : result;
+}
+
+/* Describe the entry a path names */
+int fat32_stat(Fat32 *fs, const char *path, Fat32Stat *st) {
+    PathTarget target;
+    DirEntry *entry = lookup_path(fs, path, &target);
+    if (entry) {
+        fill_stat(fs, entry, st);
+        free(entry);
+        return FAT32_OK;
+    }
+
+    /* The root directory has no entry of its own */
+    uint32_t cluster;
+    char abs_path[MAX_PATH_LENGTH];
+    if (resolve_directory(fs, path, &cluster, abs_path) == PATH_OK) {
+        memset(st, 0, sizeof(Fat32Stat));
+        st->cluster = cluster;
+        st->attr = ATTR_DIRECTORY;
+        st->is_dir = 1;
+        return FAT32_OK;
+    }
+    return FAT32_ERR_NOT_FOUND;
+}
+
+/* Create an empty file */
+int fat32_create(Fat32 *fs, const char *path) {
+    PathTarget target;
+    if (resolve_path(fs, path, &target) != PATH_OK ||
+        lock_parent(fs, &target) < 0) {
+        return FAT32_ERR_NO_PARENT;
+    }
+    int result = create_file_locked(fs, &target);
+    dir_unlock(fs, target.parent);
+    return result == FAT32_OK ? commit(fs, result) : result;
+}
+
+/* Helper: Create a directory with its "." and ".." entries; the caller
+ * holds the lock_parent lock */
+static int make_directory_locked(FileSystem *fs, const PathTarget *target) {
+    if (!lfn_valid_name(target->name)) {
+        return FAT32_ERR_INVALID_NAME;
+    }
+
+    /* Check if already exists */
+    DirEntry *existing = find_entry(fs, target->parent, target->name);
+    if (existing) {
+        free(existing);
+        return FAT32_ERR_EXISTS;
+    }
+
+    /* Allocate cluster for new directory */
+    uint32_t new_cluster = allocate_cluster(fs);
+    if (new_cluster == 0) {
+        return FAT32_ERR_NO_SPACE;
+    }
+
+    /* Create "." entry */
+    DirEntry dot_entry;
+    memset(&dot_entry, 0, sizeof(DirEntry));
+    memset(dot_entry.DIR_Name, ' ', 11);
+    dot_entry.DIR_Name[0] = '.';
+    dot_entry.DIR_Attr = ATTR_DIRECTORY;
+    dot_entry.DIR_FstClusHI = (new_cluster >> 16) & 0xFFFF;
+    dot_entry.DIR_FstClusLO = new_cluster & 0xFFFF;
+    write_directory_entry(fs, new_cluster, &dot_entry, 0);
+
+    /* Create ".." entry */
+    DirEntry dotdot_entry;
+    memset(&dotdot_entry, 0, sizeof(DirEntry));
+    memset(dotdot_entry.DIR_Name, ' ', 11);
+    dotdot_entry.DIR_Name[0] = '.';
+    dotdot_entry.DIR_Name[1] = '.';
+    dotdot_entry.DIR_Attr = ATTR_DIRECTORY;
+    uint32_t parent = (target->parent == fs->root_cluster) ?
+                      0 : target->parent;
+    dotdot_entry.DIR_FstClusHI = (parent >> 16) & 0xFFFF;
+    dotdot_entry.DIR_FstClusLO = parent & 0xFFFF;
+    write_directory_entry(fs, new_cluster, &dotdot_entry, 1);
+
+    /* Create entry in parent directory */
+    int result = FAT32_OK;
+    if (create_directory_entry(fs, target->parent, target->name,
+                               ATTR_DIRECTORY, new_cluster, 0) < 0) {
+        free_cluster_chain(fs, new_cluster);
+        result = FAT32_ERR_IO;
+    }
+    return result;
+}
+
+/* Create a directory with its "." and ".." entries */
+int fat32_mkdir(Fat32 *fs, const char *path) {
+    PathTarget target;
+    if (resolve_path(fs, path, &target) != PATH_OK ||
+        lock_parent(fs, &target) < 0) {
+        return FAT32_ERR_NO_PARENT;
+    }
+    int result = make_directory_locked(fs, &target);
+    dir_unlock(fs, target.parent);
+    return commit(fs, result);
+}
+
+/* Helper: Remove a file; the caller holds the lock_parent lock */
+static int unlink_locked(FileSystem *fs, const PathTarget *target) {
+    DirEntry *entry = find_entry(fs, target->parent, target->name);
+    if (!entry) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    int result = FAT32_OK;
+    if (entry->DIR_Attr & ATTR_DIRECTORY) {
+        result = FAT32_ERR_IS_DIR;
+    } else if (file_in_use(fs, target->parent, entry->DIR_Name)) {
+        result = FAT32_ERR_OPEN;
+    } else {
+        /* Free cluster chain */
+        uint32_t first_cluster = entry_cluster(entry);
+        if (first_cluster != 0) {
+            free_cluster_chain(fs, first_cluster);
+        }
+
+        /* Delete directory entry */
+        delete_directory_entry(fs, target->parent, target->name);
+    }
+    free(entry);
+    return result;
+}
+
+/* Remove a file that no session has open */
+int fat32_unlink(Fat32 *fs, const char *path) {
+    PathTarget target;
+    if (resolve_path(fs, path, &target) != PATH_OK ||
+        lock_parent(fs, &target) < 0) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    int result = unlink_locked(fs, &target);
+    dir_unlock(fs, target.parent);
+    return result == FAT32_OK ? commit(fs, result) : result;
+}
+
+/* Helper: Check whether any session is in the directory or has a file
+ * open in it */
+static int directory_busy(FileSystem *fs, uint32_t dir_cluster) {
+    int busy = FAT32_OK;
+    pthread_mutex_lock(&fs->volume->session_lock);
+    for (FileSystem *session = fs->volume; session && !busy;
+         session = session->next_session) {
+        if (session->current_cluster == dir_cluster) {
+            busy = FAT32_ERR_BUSY;
+        }
+        for (int i = 0; i < MAX_OPEN_FILES && !busy; i++) {
+            if (session->open_files[i].is_open &&
+                session->open_files[i].dir_cluster == dir_cluster) {
+                busy = FAT32_ERR_OPEN;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->volume->session_lock);
+    return busy;
+}
+
+/* Helper: Remove a directory; the caller holds the lock_parent lock. The
+ * directory's own write lock is held from the checks to the free, so no
+ * entry can be created in it meanwhile. */
+static int rmdir_locked(FileSystem *fs, const PathTarget *target) {
+    DirEntry *entry = find_entry(fs, target->parent, target->name);
+    if (!entry) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (!(entry->DIR_Attr & ATTR_DIRECTORY)) {
+        free(entry);
+        return FAT32_ERR_NOT_DIR;
+    }
+    uint32_t dir_cluster = entry_cluster(entry);
+    free(entry);
+    if (dir_cluster == 0) {
+        delete_directory_entry(fs, target->parent, target->name);
+        return FAT32_OK;
+    }
+
+    dir_lock_write(fs, dir_cluster);
+    int result = FAT32_OK;
+    if (!is_directory_empty(fs, dir_cluster)) {
+        result = FAT32_ERR_NOT_EMPTY;
+    } else {
+        result = directory_busy(fs, dir_cluster);
+    }
+    if (result == FAT32_OK) {
+        remove_directory(fs, dir_cluster);
+        delete_directory_entry(fs, target->parent, target->name);
+    }
+    dir_unlock(fs, dir_cluster);
+    return result;
+}
+
+/* Remove an empty directory that is no session's current directory and
+ * holds no open file */
+int fat32_rmdir(Fat32 *fs, const char *path) {
+    PathTarget target;
+    if (resolve_path(fs, path, &target) != PATH_OK ||
+        lock_parent(fs, &target) < 0) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    int result = rmdir_locked(fs, &target);
+    dir_unlock(fs, target.parent);
+    return result == FAT32_OK ? commit(fs, result) : result;
+}
+
+/* Rename or move an entry. If to names an existing directory, from is
+ * moved into it under its own name; an existing file is not replaced.
+ * Files must be closed; the paths of sessions and open files under a
+ * moved directory follow it. */
+int fat32_rename(Fat32 *fs, const char *from, const char *to) {
+    /* Check if source exists */
+    PathTarget src;
+    DirEntry *src_entry = lookup_path(fs, from, &src);
+    if (!src_entry) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+
+    /* Check if file is open */
+    if (!(src_entry->DIR_Attr & ATTR_DIRECTORY) &&
+        file_in_use(fs, src.parent, src_entry->DIR_Name)) {
+        free(src_entry);
+        return FAT32_ERR_OPEN;
+    }
+
+    PathTarget dst;
+    if (resolve_path(fs, to, &dst) != PATH_OK) {
+        free(src_entry);
+        return FAT32_ERR_NO_PARENT;
+    }
+
+    /* Check if destination exists */
+    DirEntry *dest_entry = find_entry(fs, dst.parent, dst.name);
+    uint32_t dest_dir = dst.parent;
+    const char *dest_name = dst.name;
+    int into_dir = 0;
+
+    if (dest_entry) {
+        /* Destination exists - check if it's a directory */
+        if (!(dest_entry->DIR_Attr & ATTR_DIRECTORY)) {
+            free(src_entry);
+            free(dest_entry);
+            return FAT32_ERR_NOT_DIR;
+        }
+
+        /* Move into directory */
+        dest_dir = entry_cluster(dest_entry);
+        if (dest_dir == 0) {
+            dest_dir = fs->root_cluster;
+        }
+        dest_name = src.name;
+        into_dir = 1;
+        free(dest_entry);
+
+        /* Check if already exists in destination */
+        DirEntry *existing = find_entry(fs, dest_dir, src.name);
+        if (existing) {
+            free(src_entry);
+            free(existing);
+            return FAT32_ERR_EXISTS;
+        }
+    }
+
+    uint32_t src_cluster = entry_cluster(src_entry);
+    int is_dir = (src_entry->DIR_Attr & ATTR_DIRECTORY) != 0;
+    if (is_dir && is_subdirectory(fs, dest_dir, src_cluster)) {
+        free(src_entry);
+        return FAT32_ERR_LOOP;
+    }
+
+    if (!into_dir && !lfn_valid_name(dest_name)) {
+        free(src_entry);
+        return FAT32_ERR_INVALID_NAME;
+    }
+
+    if (dest_dir == src.parent) {
+        /* Simple rename */
+        if (rename_directory_entry(fs, src.parent, src.name, dest_name) < 0) {
+            free(src_entry);
+            return commit(fs, FAT32_ERR_IO);
+        }
+    } else {
+        /* Create entry in destination */
+        if (create_directory_entry(fs, dest_dir, dest_name,
+                                   src_entry->DIR_Attr, src_cluster,
+                                   src_entry->DIR_FileSize) < 0) {
+            free(src_entry);
+            return commit(fs, FAT32_ERR_IO);
+        }
+
+        /* Delete from source */
+        delete_directory_entry(fs, src.parent, src.name);
+        if (is_dir) {
+            set_parent_link(fs, src_cluster, dest_dir);
+        }
+    }
+
+    if (is_dir) {
+        /* Keep the session and open file paths under the directory valid */
+        char old_path[MAX_PATH_LENGTH];
+        char new_path[MAX_PATH_LENGTH];
+        strcpy(old_path, src.dir_path);
+        strcpy(new_path, dst.dir_path);
+        if (path_append(old_path, src.name) == 0 &&
+            (!into_dir || path_append(new_path, dst.name) == 0) &&
+            path_append(new_path, dest_name) == 0) {
+            pthread_mutex_lock(&fs->volume->session_lock);
+            for (FileSystem *session = fs->volume; session;
+                 session = session->next_session) {
+                rebase_path(session->current_path, old_path, new_path);
+                for (int i = 0; i < MAX_OPEN_FILES; i++) {
+                    if (session->open_files[i].is_open) {
+                        rebase_path(session->open_files[i].path, old_path,
+                                    new_path);
+                    }
+                }
+            }
+            pthread_mutex_unlock(&fs->volume->session_lock);
+        }
+    }
+    free(src_entry);
+    return commit(fs, FAT32_OK);
+}
+
+/* Set a file's size: shrinking releases clusters, growing zeroes */
+int fat32_truncate(Fat32 *fs, const char *path, uint32_t size) {
+    return resize_file(fs, path, size, 0);
+}
+
+/* Reserve clusters for the first size bytes of a file, keeping its size */
+int fat32_fallocate(Fat32 *fs, const char *path, uint32_t size) {
+    return resize_file(fs, path, size, 1);
+}
+
+/* Change the handle's current directory */
+int fat32_chdir(Fat32 *fs, const char *path) {
+    uint32_t cluster;
+    char abs_path[MAX_PATH_LENGTH];
+
+    int result = resolve_directory(fs, path, &cluster, abs_path);
+    if (result == PATH_NOT_FOUND) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (result == PATH_NOT_DIR) {
+        return FAT32_ERR_NOT_DIR;
+    }
+
+    /* Under the directory's lock, so an rmdir either sees the session
+     * in it or has already removed it */
+    dir_lock_read(fs, cluster);
+    if (!directory_exists(fs, cluster)) {
+        dir_unlock(fs, cluster);
+        return FAT32_ERR_NOT_FOUND;
+    }
+    pthread_mutex_lock(&fs->volume->session_lock);
+    fs->current_cluster = cluster;
+    strcpy(fs->current_path, abs_path);
+    pthread_mutex_unlock(&fs->volume->session_lock);
+    dir_unlock(fs, cluster);
+    return FAT32_OK;
+}
+
+/* Move a directory's entries down over its deleted slots and free the
+ * clusters left empty; path NULL is the current directory. Returns the
+ * slots reclaimed. */
+int fat32_compact(Fat32 *fs, const char *path, uint32_t *freed) {
+    uint32_t cluster = fs->current_cluster;
+    if (path) {
+        char abs_path[MAX_PATH_LENGTH];
+        int result = resolve_directory(fs, path, &cluster, abs_path);
+        if (result == PATH_NOT_FOUND) {
+            return FAT32_ERR_NOT_FOUND;
+        }
+        if (result == PATH_NOT_DIR) {
+            return FAT32_ERR_NOT_DIR;
+        }
+    }
+    int reclaimed = compact_directory(fs, cluster, freed);
+    return commit(fs, reclaimed < 0 ? FAT32_ERR_IO : reclaimed);
+}
+
+/* Open a directory for fat32_readdir; path NULL is the current one */
+int fat32_opendir(Fat32 *fs, const char *path, Fat32Dir **dir) {
+    uint32_t cluster = fs->current_cluster;
+    if (path) {
+        char abs_path[MAX_PATH_LENGTH];
+        int result = resolve_directory(fs, path, &cluster, abs_path);
+        if (result == PATH_NOT_FOUND) {
+            return FAT32_ERR_NOT_FOUND;
+        }
+        if (result == PATH_NOT_DIR) {
+            return FAT32_ERR_NOT_DIR;
+        }
+    }
+
+    Fat32Dir *opened = malloc(sizeof(Fat32Dir));
+    if (!opened) {
+        return FAT32_ERR_NO_MEMORY;
+    }
+    opened->fs = fs;
+    opened->cluster = cluster;
+    dir_lock_read(fs, cluster);
+    dir_iter_open(fs, &opened->it, cluster);
+    dir_unlock(fs, cluster);
+    *dir = opened;
+    return FAT32_OK;
+}
+
+/* Read the next entry in directory order; returns 1, or 0 at the end.
+ * Entries created or deleted meanwhile may or may not be seen. */
+int fat32_readdir(Fat32Dir *dir, Fat32Dirent *entry) {
+    dir_lock_read(dir->fs, dir->cluster);
+    DirEntry *current = dir_iter_next_named(&dir->it, NULL, entry->name);
+    if (current) {
+        fill_stat(dir->fs, current, &entry->stat);
+    }
+    dir_unlock(dir->fs, dir->cluster);
+    return current != NULL;
+}
+
+/* Release a directory from fat32_opendir */
+void fat32_closedir(Fat32Dir *dir) {
+    dir_iter_close(&dir->it);
+    free(dir);
+}
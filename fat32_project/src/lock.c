@@ -0,0 +1,215 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "../include/lock.h"
+
+#ifndef NDEBUG
+#define TRACKED_READS 64
+
+/* Read holds of the calling thread, to catch a reader asking to write.
+ * Holds past the first TRACKED_READS are not checked. */
+static __thread RwLock *held_reads[TRACKED_READS];
+static __thread uint32_t held_read_count;
+
+/* Record a read hold of the calling thread */
+static void track_read(RwLock *lock) {
+    if (held_read_count < TRACKED_READS) {
+        held_reads[held_read_count++] = lock;
+    }
+}
+
+/* Forget one read hold of the calling thread */
+static void untrack_read(RwLock *lock) {
+    for (uint32_t i = held_read_count; i-- > 0;) {
+        if (held_reads[i] == lock) {
+            held_reads[i] = held_reads[--held_read_count];
+            return;
+        }
+    }
+}
+
+/* Check whether the calling thread holds the lock for reading */
+static int reading(RwLock *lock) {
+    for (uint32_t i = 0; i < held_read_count; i++) {
+        if (held_reads[i] == lock) {
+            return 1;
+        }
+    }
+    return 0;
+}
+#else
+#define track_read(lock) ((void)0)
+#define untrack_read(lock) ((void)0)
+#endif
+
+/* Initialize a mutex its holder may lock again */
+int mutex_init_recursive(pthread_mutex_t *mutex) {
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0) {
+        return -1;
+    }
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    int result = pthread_mutex_init(mutex, &attr) == 0 ? 0 : -1;
+    pthread_mutexattr_destroy(&attr);
+    return result;
+}
+
+/* Initialize an unheld reader-writer lock */
+void rwlock_init(RwLock *lock) {
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_cond_init(&lock->released, NULL);
+    lock->readers = 0;
+    lock->depth = 0;
+}
+
+/* Destroy an unheld reader-writer lock */
+void rwlock_destroy(RwLock *lock) {
+    pthread_mutex_destroy(&lock->mutex);
+    pthread_cond_destroy(&lock->released);
+}
+
+/* Check whether the calling thread holds the lock for writing; the
+ * caller holds lock->mutex */
+static int held_by_self(RwLock *lock) {
+    return lock->depth > 0 && pthread_equal(lock->writer, pthread_self());
+}
+
+/* Take the lock for reading; the writer just nests */
+void rwlock_read(RwLock *lock) {
+    pthread_mutex_lock(&lock->mutex);
+    if (held_by_self(lock)) {
+        lock->depth++;
+    } else {
+        while (lock->depth > 0) {
+            pthread_cond_wait(&lock->released, &lock->mutex);
+        }
+        lock->readers++;
+        track_read(lock);
+    }
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/* Take the lock for writing once no other thread holds it */
+void rwlock_write(RwLock *lock) {
+    pthread_mutex_lock(&lock->mutex);
+    if (held_by_self(lock)) {
+        lock->depth++;
+    } else {
+        /* It would wait for itself forever */
+        assert(!reading(lock));
+        while (lock->depth > 0 || lock->readers > 0) {
+            pthread_cond_wait(&lock->released, &lock->mutex);
+        }
+        lock->writer = pthread_self();
+        lock->depth = 1;
+    }
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/* Release one hold, read or write */
+void rwlock_unlock(RwLock *lock) {
+    pthread_mutex_lock(&lock->mutex);
+    if (held_by_self(lock)) {
+        if (--lock->depth == 0) {
+            pthread_cond_broadcast(&lock->released);
+        }
+    } else if (lock->readers > 0) {
+        untrack_read(lock);
+        if (--lock->readers == 0) {
+            pthread_cond_broadcast(&lock->released);
+        }
+    }
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/* Initialize an empty table of directory locks */
+void dir_locks_init(DirLockTable *table) {
+    pthread_mutex_init(&table->mutex, NULL);
+    pthread_cond_init(&table->spared, NULL);
+    for (int i = 0; i < DIR_LOCK_BUCKETS; i++) {
+        table->buckets[i] = NULL;
+    }
+    table->spare = NULL;
+}
+
+/* Free a table no thread holds a lock of */
+void dir_locks_destroy(DirLockTable *table) {
+    for (int i = 0; i < DIR_LOCK_BUCKETS; i++) {
+        while (table->buckets[i]) {
+            DirLock *next = table->buckets[i]->next;
+            rwlock_destroy(&table->buckets[i]->lock);
+            free(table->buckets[i]);
+            table->buckets[i] = next;
+        }
+    }
+    while (table->spare) {
+        DirLock *next = table->spare->next;
+        rwlock_destroy(&table->spare->lock);
+        free(table->spare);
+        table->spare = next;
+    }
+    pthread_mutex_destroy(&table->mutex);
+    pthread_cond_destroy(&table->spared);
+}
+
+/* Bucket of a directory's lock */
+static DirLock **dir_lock_bucket(DirLockTable *table, uint32_t cluster) {
+    return &table->buckets[((cluster * 2654435761u) >> 16) &
+                           (DIR_LOCK_BUCKETS - 1)];
+}
+
+/* Find the lock of a directory, creating it if no thread uses it, and
+ * count one more user until dir_locks_release; the caller then takes it
+ * for reading or writing. Out of memory, waits for a lock to go unused. */
+RwLock *dir_locks_get(DirLockTable *table, uint32_t cluster) {
+    DirLock **bucket = dir_lock_bucket(table, cluster);
+    DirLock *dir;
+    pthread_mutex_lock(&table->mutex);
+    for (;;) {
+        dir = *bucket;
+        while (dir && dir->cluster != cluster) {
+            dir = dir->next;
+        }
+        if (dir) {
+            break;
+        }
+        if (table->spare) {
+            dir = table->spare;
+            table->spare = dir->next;
+        } else if ((dir = malloc(sizeof(DirLock))) != NULL) {
+            rwlock_init(&dir->lock);
+        } else {
+            /* Another thread may have created the lock meanwhile */
+            pthread_cond_wait(&table->spared, &table->mutex);
+            continue;
+        }
+        dir->cluster = cluster;
+        dir->users = 0;
+        dir->next = *bucket;
+        *bucket = dir;
+        break;
+    }
+    dir->users++;
+    pthread_mutex_unlock(&table->mutex);
+    return &dir->lock;
+}
+
+/* Release a hold of a directory's lock taken after dir_locks_get, and
+ * set the lock aside for reuse once it has no users */
+void dir_locks_release(DirLockTable *table, uint32_t cluster) {
+    DirLock **link = dir_lock_bucket(table, cluster);
+    pthread_mutex_lock(&table->mutex);
+    while (*link && (*link)->cluster != cluster) {
+        link = &(*link)->next;
+    }
+    DirLock *dir = *link;
+    if (dir) {
+        rwlock_unlock(&dir->lock);
+    }
+    if (dir && --dir->users == 0) {
+        *link = dir->next;
+        dir->next = table->spare;
+        table->spare = dir;
+        pthread_cond_broadcast(&table->spared);
+    }
+    pthread_mutex_unlock(&table->mutex);
+}
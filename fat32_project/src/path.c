@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/path.h"
+#include "../include/lfn.h"
+
+/* Hash a (parent cluster, name) pair, ignoring the case of the name */
+static uint32_t dentry_hash(uint32_t parent, const char *name) {
+    uint32_t hash = lfn_hash(name) ^ (parent * 2654435761u);
+    return hash & (DENTRY_CACHE_BUCKETS - 1);
+}
+
+/* Unlink a dentry from the LRU list */
+static void lru_unlink(Dentry *dentry) {
+    dentry->lru_prev->lru_next = dentry->lru_next;
+    dentry->lru_next->lru_prev = dentry->lru_prev;
+}
+
+/* Insert a dentry at the most recently used end */
+static void lru_push_front(struct DentryCache *cache, Dentry *dentry) {
+    dentry->lru_prev = &cache->lru;
+    dentry->lru_next = cache->lru.lru_next;
+    cache->lru.lru_next->lru_prev = dentry;
+    cache->lru.lru_next = dentry;
+}
+
+/* Insert a dentry at the least recently used end, to be reused first */
+static void lru_push_back(struct DentryCache *cache, Dentry *dentry) {
+    dentry->lru_next = &cache->lru;
+    dentry->lru_prev = cache->lru.lru_prev;
+    cache->lru.lru_prev->lru_next = dentry;
+    cache->lru.lru_prev = dentry;
+}
+
+/* Find the dentry for a name in a directory */
+static Dentry *dcache_find(struct DentryCache *cache, uint32_t parent,
+                           const char *name) {
+    Dentry *dentry = cache->table[dentry_hash(parent, name)];
+    while (dentry && (dentry->parent != parent ||
+                      !lfn_name_equal(dentry->name, name))) {
+        dentry = dentry->hash_next;
+    }
+    return dentry;
+}
+
+/* Take a dentry out of its hash chain and queue it for reuse */
+static void dcache_remove(struct DentryCache *cache, Dentry *dentry) {
+    Dentry **link = &cache->table[dentry_hash(dentry->parent, dentry->name)];
+    while (*link != dentry) {
+        link = &(*link)->hash_next;
+    }
+    *link = dentry->hash_next;
+    dentry->in_use = 0;
+    lru_unlink(dentry);
+    lru_push_back(cache, dentry);
+}
+
+/* Fill in what a lookup found; entry is NULL if the name was absent */
+static void dentry_fill(FileSystem *fs, Dentry *dentry, const DirEntry *entry) {
+    dentry->negative = (entry == NULL);
+    dentry->attr = entry ? entry->DIR_Attr : 0;
+    dentry->cluster = 0;
+    if (entry) {
+        dentry->cluster = ((uint32_t)entry->DIR_FstClusHI << 16) |
+                          entry->DIR_FstClusLO;
+        /* ".." entries store 0 for the root directory */
+        if (dentry->cluster == 0 && (entry->DIR_Attr & ATTR_DIRECTORY)) {
+            dentry->cluster = fs->root_cluster;
+        }
+    }
+}
+
+/* Record the result of looking up a name; entry is NULL if it was absent */
+static Dentry *dcache_store(FileSystem *fs, uint32_t parent,
+                            const char *name, const DirEntry *entry) {
+    struct DentryCache *cache = fs->dentries;
+    Dentry *dentry = cache->lru.lru_prev;
+    if (dentry->in_use) {
+        dcache_remove(cache, dentry);
+    }
+
+    dentry->parent = parent;
+    strcpy(dentry->name, name);
+    dentry_fill(fs, dentry, entry);
+    dentry->in_use = 1;
+
+    uint32_t bucket = dentry_hash(parent, name);
+    dentry->hash_next = cache->table[bucket];
+    cache->table[bucket] = dentry;
+    lru_unlink(dentry);
+    lru_push_front(cache, dentry);
+    return dentry;
+}
+
+/* Set up an empty dentry cache */
+int dcache_init(FileSystem *fs) {
+    struct DentryCache *cache = calloc(1, sizeof(struct DentryCache));
+    if (!cache) {
+        return -1;
+    }
+    cache->lru.lru_next = &cache->lru;
+    cache->lru.lru_prev = &cache->lru;
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        lru_push_front(cache, &cache->entries[i]);
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    fs->dentries = cache;
+    return 0;
+}
+
+/* Free the dentry cache */
+void dcache_destroy(FileSystem *fs) {
+    if (fs->dentries) {
+        pthread_mutex_destroy(&fs->dentries->lock);
+    }
+    free(fs->dentries);
+    fs->dentries = NULL;
+}
+
+/* Forget what is known about name in a directory whose entries changed */
+void dcache_invalidate(FileSystem *fs, uint32_t parent, const char *name) {
+    if (!fs->dentries || strlen(name) >= DENTRY_NAME_MAX) {
+        return;
+    }
+    pthread_mutex_lock(&fs->dentries->lock);
+    fs->dentries->generation++;
+    Dentry *dentry = dcache_find(fs->dentries, parent, name);
+    if (dentry) {
+        dcache_remove(fs->dentries, dentry);
+    }
+    pthread_mutex_unlock(&fs->dentries->lock);
+}
+
+/* Forget every name cached under a directory that is being removed */
+void dcache_purge_dir(FileSystem *fs, uint32_t cluster) {
+    if (!fs->dentries) {
+        return;
+    }
+    pthread_mutex_lock(&fs->dentries->lock);
+    fs->dentries->generation++;
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        Dentry *dentry = &fs->dentries->entries[i];
+        if (dentry->in_use && dentry->parent == cluster) {
+            dcache_remove(fs->dentries, dentry);
+        }
+    }
+    pthread_mutex_unlock(&fs->dentries->lock);
+}
+
+/* Forget every cached lookup in, or resolving to, a directory */
+void dcache_purge_cluster(FileSystem *fs, uint32_t cluster) {
+    if (!fs->dentries) {
+        return;
+    }
+    pthread_mutex_lock(&fs->dentries->lock);
+    fs->dentries->generation++;
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        Dentry *dentry = &fs->dentries->entries[i];
+        if (dentry->in_use && (dentry->parent == cluster ||
+                               (!dentry->negative && dentry->cluster == cluster))) {
+            dcache_remove(fs->dentries, dentry);
+        }
+    }
+    pthread_mutex_unlock(&fs->dentries->lock);
+}
+
+/* Look up one path component that must be a directory */
+static int lookup_dir(FileSystem *fs, uint32_t parent, const char *name,
+                      uint32_t *cluster) {
+    struct DentryCache *cache = fs->dentries;
+    int cacheable = strlen(name) < DENTRY_NAME_MAX;
+    Dentry result;
+    Dentry *dentry = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cacheable) {
+        dentry = dcache_find(cache, parent, name);
+    }
+    if (dentry) {
+        cache->hits++;
+        lru_unlink(dentry);
+        lru_push_front(cache, dentry);
+        result = *dentry;
+        pthread_mutex_unlock(&cache->lock);
+    } else {
+        cache->misses++;
+        uint64_t generation = cache->generation;
+        pthread_mutex_unlock(&cache->lock);
+
+        DirEntry *entry = find_entry(fs, parent, name);
+        dentry_fill(fs, &result, entry);
+        /* Skip storing if the directory may have changed since the
+         * lookup, or another thread stored the name first */
+        pthread_mutex_lock(&cache->lock);
+        if (cacheable && cache->generation == generation &&
+            !dcache_find(cache, parent, name)) {
+            dcache_store(fs, parent, name, entry);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        free(entry);
+    }
+    dentry = &result;
+
+    if (dentry->negative) {
+        return PATH_NOT_FOUND;
+    }
+    if (!(dentry->attr & ATTR_DIRECTORY)) {
+        return PATH_NOT_DIR;
+    }
+    *cluster = dentry->cluster;
+    return PATH_OK;
+}
+
+/* Apply one component to an absolute path string */
+int path_append(char *abs_path, const char *component) {
+    if (strcmp(component, ".") == 0) {
+        return 0;
+    }
+    if (strcmp(component, "..") == 0) {
+        char *last_slash = strrchr(abs_path, '/');
+        if (last_slash == abs_path) {
+            strcpy(abs_path, "/");
+        } else {
+            *last_slash = '\0';
+        }
+        return 0;
+    }
+
+    size_t len = strlen(abs_path);
+    int separator = strcmp(abs_path, "/") != 0;
+    if (len + separator + strlen(component) >= MAX_PATH_LENGTH) {
+        return -1;
+    }
+    if (separator) {
+        strcat(abs_path, "/");
+    }
+    strcat(abs_path, component);
+    return 0;
+}
+
+/* Walk the directories named in path (modified in place), starting at
+ * the root for absolute paths and at the current directory otherwise */
+static int walk_path(FileSystem *fs, char *path, int absolute,
+                     uint32_t *cluster, char *abs_path) {
+    uint32_t current = absolute ? fs->root_cluster : fs->current_cluster;
+    strcpy(abs_path, absolute ? "/" : fs->current_path);
+
+    char *save = NULL;
+    for (char *component = strtok_r(path, "/", &save); component;
+         component = strtok_r(NULL, "/", &save)) {
+        if (strcmp(component, ".") == 0) {
+            continue;
+        }
+        int result = lookup_dir(fs, current, component, &current);
+        if (result != PATH_OK) {
+            return result;
+        }
+        if (path_append(abs_path, component) < 0) {
+            return PATH_NOT_FOUND;
+        }
+    }
+
+    *cluster = current;
+    return PATH_OK;
+}
+
+/* Resolve every component of path except the last, which is returned as
+ * a name in the directory it names */
+int resolve_path(FileSystem *fs, const char *path, PathTarget *target) {
+    char buffer[MAX_PATH_LENGTH];
+    char empty[1] = "";
+    size_t len = strlen(path);
+    if (len == 0 || len >= MAX_PATH_LENGTH) {
+        return PATH_NOT_FOUND;
+    }
+    memcpy(buffer, path, len + 1);
+    while (len > 1 && buffer[len - 1] == '/') {
+        buffer[--len] = '\0';
+    }
+
+    char *dir = empty;
+    char *leaf = buffer;
+    char *slash = strrchr(buffer, '/');
+    if (slash) {
+        *slash = '\0';
+        dir = buffer;
+        leaf = slash + 1;
+    }
+    if (*leaf == '\0') {
+        return PATH_NOT_FOUND;
+    }
+    strcpy(target->name, leaf);
+
+    return walk_path(fs, dir, path[0] == '/', &target->parent,
+                     target->dir_path);
+}
+
+/* Resolve a path that must name a directory */
+int resolve_directory(FileSystem *fs, const char *path, uint32_t *cluster,
+                      char *abs_path) {
+    char buffer[MAX_PATH_LENGTH];
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        return PATH_NOT_FOUND;
+    }
+    strcpy(buffer, path);
+    return walk_path(fs, buffer, path[0] == '/', cluster, abs_path);
+}
+
+/* Rewrite an absolute path as ls lists it: each component by its long
+ * name, or by its short name if it has none */
+int display_path(FileSystem *fs, const char *abs_path, char *shown) {
+    char buffer[MAX_PATH_LENGTH];
+    char name[MAX_NAME_LENGTH];
+    uint32_t current = fs->root_cluster;
+    if (strlen(abs_path) >= MAX_PATH_LENGTH) {
+        return PATH_NOT_FOUND;
+    }
+    strcpy(buffer, abs_path);
+    strcpy(shown, "/");
+
+    char *save = NULL;
+    for (char *component = strtok_r(buffer, "/", &save); component;
+         component = strtok_r(NULL, "/", &save)) {
+        if (find_entry_name(fs, current, component, name) < 0) {
+            return PATH_NOT_FOUND;
+        }
+        int result = lookup_dir(fs, current, component, &current);
+        if (result != PATH_OK) {
+            return result;
+        }
+        if (path_append(shown, name) < 0) {
+            return PATH_NOT_FOUND;
+        }
+    }
+    return PATH_OK;
+}
+
+/* Resolve a path and read the entry it names; NULL if any part is missing */
+DirEntry *lookup_path(FileSystem *fs, const char *path, PathTarget *target) {
+    if (resolve_path(fs, path, target) != PATH_OK) {
+        return NULL;
+    }
+    return find_entry(fs, target->parent, target->name);
+}
+
+/* Check whether the directory at cluster is ancestor or lies below it */
+int is_subdirectory(FileSystem *fs, uint32_t cluster, uint32_t ancestor) {
+    for (uint32_t depth = 0; depth < fs->total_clusters; depth++) {
+        if (cluster == ancestor) {
+            return 1;
+        }
+        if (cluster == fs->root_cluster ||
+            lookup_dir(fs, cluster, "..", &cluster) != PATH_OK) {
+            return 0;
+        }
+    }
+    return 0;
+}
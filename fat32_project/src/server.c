@@ -0,0 +1,585 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "../include/server.h"
+#include "../include/shell.h"
+
+#define SERVER_EVENTS 64
+#define SERVER_READ_SIZE 4096
+
+/* Commands that change other sessions' open files or directories, or
+ * walk the whole volume; they run while no other command does */
+static const char *exclusive_commands[] = {
+    "mv", "truncate", "fallocate", "defrag", "fsck", NULL
+};
+
+/* One connected client. The event loop owns everything but line, reply
+ * and quit while busy is set; a worker owns those until it hands the
+ * client back. */
+typedef struct Client {
+    int fd;
+    FileSystem session;
+    char *input;            /* Received bytes not yet run */
+    size_t input_length;
+    size_t input_capacity;
+    char *output;           /* Bytes not yet sent */
+    size_t output_length;
+    size_t output_sent;
+    size_t output_capacity;
+    char line[MAX_INPUT_SIZE];  /* Command handed to a worker */
+    char *reply;            /* What the command printed, then the prompt */
+    size_t reply_length;
+    int busy;               /* A worker runs line */
+    int end_of_input;       /* The client shut down its side */
+    int quit;               /* Ran exit: close once the output is sent */
+    int broken;             /* The connection failed: close when idle */
+    struct Client *queue_next;  /* Next in the job or done queue */
+    struct Client *next;    /* Neighbours in the list of clients */
+    struct Client *prev;
+} Client;
+
+typedef struct {
+    FileSystem *fs;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;            /* Workers post here when a command is done */
+    int signal_fd;
+    pthread_rwlock_t volume_lock;   /* Shared per command, held alone by
+                                       the exclusive ones */
+    pthread_mutex_t lock;   /* Guards the queues and stopping */
+    pthread_cond_t work;
+    Client *jobs;
+    Client *jobs_tail;
+    Client *done;
+    int stopping;
+    Client clients;         /* Sentinel of the connected clients */
+    pthread_t threads[SERVER_MAX_WORKERS];
+    int workers;
+} Server;
+
+/* Whether a command has to run alone */
+static int is_exclusive(const char *command) {
+    for (int i = 0; exclusive_commands[i]; i++) {
+        if (strcmp(command, exclusive_commands[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Append bytes to a growable buffer */
+static int buffer_append(char **buffer, size_t *length, size_t *capacity,
+                         const char *data, size_t size) {
+    if (*length + size > *capacity) {
+        size_t new_capacity = *capacity ? *capacity : SERVER_READ_SIZE;
+        while (new_capacity < *length + size) {
+            new_capacity *= 2;
+        }
+        char *grown = realloc(*buffer, new_capacity);
+        if (!grown) {
+            return -1;
+        }
+        *buffer = grown;
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *length, data, size);
+    *length += size;
+    return 0;
+}
+
+/* Run one line of a client as the shell would, capturing the output */
+static void run_line(Server *server, Client *client) {
+    char *args[MAX_ARGS];
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buffer, &size);
+
+    client->reply = NULL;
+    client->reply_length = 0;
+    if (!out) {
+        client->quit = 1;
+        return;
+    }
+    client->session.out = out;
+
+    int argc = parse_input(client->line, args);
+    if (argc > 0 && strcmp(args[0], "exit") == 0) {
+        client->quit = 1;
+    } else {
+        if (argc > 0) {
+            if (is_exclusive(args[0])) {
+                pthread_rwlock_wrlock(&server->volume_lock);
+            } else {
+                pthread_rwlock_rdlock(&server->volume_lock);
+            }
+            run_command(&client->session, argc, args);
+            pthread_rwlock_unlock(&server->volume_lock);
+        }
+        print_prompt(&client->session);
+    }
+
+    fclose(out);
+    client->session.out = stdout;
+    client->reply = buffer;
+    client->reply_length = size;
+}
+
+/* Worker: run queued lines until the server stops and the queue drains */
+static void *worker_main(void *arg) {
+    Server *server = arg;
+    uint64_t one = 1;
+
+    while (1) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->jobs && !server->stopping) {
+            pthread_cond_wait(&server->work, &server->lock);
+        }
+        Client *client = server->jobs;
+        if (!client) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        server->jobs = client->queue_next;
+        if (!server->jobs) {
+            server->jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        run_line(server, client);
+
+        pthread_mutex_lock(&server->lock);
+        client->queue_next = server->done;
+        server->done = client;
+        pthread_mutex_unlock(&server->lock);
+        if (write(server->wake_fd, &one, sizeof(one)) < 0) {
+            /* The counter only saturates; the loop still wakes */
+        }
+    }
+    return NULL;
+}
+
+/* Queue a client's line for the workers */
+static void queue_line(Server *server, Client *client) {
+    client->busy = 1;
+    client->queue_next = NULL;
+    pthread_mutex_lock(&server->lock);
+    if (server->jobs_tail) {
+        server->jobs_tail->queue_next = client;
+    } else {
+        server->jobs = client;
+    }
+    server->jobs_tail = client;
+    pthread_cond_signal(&server->work);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/* Cut the next line out of a client's input the way fgets would: up to a
+ * newline, at most MAX_INPUT_SIZE - 1 bytes, or what is left at the end
+ * of input. Returns 0 if no line is complete yet. */
+static int take_line(Client *client) {
+    if (client->input_length == 0) {
+        return 0;
+    }
+    size_t limit = client->input_length;
+    if (limit > MAX_INPUT_SIZE - 1) {
+        limit = MAX_INPUT_SIZE - 1;
+    }
+    char *newline = memchr(client->input, '\n', limit);
+    size_t length;
+    if (newline) {
+        length = newline - client->input + 1;
+    } else if (limit == MAX_INPUT_SIZE - 1 || client->end_of_input) {
+        length = limit;
+    } else {
+        return 0;
+    }
+
+    memcpy(client->line, client->input, length);
+    client->line[length] = '\0';
+    client->line[strcspn(client->line, "\n")] = '\0';
+    client->input_length -= length;
+    memmove(client->input, client->input + length, client->input_length);
+    return 1;
+}
+
+/* Send as much pending output as the socket takes */
+static void flush_output(Client *client) {
+    while (client->output_sent < client->output_length) {
+        ssize_t sent = send(client->fd, client->output + client->output_sent,
+                            client->output_length - client->output_sent,
+                            MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client->broken = 1;
+            }
+            return;
+        }
+        client->output_sent += sent;
+    }
+    client->output_sent = 0;
+    client->output_length = 0;
+}
+
+/* Disconnect a client and drop its session */
+static void close_client(Server *server, Client *client) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->prev->next = client->next;
+    client->next->prev = client->prev;
+
+    session_close(&client->session);
+    fs_commit(server->fs);
+    free(client->input);
+    free(client->output);
+    free(client);
+}
+
+/* Move a client on after anything happened to it: hand its next line to
+ * a worker, send what is pending, close it once it is finished, and
+ * watch for what it waits on. Only line, reply and quit belong to the
+ * worker while the client is busy. */
+static void client_progress(Server *server, Client *client) {
+    if (!client->busy && !client->broken && !client->quit &&
+        !server->stopping && take_line(client)) {
+        queue_line(server, client);
+    }
+    if (!client->broken) {
+        flush_output(client);
+    }
+
+    if (client->broken) {
+        if (client->busy) {
+            /* Stop watching it until its worker is done */
+            epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        } else {
+            close_client(server, client);
+        }
+        return;
+    }
+    if (!client->busy && client->output_length == 0 &&
+        (client->quit ||
+         (client->end_of_input && client->input_length == 0))) {
+        close_client(server, client);
+        return;
+    }
+
+    struct epoll_event event = { 0 };
+    if (!client->end_of_input && (client->busy || !client->quit) &&
+        client->input_length < SERVER_INPUT_LIMIT) {
+        event.events |= EPOLLIN;
+    }
+    if (client->output_length > 0) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = client;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+/* Read what a client sent */
+static void read_input(Client *client) {
+    char chunk[SERVER_READ_SIZE];
+
+    while (client->input_length < SERVER_INPUT_LIMIT) {
+        ssize_t received = recv(client->fd, chunk, sizeof(chunk), 0);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client->broken = 1;
+            }
+            return;
+        }
+        if (received == 0) {
+            client->end_of_input = 1;
+            return;
+        }
+        if (buffer_append(&client->input, &client->input_length,
+                          &client->input_capacity, chunk, received) < 0) {
+            client->broken = 1;
+            return;
+        }
+    }
+}
+
+/* Accept every pending connection and greet it with a prompt */
+static void accept_clients(Server *server) {
+    while (1) {
+        int fd = accept4(server->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        Client *client = calloc(1, sizeof(Client));
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        struct epoll_event event = { 0 };
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        session_open(server->fs, &client->session);
+        client->next = server->clients.next;
+        client->prev = &server->clients;
+        client->next->prev = client;
+        server->clients.next = client;
+
+        /* The prompt goes out under the volume lock like any command */
+        char *buffer = NULL;
+        size_t size = 0;
+        FILE *out = open_memstream(&buffer, &size);
+        if (out) {
+            client->session.out = out;
+            pthread_rwlock_rdlock(&server->volume_lock);
+            print_prompt(&client->session);
+            pthread_rwlock_unlock(&server->volume_lock);
+            fclose(out);
+            client->session.out = stdout;
+            if (buffer_append(&client->output, &client->output_length,
+                              &client->output_capacity, buffer, size) < 0) {
+                client->broken = 1;
+            }
+            free(buffer);
+        } else {
+            client->broken = 1;
+        }
+        client_progress(server, client);
+    }
+}
+
+/* Take back the clients whose commands finished */
+static void collect_done(Server *server) {
+    uint64_t count;
+    if (read(server->wake_fd, &count, sizeof(count)) < 0) {
+        /* Nothing posted since the last read */
+    }
+
+    pthread_mutex_lock(&server->lock);
+    Client *client = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    while (client) {
+        Client *next = client->queue_next;
+        client->busy = 0;
+        if (client->reply &&
+            buffer_append(&client->output, &client->output_length,
+                          &client->output_capacity, client->reply,
+                          client->reply_length) < 0) {
+            client->broken = 1;
+        }
+        free(client->reply);
+        client->reply = NULL;
+        client_progress(server, client);
+        client = next;
+    }
+}
+
+/* Create the listening socket, replacing a stale one left at the path */
+static int listen_on(const char *socket_path) {
+    struct sockaddr_un address;
+    struct stat st;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Error: Socket path too long\n");
+        return -1;
+    }
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("Error: %s exists and is not a socket\n", socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        printf("Error: Cannot create socket\n");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        printf("Error: Cannot listen on %s\n", socket_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Register a server descriptor, tagged by its address in the server */
+static int watch_fd(Server *server, int *fd) {
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.ptr = fd;
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, *fd, &event);
+}
+
+/* Serve the mounted volume on a Unix socket until SIGINT or SIGTERM.
+ * Each client gets a session of its own and talks the shell's language:
+ * lines in, output and a prompt back. */
+int serve(FileSystem *fs, const char *socket_path, int workers) {
+    Server server;
+    sigset_t signals, old_signals;
+    int status = -1;
+
+    if (workers <= 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > SERVER_MAX_WORKERS) {
+        workers = SERVER_MAX_WORKERS;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.fs = fs;
+    server.epoll_fd = server.listen_fd = -1;
+    server.wake_fd = server.signal_fd = -1;
+    server.clients.next = server.clients.prev = &server.clients;
+
+    /* Writers first, so a queued exclusive command is not starved */
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&server.volume_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.work, NULL);
+
+    /* Block the signals before any worker starts so only signalfd sees them */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+    server.listen_fd = listen_on(socket_path);
+    if (server.listen_fd < 0) {
+        goto out;
+    }
+    server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.signal_fd < 0 || server.wake_fd < 0 || server.epoll_fd < 0 ||
+        watch_fd(&server, &server.listen_fd) < 0 ||
+        watch_fd(&server, &server.wake_fd) < 0 ||
+        watch_fd(&server, &server.signal_fd) < 0) {
+        printf("Error: Cannot set up the event loop\n");
+        goto out;
+    }
+
+    for (server.workers = 0; server.workers < workers; server.workers++) {
+        if (pthread_create(&server.threads[server.workers], NULL,
+                           worker_main, &server) != 0) {
+            break;
+        }
+    }
+    if (server.workers == 0) {
+        printf("Error: Cannot start workers\n");
+        goto out;
+    }
+
+    printf("Serving on %s with %d workers\n", socket_path, server.workers);
+    fflush(stdout);
+
+    int running = 1;
+    struct epoll_event events[SERVER_EVENTS];
+    while (running) {
+        int count = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &server.listen_fd) {
+                accept_clients(&server);
+            } else if (tag == &server.wake_fd) {
+                collect_done(&server);
+            } else if (tag == &server.signal_fd) {
+                /* Consume it, or it is delivered once unblocked */
+                struct signalfd_siginfo info;
+                if (read(server.signal_fd, &info, sizeof(info)) > 0) {
+                    running = 0;
+                }
+            } else {
+                Client *client = tag;
+                if (events[i].events & EPOLLIN) {
+                    read_input(client);
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    client->broken = 1;
+                }
+                client_progress(&server, client);
+            }
+        }
+    }
+    status = 0;
+
+out:
+    /* Let the workers finish what is queued, then drop every client */
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.work);
+    pthread_mutex_unlock(&server.lock);
+    for (int i = 0; i < server.workers; i++) {
+        pthread_join(server.threads[i], NULL);
+    }
+    if (server.wake_fd >= 0) {
+        collect_done(&server);
+    }
+    while (server.clients.next != &server.clients) {
+        Client *client = server.clients.next;
+        flush_output(client);
+        close_client(&server, client);
+    }
+
+    if (server.listen_fd >= 0) {
+        close(server.listen_fd);
+        unlink(socket_path);
+    }
+    if (server.epoll_fd >= 0) {
+        close(server.epoll_fd);
+    }
+    if (server.wake_fd >= 0) {
+        close(server.wake_fd);
+    }
+    if (server.signal_fd >= 0) {
+        close(server.signal_fd);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    pthread_cond_destroy(&server.work);
+    pthread_mutex_destroy(&server.lock);
+    pthread_rwlock_destroy(&server.volume_lock);
+    return status;
+}
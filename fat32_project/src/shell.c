@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/shell.h"
+#include "../include/commands.h"
+
+/* Parse command line input into at most MAX_ARGS words */
+int parse_input(char *input, char **args) {
+    int argc = 0;
+    int in_quotes = 0;
+    char *start = input;
+
+    while (*input && argc < MAX_ARGS) {
+        if (*input == '"') {
+            if (!in_quotes) {
+                in_quotes = 1;
+                start = input + 1;
+            } else {
+                *input = '\0';
+                args[argc++] = start;
+                in_quotes = 0;
+                start = input + 1;
+            }
+        } else if (*input == ' ' && !in_quotes) {
+            if (input > start) {
+                *input = '\0';
+                args[argc++] = start;
+            }
+            start = input + 1;
+        }
+        input++;
+    }
+
+    if (input > start && !in_quotes && argc < MAX_ARGS) {
+        args[argc++] = start;
+    }
+
+    return argc;
+}
+
+/* Print the prompt showing the image and current directory */
+void print_prompt(FileSystem *fs) {
+    fprintf(fs->out, "[%s]%s/>", fs->image_name, fs->current_path);
+    fflush(fs->out);
+}
+
+/* Run one parsed command other than exit */
+void run_command(FileSystem *fs, int argc, char **args) {
+    if (strcmp(args[0], "info") == 0) {
+        if (argc != 1) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_info(fs);
+        }
+    } else if (strcmp(args[0], "stats") == 0) {
+        if (argc != 1) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_stats(fs);
+        }
+    } else if (strcmp(args[0], "sync") == 0) {
+        if (argc != 1) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_sync(fs);
+        }
+    } else if (strcmp(args[0], "ls") == 0) {
+        if (argc > 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_ls(fs, argc == 2 ? args[1] : NULL);
+        }
+    } else if (strcmp(args[0], "cd") == 0) {
+        if (argc != 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_cd(fs, args[1]);
+        }
+    } else if (strcmp(args[0], "mkdir") == 0) {
+        if (argc != 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_mkdir(fs, args[1]);
+        }
+    } else if (strcmp(args[0], "creat") == 0) {
+        if (argc != 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_creat(fs, args[1]);
+        }
+    } else if (strcmp(args[0], "open") == 0) {
+        if (argc != 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_open(fs, args[1], args[2]);
+        }
+    } else if (strcmp(args[0], "close") == 0) {
+        if (argc != 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_close(fs, args[1]);
+        }
+    } else if (strcmp(args[0], "lsof") == 0) {
+        if (argc != 1) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_lsof(fs);
+        }
+    } else if (strcmp(args[0], "lseek") == 0) {
+        if (argc != 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            uint32_t offset = atoi(args[2]);
+            cmd_lseek(fs, args[1], offset);
+        }
+    } else if (strcmp(args[0], "read") == 0) {
+        if (argc == 4 && strcmp(args[3], "-b") != 0) {
+            fprintf(fs->out, "Error: Invalid option\n");
+        } else if (argc != 3 && argc != 4) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            uint32_t size = atoi(args[2]);
+            cmd_read(fs, args[1], size, argc == 4);
+        }
+    } else if (strcmp(args[0], "write") == 0) {
+        if (argc != 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_write(fs, args[1], args[2]);
+        }
+    } else if (strcmp(args[0], "mv") == 0) {
+        if (argc != 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_mv(fs, args[1], args[2]);
+        }
+    } else if (strcmp(args[0], "rm") == 0) {
+        if (argc != 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_rm(fs, args[1]);
+        }
+    } else if (strcmp(args[0], "rmdir") == 0) {
+        if (argc != 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_rmdir(fs, args[1]);
+        }
+    } else if (strcmp(args[0], "compact") == 0) {
+        if (argc > 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_compact(fs, argc == 2 ? args[1] : NULL);
+        }
+    } else if (strcmp(args[0], "defrag") == 0) {
+        if (argc > 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_defrag(fs, argc == 2 ? args[1] : NULL);
+        }
+    } else if (strcmp(args[0], "put") == 0) {
+        if (argc != 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_put(fs, args[1], args[2]);
+        }
+    } else if (strcmp(args[0], "get") == 0) {
+        if (argc != 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_get(fs, args[1], args[2]);
+        }
+    } else if (strcmp(args[0], "truncate") == 0) {
+        if (argc != 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_truncate(fs, args[1], strtoul(args[2], NULL, 10));
+        }
+    } else if (strcmp(args[0], "fallocate") == 0) {
+        if (argc != 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_fallocate(fs, args[1], strtoul(args[2], NULL, 10));
+        }
+    } else if (strcmp(args[0], "fsck") == 0) {
+        int repair = 0, threads = 0, valid = 1;
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(args[i], "-r") == 0) {
+                repair = 1;
+            } else if (strcmp(args[i], "-j") == 0 && i + 1 < argc) {
+                threads = atoi(args[++i]);
+            } else {
+                valid = 0;
+            }
+        }
+        if (!valid) {
+            fprintf(fs->out, "Error: Invalid option\n");
+        } else {
+            cmd_fsck(fs, repair, threads);
+        }
+    } else if (strcmp(args[0], "du") == 0) {
+        if (argc > 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_du(fs, argc == 2 ? args[1] : NULL);
+        }
+    } else if (strcmp(args[0], "tree") == 0) {
+        if (argc > 2) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_tree(fs, argc == 2 ? args[1] : NULL);
+        }
+    } else if (strcmp(args[0], "find") == 0) {
+        if (argc < 2 || argc > 3) {
+            fprintf(fs->out, "Error: Incorrect number of arguments\n");
+        } else {
+            cmd_find(fs, args[1], argc == 3 ? args[2] : NULL);
+        }
+    } else {
+        fprintf(fs->out, "Error: Unknown command\n");
+    }
+
+    /* Write-through mode flushes after every command */
+    if (fs_commit(fs) < 0) {
+        fprintf(fs->out, "Error: Failed to write changes to image\n");
+    }
+}
+
+/* Main shell loop */
+void shell_loop(FileSystem *fs) {
+    char input[MAX_INPUT_SIZE];
+    char *args[MAX_ARGS];
+
+    while (1) {
+        /* Print prompt */
+        print_prompt(fs);
+
+        /* Read input */
+        if (!fgets(input, MAX_INPUT_SIZE, stdin)) {
+            break;
+        }
+
+        /* Remove newline */
+        input[strcspn(input, "\n")] = '\0';
+
+        /* Skip empty lines */
+        if (strlen(input) == 0) {
+            continue;
+        }
+
+        /* Parse input */
+        int argc = parse_input(input, args);
+        if (argc == 0) {
+            continue;
+        }
+
+        /* Process commands */
+        if (strcmp(args[0], "exit") == 0) {
+            break;
+        }
+        run_command(fs, argc, args);
+    }
+}
@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include "../include/walk.h"
+#include "../include/lfn.h"
+
+typedef struct WalkNode WalkNode;
+
+/* One entry of a directory read by a worker */
+typedef struct {
+    uint32_t name;          /* Offset of the name in the node's names */
+    DirEntry entry;
+    uint64_t bytes;         /* Allocated bytes of a file's chain */
+    WalkNode *child;        /* Subdirectory to walk, NULL if not walked */
+} WalkRecord;
+
+/* One directory: a task for the workers, then a result for the emitter */
+struct WalkNode {
+    uint32_t cluster;
+    uint64_t bytes;         /* The directory's own chain */
+    WalkRecord *records;
+    uint32_t count;
+    uint32_t capacity;
+    char *names;
+    uint32_t names_used;
+    uint32_t names_capacity;
+    int done;
+};
+
+/* Tasks of one worker. The owner pushes and pops at the tail, so it
+ * goes depth first like the emitter; thieves take the oldest task at
+ * the head, which tends to be the largest subtree left. */
+typedef struct {
+    pthread_mutex_t lock;
+    WalkNode **tasks;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t capacity;
+} WalkDeque;
+
+/* State shared by the workers and the emitter of one walk */
+typedef struct {
+    FileSystem *fs;
+    WalkDeque deques[WALK_MAX_THREADS];
+    int threads;
+    uint32_t bytes_per_cluster;
+    uint64_t *visited;      /* Set atomically for every directory queued */
+    pthread_mutex_t lock;   /* Guards the waits below */
+    pthread_cond_t work;    /* A task was pushed or the walk ended */
+    pthread_cond_t filled;  /* The node the emitter waits for was read */
+    WalkNode *waiting;
+    long pending;           /* Tasks queued or being read */
+    int idle;               /* Workers waiting for a task */
+    int failed;
+} WalkState;
+
+typedef struct {
+    WalkState *state;
+    int index;
+} WalkWorker;
+
+/* Growable path of the entry being emitted */
+typedef struct {
+    char *buffer;
+    size_t length;
+    size_t capacity;
+} WalkPath;
+
+/* Mark the walk as failed; it still runs to the end */
+static void walk_fail(WalkState *state) {
+    __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+}
+
+/* Append a task at the tail of a deque */
+static int deque_push(WalkDeque *deque, WalkNode *node) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head >= deque->capacity / 2 && deque->head > 0) {
+            memmove(deque->tasks, deque->tasks + deque->head,
+                    (deque->tail - deque->head) * sizeof(WalkNode *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            uint32_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            WalkNode **grown = realloc(deque->tasks,
+                                       capacity * sizeof(WalkNode *));
+            if (!grown) {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->tasks = grown;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->tail++] = node;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/* Take a task from the tail (owner) or the head (thief) of a deque */
+static WalkNode *deque_take(WalkDeque *deque, int steal) {
+    WalkNode *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        node = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+        if (deque->head == deque->tail) {
+            deque->head = deque->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+/* Steal a task from any other worker, starting with the next one */
+static WalkNode *steal_task(WalkState *state, int index) {
+    for (int i = 1; i <= state->threads; i++) {
+        WalkNode *node = deque_take(&state->deques[(index + i) % state->threads], 1);
+        if (node) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/* Queue a directory on a worker's deque and wake an idle worker */
+static int push_task(WalkState *state, int index, WalkNode *node) {
+    __atomic_add_fetch(&state->pending, 1, __ATOMIC_SEQ_CST);
+    if (deque_push(&state->deques[index], node) < 0) {
+        __atomic_sub_fetch(&state->pending, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    /* A worker going idle counts itself before it looks at the deques,
+     * so either it sees this task or this sees it */
+    if (__atomic_load_n(&state->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&state->lock);
+        pthread_cond_signal(&state->work);
+        pthread_mutex_unlock(&state->lock);
+    }
+    return 0;
+}
+
+/* Sleep until some deque has a task; NULL once the walk is over */
+static WalkNode *wait_task(WalkState *state, int index) {
+    WalkNode *node;
+    pthread_mutex_lock(&state->lock);
+    __atomic_add_fetch(&state->idle, 1, __ATOMIC_SEQ_CST);
+    while (!(node = steal_task(state, index)) &&
+           __atomic_load_n(&state->pending, __ATOMIC_SEQ_CST) > 0) {
+        pthread_cond_wait(&state->work, &state->lock);
+    }
+    __atomic_sub_fetch(&state->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&state->lock);
+    return node;
+}
+
+/* Claim a directory for the walk; 0 if it was already queued */
+static int claim(WalkState *state, uint32_t cluster) {
+    uint64_t bit = 1ULL << (cluster % 64);
+    return !(__atomic_fetch_or(&state->visited[cluster / 64], bit,
+                               __ATOMIC_RELAXED) & bit);
+}
+
+/* Allocated bytes of a chain, stopping at the first invalid link */
+static uint64_t chain_bytes(WalkState *state, uint32_t cluster) {
+    FileSystem *fs = state->fs;
+    uint32_t count = 0;
+    while (is_valid_cluster(fs, cluster) && count < fs->total_clusters) {
+        count++;
+        cluster = get_fat_entry(fs, cluster);
+    }
+    return (uint64_t)count * state->bytes_per_cluster;
+}
+
+/* Add an entry to the node being read, queueing subdirectories */
+static void add_record(WalkState *state, int index, WalkNode *node,
+                       const DirEntry *entry, const char *name) {
+    if (node->count == node->capacity) {
+        uint32_t capacity = node->capacity ? node->capacity * 2 : 16;
+        WalkRecord *grown = realloc(node->records, capacity * sizeof(WalkRecord));
+        if (!grown) {
+            walk_fail(state);
+            return;
+        }
+        node->records = grown;
+        node->capacity = capacity;
+    }
+    uint32_t length = strlen(name) + 1;
+    if (node->names_used + length > node->names_capacity) {
+        uint32_t capacity = node->names_capacity ? node->names_capacity * 2 : 256;
+        while (capacity < node->names_used + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(node->names, capacity);
+        if (!grown) {
+            walk_fail(state);
+            return;
+        }
+        node->names = grown;
+        node->names_capacity = capacity;
+    }
+
+    WalkRecord *record = &node->records[node->count++];
+    record->name = node->names_used;
+    memcpy(node->names + node->names_used, name, length);
+    node->names_used += length;
+    record->entry = *entry;
+    record->bytes = 0;
+    record->child = NULL;
+
+    uint32_t first = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    if (!(entry->DIR_Attr & ATTR_DIRECTORY)) {
+        record->bytes = chain_bytes(state, first);
+        return;
+    }
+
+    /* A directory reached twice (cross-linked or looped) is walked once */
+    if (!is_valid_cluster(state->fs, first) || !claim(state, first)) {
+        return;
+    }
+    WalkNode *child = calloc(1, sizeof(WalkNode));
+    if (!child) {
+        walk_fail(state);
+        return;
+    }
+    child->cluster = first;
+    if (push_task(state, index, child) < 0) {
+        free(child);
+        walk_fail(state);
+        return;
+    }
+    record->child = child;
+}
+
+/* Read a directory straight from the device into its node */
+static void read_dir(WalkState *state, int index, WalkNode *node,
+                     uint8_t *buffer) {
+    FileSystem *fs = state->fs;
+    uint32_t per_cluster = state->bytes_per_cluster / DIR_ENTRY_SIZE;
+    uint32_t cluster = node->cluster;
+    char name[MAX_NAME_LENGTH];
+    LfnAssembler lfn;
+    lfn_reset(&lfn);
+
+    for (uint32_t c = 0; c < fs->total_clusters && is_valid_cluster(fs, cluster); c++) {
+        node->bytes += state->bytes_per_cluster;
+        if (bdev_read(fs->dev, get_first_sector_of_cluster(fs, cluster),
+                      fs->boot_sector.BPB_SecPerClus, buffer) < 0) {
+            walk_fail(state);
+            return;
+        }
+
+        DirEntry *entries = (DirEntry *)buffer;
+        for (uint32_t i = 0; i < per_cluster; i++) {
+            DirEntry *entry = &entries[i];
+            uint32_t slot = c * per_cluster + i;
+            if (entry->DIR_Name[0] == 0x00) {
+                return;
+            }
+            if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Attr == ATTR_LONG_NAME) {
+                lfn_feed(&lfn, entry, slot);
+                continue;
+            }
+
+            uint32_t first_slot;
+            if (!lfn_finish(&lfn, entry, slot, name, sizeof(name),
+                            &first_slot)) {
+                parse_filename((char *)entry->DIR_Name, name);
+            }
+            if (entry->DIR_Name[0] == '.' ||
+                (entry->DIR_Attr & (ATTR_VOLUME_ID | ATTR_DIRECTORY)) ==
+                ATTR_VOLUME_ID) {
+                continue;
+            }
+            add_record(state, index, node, entry, name);
+        }
+        cluster = get_fat_entry(fs, cluster);
+    }
+}
+
+/* Worker: read directories from its own deque, stealing when it runs
+ * dry, until no task is queued or being read anywhere */
+static void *walk_worker(void *arg) {
+    WalkWorker *worker = arg;
+    WalkState *state = worker->state;
+    uint8_t *buffer = malloc(state->bytes_per_cluster);
+    if (!buffer) {
+        walk_fail(state);
+    }
+
+    for (;;) {
+        WalkNode *node = deque_take(&state->deques[worker->index], 0);
+        if (!node) {
+            node = steal_task(state, worker->index);
+        }
+        if (!node) {
+            node = wait_task(state, worker->index);
+        }
+        if (!node) {
+            break;
+        }
+
+        if (buffer) {
+            read_dir(state, worker->index, node, buffer);
+        }
+        pthread_mutex_lock(&state->lock);
+        node->done = 1;
+        if (state->waiting == node) {
+            pthread_cond_signal(&state->filled);
+        }
+        pthread_mutex_unlock(&state->lock);
+
+        if (__atomic_sub_fetch(&state->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&state->lock);
+            pthread_cond_broadcast(&state->work);
+            pthread_mutex_unlock(&state->lock);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/* Block until a worker has read the node */
+static void wait_node(WalkState *state, WalkNode *node) {
+    pthread_mutex_lock(&state->lock);
+    state->waiting = node;
+    while (!node->done) {
+        pthread_cond_wait(&state->filled, &state->lock);
+    }
+    state->waiting = NULL;
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Wait for and free a node and its subtree without visiting them */
+static void discard_node(WalkState *state, WalkNode *node) {
+    wait_node(state, node);
+    for (uint32_t i = 0; i < node->count; i++) {
+        if (node->records[i].child) {
+            discard_node(state, node->records[i].child);
+        }
+    }
+    free(node->records);
+    free(node->names);
+    free(node);
+}
+
+/* Append a name to the path, adding a separator if needed */
+static int path_append(WalkPath *path, const char *name) {
+    size_t length = strlen(name);
+    if (path->length + length + 2 > path->capacity) {
+        size_t capacity = path->capacity * 2;
+        while (capacity < path->length + length + 2) {
+            capacity *= 2;
+        }
+        char *grown = realloc(path->buffer, capacity);
+        if (!grown) {
+            return -1;
+        }
+        path->buffer = grown;
+        path->capacity = capacity;
+    }
+    if (path->length > 0 && path->buffer[path->length - 1] != '/') {
+        path->buffer[path->length++] = '/';
+    }
+    memcpy(path->buffer + path->length, name, length + 1);
+    path->length += length;
+    return 0;
+}
+
+/* Visit the entries of a node in directory order, each subtree as soon
+ * as its workers are done with it, and free the node. *total receives
+ * the bytes allocated to the directory and everything below it. */
+static void emit_node(WalkState *state, WalkNode *node, WalkPath *path,
+                      uint32_t depth, WalkVisitor visitor, void *context,
+                      uint64_t *total) {
+    wait_node(state, node);
+    *total = node->bytes;
+
+    size_t length = path->length;
+    for (uint32_t i = 0; i < node->count; i++) {
+        WalkRecord *record = &node->records[i];
+        const char *name = node->names + record->name;
+        if (__atomic_load_n(&state->failed, __ATOMIC_RELAXED) ||
+            path_append(path, name) < 0) {
+            walk_fail(state);
+            if (record->child) {
+                discard_node(state, record->child);
+            }
+            continue;
+        }
+
+        WalkItem item;
+        item.path = path->buffer;
+        item.name = name;
+        item.entry = &record->entry;
+        item.depth = depth + 1;
+        item.last = (i + 1 == node->count);
+        item.bytes = record->bytes;
+        visitor(context, &item, 0);
+
+        if (record->entry.DIR_Attr & ATTR_DIRECTORY) {
+            if (record->child) {
+                emit_node(state, record->child, path, depth + 1, visitor,
+                          context, &item.bytes);
+            }
+            item.path = path->buffer;   /* May have moved */
+            visitor(context, &item, 1);
+        }
+        *total += item.bytes;
+        path->length = length;
+        path->buffer[length] = '\0';
+    }
+
+    free(node->records);
+    free(node->names);
+    free(node);
+}
+
+/* Walk the tree below the directory at cluster, whose absolute path is
+ * path. Directories are read by a pool of threads, each with its own
+ * deque of directories and stealing from the others when it runs dry,
+ * while the calling thread hands the entries to the visitor in the
+ * order a serial depth-first walk would, as soon as they are read.
+ * threads <= 0 uses one per online CPU. */
+int walk_tree(FileSystem *fs, uint32_t cluster, const char *path, int threads,
+              WalkVisitor visitor, void *context) {
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > WALK_MAX_THREADS) {
+        threads = WALK_MAX_THREADS;
+    }
+
+    /* The workers bypass the cache, so the image must be current */
+    if (fs_flush(fs) < 0) {
+        return -1;
+    }
+
+    WalkState *state = calloc(1, sizeof(WalkState));
+    WalkNode *root = calloc(1, sizeof(WalkNode));
+    WalkPath walk_path = { NULL, 0, strlen(path) + 64 };
+    walk_path.buffer = malloc(walk_path.capacity);
+    if (state) {
+        state->visited = calloc((fs->total_clusters + 2 + 63) / 64,
+                                sizeof(uint64_t));
+    }
+    if (!state || !state->visited || !root || !walk_path.buffer) {
+        if (state) {
+            free(state->visited);
+        }
+        free(state);
+        free(root);
+        free(walk_path.buffer);
+        return -1;
+    }
+    strcpy(walk_path.buffer, path);
+    walk_path.length = strlen(path);
+
+    state->fs = fs;
+    state->threads = threads;
+    state->bytes_per_cluster = fs->boot_sector.BPB_BytsPerSec *
+                               fs->boot_sector.BPB_SecPerClus;
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->work, NULL);
+    pthread_cond_init(&state->filled, NULL);
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&state->deques[i].lock, NULL);
+    }
+
+    root->cluster = cluster;
+    claim(state, cluster);
+    push_task(state, 0, root);
+
+    pthread_t ids[WALK_MAX_THREADS];
+    WalkWorker workers[WALK_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        workers[i].state = state;
+        workers[i].index = i;
+        if (pthread_create(&ids[i], NULL, walk_worker, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        walk_worker(&workers[0]);
+    }
+
+    const char *name = strrchr(path, '/');
+    WalkItem item;
+    item.path = walk_path.buffer;
+    item.name = (name && name[1]) ? name + 1 : path;
+    item.entry = NULL;
+    item.depth = 0;
+    item.last = 1;
+    item.bytes = 0;
+    visitor(context, &item, 0);
+    emit_node(state, root, &walk_path, 0, visitor, context, &item.bytes);
+    item.path = walk_path.buffer;
+    visitor(context, &item, 1);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+
+    int result = state->failed ? -1 : 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&state->deques[i].lock);
+        free(state->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&state->lock);
+    pthread_cond_destroy(&state->work);
+    pthread_cond_destroy(&state->filled);
+    free(state->visited);
+    free(state);
+    free(walk_path.buffer);
+    return result;
+}
+
+/* Match a name against a shell wildcard pattern, ignoring case */
+int walk_match(const char *pattern, const char *name) {
+    return fnmatch(pattern, name, FNM_CASEFOLD) == 0;
+}
@@ -102,18 +102,945 @@ echo ""
 ./bin/filesys test.img < test_commands.txt
 
 EXIT_CODE=$?
+FAILED=0
+
+# Run test_commands.txt against an image (default test.img), mounted
+# with any further arguments as options, keeping the output in
+# test_output.txt and showing it
+run_commands() {
+    local image=${1:-test.img}
+    shift
+    ./bin/filesys "$@" "$image" < test_commands.txt > test_output.txt 2>&1
+    local status=$?
+    cat test_output.txt
+    echo ""
+    if [ $status -ne 0 ]; then
+        echo "✗ filesys exited with code $status"
+        FAILED=1
+    fi
+}
+
+# Check that the last output contains a string
+expect() {
+    if grep -qF -- "$1" test_output.txt; then
+        echo "✓ $2"
+    else
+        echo "✗ $2 (missing: $1)"
+        FAILED=1
+    fi
+}
+
+# Check that the last output does not contain a string
+expect_not() {
+    if grep -qF -- "$1" test_output.txt; then
+        echo "✗ $2 (unexpected: $1)"
+        FAILED=1
+    else
+        echo "✓ $2"
+    fi
+}
 
 echo ""
-echo "================================"
-if [ $EXIT_CODE -eq 0 ]; then
-    echo "✓ All tests completed successfully!"
+echo "Long file names"
+echo "==============="
+echo ""
+
+cat > test_commands.txt << 'EOF'
+mkdir "Project Files"
+cd "Project Files"
+creat "Meeting Notes 2025.txt"
+open "Meeting Notes 2025.txt" -w
+write "Meeting Notes 2025.txt" "agenda"
+close "Meeting Notes 2025.txt"
+creat café.txt
+creat 日本語のファイル名.txt
+creat "bad*name"
+exit
+EOF
+run_commands
+expect "Error: Invalid name" "Names with forbidden characters are rejected"
+
+# A second run reads the names back from the image
+cat > test_commands.txt << 'EOF'
+ls "project files"
+cd PROJEC~1
+open "MEETING NOTES 2025.TXT" -r
+read "meeting notes 2025.txt" 6
+close "meeting notes 2025.txt"
+rm "Meeting Notes 2025.txt"
+rm café.txt
+rm 日本語のファイル名.txt
+cd ..
+rmdir "Project Files"
+exit
+EOF
+run_commands
+expect "Meeting Notes 2025.txt" "Long name with spaces kept"
+expect "café.txt" "Two-byte UTF-8 name kept"
+expect "日本語のファイル名.txt" "Three-byte UTF-8 name kept"
+expect "[test.img]/PROJEC~1/>" "Short alias resolves to the long-named directory"
+expect "agenda" "Lookup by long name ignores case"
+expect_not "Error" "Long-named entries removed"
+
+echo ""
+echo "Directory compaction"
+echo "===================="
+echo ""
+
+# Enough entries to span several directory clusters, most then deleted
+{
+    echo "mkdir many"
+    echo "cd many"
+    for i in $(seq 1 40); do
+        echo "creat file$i"
+    done
+    echo "open file40 -w"
+    echo "write file40 \"still here\""
+    echo "close file40"
+    for i in $(seq 1 36); do
+        echo "rm file$i"
+    done
+    echo "compact"
+    echo "ls"
+    echo "open file40 -r"
+    echo "read file40 10"
+    echo "close file40"
+    echo "exit"
+} > test_commands.txt
+run_commands
+expect "36 slots reclaimed" "compact reclaims the deleted slots"
+expect_not ", 0 clusters freed" "compact frees the emptied directory clusters"
+expect "FILE37" "Remaining entries kept"
+expect "still here" "File contents unchanged by compaction"
+
+{
+    echo "cd many"
+    echo "compact"
+    for i in $(seq 37 40); do
+        echo "rm file$i"
+    done
+    echo "cd .."
+    echo "rmdir many"
+    echo "exit"
+} > test_commands.txt
+run_commands
+expect "0 slots reclaimed, 0 clusters freed" "A compacted directory has nothing left to reclaim"
+expect_not "Error" "Compacted directory cleaned up"
+
+echo ""
+echo "Defragmentation"
+echo "==============="
+echo ""
+
+# Alternate appends to two files so their clusters interleave
+PART1=$(printf '%600s' | tr ' ' A)
+PART2=$(printf '%600s' | tr ' ' B)
+PART3=$(printf '%600s' | tr ' ' a)
+PART4=$(printf '%600s' | tr ' ' b)
+cat > test_commands.txt << EOF
+mkdir frag
+cd frag
+creat one.txt
+creat two.txt
+open one.txt -w
+open two.txt -w
+write one.txt "$PART1"
+write two.txt "$PART2"
+write one.txt "$PART3"
+write two.txt "$PART4"
+close one.txt
+close two.txt
+defrag -a
+defrag
+exit
+EOF
+run_commands
+expect "2 fragmented" "defrag -a finds the interleaved files"
+expect "After:  " "defrag reports the result"
+expect_not "Error" "defrag completes"
+
+cat > test_commands.txt << EOF
+defrag -a
+cd frag
+open one.txt -r
+read one.txt 1200
+close one.txt
+open two.txt -r
+read two.txt 1200
+close two.txt
+rm one.txt
+rm two.txt
+cd ..
+rmdir frag
+exit
+EOF
+run_commands
+expect "files, 0 fragmented" "No fragmented files left"
+expect "$PART1$PART3" "First file unchanged by defrag"
+expect "$PART2$PART4" "Second file unchanged by defrag"
+expect_not "Error" "Defragmented files cleaned up"
+
+echo ""
+echo "Importing host files"
+echo "===================="
+echo ""
+
+# A text file spanning many clusters
+seq 1 3000 | sed 's/^/line /' > test_host.txt
+HOST_SIZE=$(wc -c < test_host.txt)
+cat > test_commands.txt << EOF
+put test_host.txt imported.txt
+put test_host.txt imported.txt
+put test_missing.txt other.txt
+open imported.txt -r
+read imported.txt $HOST_SIZE
+close imported.txt
+rm imported.txt
+exit
+EOF
+run_commands
+expect "line 1500" "put imports the middle of the file"
+expect "line 3000" "put imports the end of the file"
+expect "Error: Directory/file already exists" "put refuses to overwrite"
+expect "Error: Cannot open host file" "put reports a missing host file"
+
+echo ""
+echo "Exporting files"
+echo "==============="
+echo ""
+
+# Random bytes, not a whole number of clusters
+head -c 100001 /dev/urandom > test_host.bin
+seq 1 3000 | sed 's/^/line /' > test_host.txt
+rm -f test_get.bin
+cat > test_commands.txt << 'EOF'
+put test_host.bin binary.bin
+get binary.bin test_get.bin
+mkdir exports
+get exports test_dir.bin
+rmdir exports
+put test_host.txt text.txt
+open text.txt -r
+lseek text.txt 7
+read text.txt 6 -b
+close text.txt
+rm binary.bin
+rm text.txt
+exit
+EOF
+run_commands
+if cmp -s test_host.bin test_get.bin; then
+    echo "✓ get returns the bytes put stored"
+else
+    echo "✗ get returns the bytes put stored"
+    FAILED=1
+fi
+expect "Error: Cannot read a directory" "get refuses a directory"
+expect ">line 2" "read -b copies raw bytes from the file position"
+
+echo ""
+echo "Truncate and fallocate"
+echo "======================"
+echo ""
+
+cat > test_commands.txt << 'EOF'
+creat sized.txt
+open sized.txt -w
+write sized.txt "hello world"
+close sized.txt
+truncate sized.txt 5
+get sized.txt test_get.bin
+exit
+EOF
+run_commands
+if [ "$(cat test_get.bin)" = "hello" ]; then
+    echo "✓ truncate shrinks the file"
+else
+    echo "✗ truncate shrinks the file"
+    FAILED=1
+fi
+
+cat > test_commands.txt << 'EOF'
+truncate sized.txt 8
+fallocate sized.txt 20000
+get sized.txt test_get.bin
+mkdir sizes
+truncate sizes 10
+fallocate missing.txt 10
+rmdir sizes
+rm sized.txt
+exit
+EOF
+run_commands
+if printf 'hello\0\0\0' | cmp -s - test_get.bin; then
+    echo "✓ truncate grows the file with zeros and fallocate keeps the size"
+else
+    echo "✗ truncate grows the file with zeros and fallocate keeps the size"
+    FAILED=1
+fi
+expect "Error: Cannot resize a directory" "Directories cannot be resized"
+expect "Error: File does not exist" "fallocate reports a missing file"
+
+echo ""
+echo "Consistency check"
+echo "================="
+echo ""
+
+# Little-endian integer of $3 bytes at offset $2 of image $1
+read_le() {
+    local value=0 shift=0 byte
+    for byte in $(od -An -tu1 -j "$2" -N "$3" "$1"); do
+        value=$((value | byte << shift))
+        shift=$((shift + 8))
+    done
+    echo $value
+}
+
+# Set FAT entry $2 of image $1 to $3 in every FAT copy
+set_fat() {
+    local bps=$(read_le "$1" 11 2) rsvd=$(read_le "$1" 14 2)
+    local fats=$(read_le "$1" 16 1) fatsz=$(read_le "$1" 36 4)
+    local bytes=$(printf '\\%03o\\%03o\\%03o\\%03o' $(($3 & 255)) \
+                  $(($3 >> 8 & 255)) $(($3 >> 16 & 255)) $(($3 >> 24 & 255)))
+    for ((f = 0; f < fats; f++)); do
+        printf "$bytes" | dd of="$1" bs=1 conv=notrunc 2>/dev/null \
+            seek=$(((rsvd + f * fatsz) * bps + $2 * 4))
+    done
+}
+
+# First cluster of the entry with 11-byte short name $2 in the first
+# cluster of the root directory of image $1
+root_cluster_of() {
+    local bps=$(read_le "$1" 11 2) spc=$(read_le "$1" 13 1)
+    local rsvd=$(read_le "$1" 14 2) fats=$(read_le "$1" 16 1)
+    local fatsz=$(read_le "$1" 36 4) root=$(read_le "$1" 44 4)
+    local base=$(((rsvd + fats * fatsz + (root - 2) * spc) * bps))
+    for ((i = 0; i < bps * spc / 32; i++)); do
+        local entry=$((base + i * 32))
+        local name=$(dd if="$1" bs=1 skip=$entry count=11 2>/dev/null | tr -d '\0')
+        if [ "$name" = "$2" ]; then
+            echo $(($(read_le "$1" $((entry + 20)) 2) << 16 |
+                    $(read_le "$1" $((entry + 26)) 2)))
+            return
+        fi
+    done
+    echo 0
+}
+
+# Work on a copy so test.img stays sound
+cp test.img fsck.img
+cat > test_commands.txt << 'EOF'
+put test_host.txt chain.txt
+creat linked.txt
+open linked.txt -w
+write linked.txt "x"
+close linked.txt
+mkdir keep
+cd keep
+creat inner.txt
+open inner.txt -w
+write inner.txt "inner data"
+close inner.txt
+exit
+EOF
+run_commands fsck.img
+
+# Cut chain.txt after its first cluster and point linked.txt into keep
+CHAIN=$(root_cluster_of fsck.img "CHAIN   TXT")
+LINKED=$(root_cluster_of fsck.img "LINKED  TXT")
+KEEP=$(root_cluster_of fsck.img "KEEP       ")
+set_fat fsck.img "$CHAIN" $((0x0FFFFFFF))
+set_fat fsck.img "$LINKED" "$KEEP"
+
+cat > test_commands.txt << 'EOF'
+fsck -j 1
+exit
+EOF
+run_commands fsck.img
+sed 's/with [0-9]* threads//' test_output.txt > test_single.txt
+expect "/LINKED.TXT: cross-linked at cluster $KEEP" "fsck finds the cross-link"
+expect "/CHAIN.TXT: size $HOST_SIZE exceeds its 1 clusters" "fsck finds the short chain"
+expect "lost clusters in 1 chains" "fsck finds the clusters cut off"
+
+cat > test_commands.txt << 'EOF'
+fsck -j 8
+exit
+EOF
+run_commands fsck.img
+if sed 's/with [0-9]* threads//' test_output.txt | cmp -s - test_single.txt; then
+    echo "✓ fsck reports the same problems whatever the thread count"
 else
+    echo "✗ fsck reports the same problems whatever the thread count"
+    FAILED=1
+fi
+
+rm -f test_get.bin
+cat > test_commands.txt << 'EOF'
+fsck -r
+fsck
+open keep/inner.txt -r
+read keep/inner.txt 10
+close keep/inner.txt
+get FOUND.000 test_get.bin
+exit
+EOF
+run_commands fsck.img
+expect "3 problems repaired" "fsck -r repairs every problem"
+expect "1 lost chains saved as /FOUND.nnn" "fsck -r saves the lost chain"
+expect ": 0 problems" "Nothing left after the repair"
+expect "inner data" "The directory the file ran into keeps its contents"
+CLUSTER_SIZE=$(($(read_le fsck.img 11 2) * $(read_le fsck.img 13 1)))
+if tail -c +$((CLUSTER_SIZE + 1)) test_host.txt |
+       cmp -s - <(head -c $((HOST_SIZE - CLUSTER_SIZE)) test_get.bin); then
+    echo "✓ The saved chain holds the bytes cut off the file"
+else
+    echo "✗ The saved chain holds the bytes cut off the file"
+    FAILED=1
+fi
+rm -f fsck.img test_single.txt
+
+echo ""
+echo "du, tree and find"
+echo "================="
+echo ""
+
+cat > test_commands.txt << 'EOF'
+mkdir "Walk Root"
+cd "walk root"
+mkdir "Sub Dir"
+mkdir docs
+creat readme.txt
+cd "sub dir"
+creat "Field Notes.txt"
+open "Field Notes.txt" -w
+write "Field Notes.txt" "notes"
+close "Field Notes.txt"
+du ..
+tree "/WALK ROOT"
+cd ..
+find "*.txt"
+find "*notes*" "/walk root/sub dir"
+find "*" missing
+exit
+EOF
+run_commands
+TAB=$(printf '\t')
+expect "$((2 * CLUSTER_SIZE))$TAB/Walk Root/Sub Dir" "du sums a subdirectory"
+expect "$((CLUSTER_SIZE))$TAB/Walk Root/DOCS" "du counts an empty directory's own cluster"
+expect "$((4 * CLUSTER_SIZE))$TAB/Walk Root" "du sums the whole tree"
+expect "|-- Sub Dir" "tree lists a long-named subdirectory"
+expect "|   \`-- Field Notes.txt" "tree indents the entries of a subdirectory"
+expect "2 directories, 2 files" "tree counts directories and files"
+expect "/Walk Root/Sub Dir/Field Notes.txt" "find prints paths by long name"
+expect "/Walk Root/README.TXT" "find matches a short name ignoring case"
+expect "Error: Directory does not exist" "find reports a missing directory"
+
+cat > test_commands.txt << 'EOF'
+rm "/Walk Root/Sub Dir/Field Notes.txt"
+rm "/Walk Root/readme.txt"
+rmdir "/Walk Root/Sub Dir"
+rmdir "/Walk Root/docs"
+rmdir "/Walk Root"
+exit
+EOF
+run_commands
+expect_not "Error" "Walk test files removed"
+
+echo ""
+echo "Parallel readers"
+echo "================"
+echo ""
+
+# A tree wide enough for the walkers' threads to read directories at once
+{
+    echo "mkdir par"
+    echo "cd par"
+    for d in $(seq 1 16); do
+        echo "mkdir dir$d"
+        echo "cd dir$d"
+        for f in $(seq 1 8); do
+            echo "creat f$f.txt"
+        done
+        echo "cd .."
+    done
+    echo "exit"
+} > test_commands.txt
+run_commands > /dev/null
+
+cat > test_commands.txt << 'EOF'
+tree par
+find f8.txt par
+fsck -j 8
+exit
+EOF
+run_commands
+cp test_output.txt test_first.txt
+expect "16 directories, 128 files" "tree sees every entry of a wide tree"
+if [ "$(grep -c "/PAR/DIR[0-9]*/F8.TXT$" test_output.txt)" -eq 16 ]; then
+    echo "✓ find matches once in every directory"
+else
+    echo "✗ find matches once in every directory"
+    FAILED=1
+fi
+expect ": 0 problems" "fsck with 8 threads finds no problems"
+
+run_commands > /dev/null
+if cmp -s test_first.txt test_output.txt; then
+    echo "✓ Parallel walks give the same output every run"
+else
+    echo "✗ Parallel walks give the same output every run"
+    FAILED=1
+fi
+
+{
+    for d in $(seq 1 16); do
+        for f in $(seq 1 8); do
+            echo "rm par/dir$d/f$f.txt"
+        done
+        echo "rmdir par/dir$d"
+    done
+    echo "rmdir par"
+    echo "exit"
+} > test_commands.txt
+run_commands > /dev/null
+expect_not "Error" "Parallel test tree removed"
+
+echo ""
+echo "Server mode"
+echo "==========="
+echo ""
+
+rm -f test.sock
+./bin/filesys --serve test.sock --workers 4 test.img > test_server.txt 2>&1 &
+SERVER=$!
+for i in $(seq 1 50); do
+    [ -S test.sock ] && break
+    sleep 0.1
+done
+
+# Clients each work in a directory of their own at the same time
+CLIENTS=""
+for c in 1 2 3 4; do
+    {
+        echo "mkdir client$c"
+        echo "cd client$c"
+        for f in $(seq 1 10); do
+            echo "creat f$f"
+        done
+        echo "open f10 -w"
+        echo "write f10 \"from client $c\""
+        echo "close f10"
+        echo "open f10 -r"
+        echo "read f10 13"
+        echo "close f10"
+        echo "exit"
+    } > test_commands$c.txt
+    ./bin/filesys --connect test.sock < test_commands$c.txt \
+        > test_client$c.txt 2>&1 &
+    CLIENTS="$CLIENTS $!"
+done
+wait $CLIENTS
+
+cat > test_commands.txt << 'EOF'
+ls client3
+open client2/f10 -r
+read client2/f10 13
+close client2/f10
+exit
+EOF
+./bin/filesys --connect test.sock < test_commands.txt > test_output.txt 2>&1
+cat test_output.txt
+echo ""
+for c in 1 2 3 4; do
+    if grep -qF "from client $c" test_client$c.txt &&
+       ! grep -q "Error" test_client$c.txt; then
+        echo "✓ Client $c reads back its own write"
+    else
+        echo "✗ Client $c reads back its own write"
+        FAILED=1
+    fi
+done
+expect "F9" "A client lists another client's files"
+expect "from client 2" "A client reads another client's file"
+expect "[test.img]//>" "Each client starts at the root"
+
+kill -TERM $SERVER
+if wait $SERVER; then
+    echo "✓ Server stops cleanly on SIGTERM"
+else
+    echo "✗ Server stops cleanly on SIGTERM"
+    FAILED=1
+fi
+
+# The server's changes are on the image
+{
+    for c in 1 2 3 4; do
+        for f in $(seq 1 10); do
+            echo "rm client$c/f$f"
+        done
+        echo "rmdir client$c"
+    done
+    echo "exit"
+} > test_commands.txt
+run_commands > /dev/null
+expect_not "Error" "Files written through the server are on the image"
+rm -f test.sock test_server.txt test_commands[1-4].txt test_client[1-4].txt
+
+echo ""
+echo "Library API"
+echo "==========="
+echo ""
+
+cat > test_lib.c << 'EOF'
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "libfat32.h"
+
+static Fat32 *volume;
+
+/* Each thread works on a session of its own in a directory of its own */
+static void *worker(void *arg) {
+    long n = (long)arg;
+    char path[32], buffer[32] = "";
+    Fat32 *fs;
+    if (fat32_session_open(volume, &fs) != FAT32_OK) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "lib%ld", n);
+    fat32_mkdir(fs, path);
+    fat32_chdir(fs, path);
+    int fd = fat32_open(fs, "data.txt", FAT32_O_RDWR | FAT32_O_CREAT);
+    int len = snprintf(buffer, sizeof(buffer), "session %ld", n);
+    fat32_pwrite(fs, fd, buffer, len, 0);
+    memset(buffer, 0, sizeof(buffer));
+    fat32_pread(fs, fd, buffer, sizeof(buffer) - 1, 0);
+    fat32_close(fs, fd);
+    printf("thread %ld read: %s\n", n, buffer);
+    fat32_session_close(fs);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || fat32_mount(argv[1], NULL, &volume) != FAT32_OK) {
+        return 1;
+    }
+    pthread_t threads[4];
+    for (long i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    Fat32Stat st;
+    if (fat32_stat(volume, "/lib2/data.txt", &st) == FAT32_OK) {
+        printf("size: %u\n", st.size);
+    }
+    printf("missing: %s\n",
+           fat32_strerror(fat32_open(volume, "/nope.txt", FAT32_O_RDONLY)));
+    printf("mkdir again: %s\n", fat32_strerror(fat32_mkdir(volume, "lib0")));
+    fat32_unmount(volume);
+    return 0;
+}
+EOF
+if ${CC:-cc} -Iinclude -o test_lib test_lib.c lib/libfat32.a -pthread; then
+    ./test_lib test.img > test_output.txt 2>&1
+    cat test_output.txt
+    echo ""
+    expect "thread 0 read: session 0" "Session 0 reads back its write"
+    expect "thread 3 read: session 3" "Session 3 reads back its write"
+    expect "size: 9" "fat32_stat reports the size written by another session"
+    expect "missing: No such file or directory" "A missing file gives an error code"
+    expect "mkdir again: File exists" "An existing name gives an error code"
+else
+    echo "✗ Program linked against lib/libfat32.a builds"
+    FAILED=1
+fi
+
+# The shell sees what the library wrote
+{
+    echo "open lib1/data.txt -r"
+    echo "read lib1/data.txt 9"
+    echo "close lib1/data.txt"
+    for n in 0 1 2 3; do
+        echo "rm lib$n/data.txt"
+        echo "rmdir lib$n"
+    done
+    echo "exit"
+} > test_commands.txt
+run_commands
+expect "session 1" "The shell reads a file written through the library"
+expect_not "Error" "Library test files removed"
+rm -f test_lib test_lib.c
+
+echo ""
+echo "Removal Races"
+echo "============="
+echo ""
+
+# One session keeps creating and removing a directory while another
+# creates, writes and removes files in it
+cat > test_race.c << 'EOF'
+#include <stdio.h>
+#include <pthread.h>
+#include "libfat32.h"
+
+static Fat32 *volume;
+static int created;
+
+static void *remover(void *arg) {
+    Fat32 *fs;
+    if (fat32_session_open(volume, &fs) != FAT32_OK) {
+        return NULL;
+    }
+    for (int i = 0; i < 2000; i++) {
+        fat32_mkdir(fs, "/race");
+        fat32_rmdir(fs, "/race");
+    }
+    fat32_session_close(fs);
+    return arg;
+}
+
+static void *creator(void *arg) {
+    char path[32];
+    Fat32 *fs;
+    if (fat32_session_open(volume, &fs) != FAT32_OK) {
+        return NULL;
+    }
+    for (int i = 0; i < 2000; i++) {
+        snprintf(path, sizeof(path), "/race/f%d", i);
+        int fd = fat32_open(fs, path, FAT32_O_RDWR | FAT32_O_CREAT);
+        if (fd >= 0) {
+            fat32_pwrite(fs, fd, "x", 1, 0);
+            fat32_close(fs, fd);
+            fat32_unlink(fs, path);
+            created++;
+        }
+    }
+    fat32_session_close(fs);
+    return arg;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || fat32_mount(argv[1], NULL, &volume) != FAT32_OK) {
+        return 1;
+    }
+    pthread_t a, b;
+    pthread_create(&a, NULL, remover, NULL);
+    pthread_create(&b, NULL, creator, NULL);
+    pthread_join(a, NULL);
+    pthread_join(b, NULL);
+    fat32_rmdir(volume, "/race");
+    printf("race done, %d files created\n", created);
+    fat32_unmount(volume);
+    return 0;
+}
+EOF
+if ${CC:-cc} -Iinclude -o test_race test_race.c lib/libfat32.a -pthread; then
+    ./test_race test.img > test_output.txt 2>&1
+    cat test_output.txt
+    expect "race done" "Sessions racing mkdir, rmdir, open and unlink finish"
+    printf 'fsck\nls\nexit\n' > test_commands.txt
+    run_commands
+    expect ": 0 problems" "No clusters are lost or cross-linked by the race"
+    expect_not "race" "The raced directory is removed"
+else
+    echo "✗ Race program linked against lib/libfat32.a builds"
+    FAILED=1
+fi
+rm -f test_race test_race.c
+
+echo ""
+echo "Mount Options"
+echo "============="
+echo ""
+
+# Append to a file, sync, read it all back and check the image, three
+# times in one session mounted with the given options
+option_rounds() {
+    local name=$1
+    shift
+    {
+        echo "creat opt.txt"
+        echo "open opt.txt -rw"
+        for round in 1 2 3; do
+            echo "write opt.txt \"round $round under $name;\""
+            echo "sync"
+            echo "lseek opt.txt 0"
+            echo "read opt.txt 200"
+            echo "fsck"
+        done
+        echo "close opt.txt"
+        echo "stats"
+        echo "exit"
+    } > test_commands.txt
+    run_commands test.img "$@"
+    expect "round 1 under $name;round 2 under $name;round 3 under $name;" \
+           "Rounds written under $name read back"
+    if [ "$(grep -c ": 0 problems" test_output.txt)" -eq 3 ]; then
+        echo "✓ fsck finds no problems after each round under $name"
+    else
+        echo "✗ fsck finds no problems after each round under $name"
+        FAILED=1
+    fi
+}
+
+# Read the rounds back on a default mount and remove the file
+option_on_image() {
+    printf 'open opt.txt -r\nread opt.txt 200\nclose opt.txt\nrm opt.txt\nexit\n' \
+        > test_commands.txt
+    run_commands
+    expect "round 3 under $1;" "Rounds written under $1 are on the image"
+}
+
+option_rounds mmap --mmap
+expect "cache capacity (sectors): 0" "The mapping is used without the buffer cache"
+option_on_image mmap
+
+option_rounds cache --cache 64
+expect "cache capacity (sectors): 64" "stats reports the cache size given"
+if grep -qE "^cache hits: [1-9]" test_output.txt &&
+   grep -qE "^cache misses: [1-9]" test_output.txt; then
+    echo "✓ stats counts cache hits and misses"
+else
+    echo "✗ stats counts cache hits and misses"
+    FAILED=1
+fi
+option_on_image cache
+
+option_rounds io_uring --io-uring
+option_on_image io_uring
+
+# Files written a cluster at a time in turn have one extent per cluster,
+# so reading one back submits a batch of several requests to the ring
+{
+    echo "creat frag_a.txt"
+    echo "creat frag_b.txt"
+    echo "open frag_a.txt -rw"
+    echo "open frag_b.txt -rw"
+    for letter in c d e f; do
+        echo "write frag_a.txt \"$(head -c "$CLUSTER_SIZE" /dev/zero | tr '\0' "$letter")\""
+        echo "write frag_b.txt \"$(head -c "$CLUSTER_SIZE" /dev/zero | tr '\0' x)\""
+    done
+    echo "lseek frag_a.txt 0"
+    echo "read frag_a.txt $((CLUSTER_SIZE * 4))"
+    echo "close frag_a.txt"
+    echo "close frag_b.txt"
+    echo "rm frag_a.txt"
+    echo "rm frag_b.txt"
+    echo "exit"
+} > test_commands.txt
+run_commands test.img --io-uring > /dev/null
+EXTENTS=""
+for letter in c d e f; do
+    EXTENTS="$EXTENTS$(head -c "$CLUSTER_SIZE" /dev/zero | tr '\0' "$letter")"
+done
+expect "$EXTENTS" "A file of several extents reads back in order through io_uring"
+
+option_rounds write_back --write-back
+expect "write mode: write-back" "stats reports write-back mode"
+option_on_image write_back
+
+# Without sync or close, exit still writes the buffered data back
+printf 'creat wb.txt\nopen wb.txt -rw\nwrite wb.txt "kept without sync"\nstats\nexit\n' \
+    > test_commands.txt
+run_commands test.img --write-back
+if grep -qE "^dirty sectors: [1-9]" test_output.txt; then
+    echo "✓ Writes stay buffered until exit"
+else
+    echo "✗ Writes stay buffered until exit"
+    FAILED=1
+fi
+printf 'open wb.txt -r\nread wb.txt 17\nclose wb.txt\nrm wb.txt\nexit\n' \
+    > test_commands.txt
+run_commands
+expect "kept without sync" "A write-back session left without sync is on the image"
+
+option_rounds auto_compact --auto-compact 25
+option_on_image auto_compact
+
+# Deletes past the threshold compact the directory as they go, leaving
+# little for an explicit compact to reclaim
+{
+    echo "mkdir auto"
+    echo "cd auto"
+    for i in $(seq 1 40); do
+        echo "creat file$i"
+    done
+    for i in $(seq 1 36); do
+        echo "rm file$i"
+    done
+    echo "compact"
+    echo "ls"
+    echo "fsck"
+    for i in $(seq 37 40); do
+        echo "rm file$i"
+    done
+    echo "cd .."
+    echo "rmdir auto"
+    echo "exit"
+} > test_commands.txt
+run_commands test.img --auto-compact 25
+expect_not "36 slots reclaimed" "Deletes compact the directory under --auto-compact"
+expect "FILE37" "Entries kept by automatic compaction"
+expect ": 0 problems" "fsck finds no problems after automatic compaction"
+
+echo ""
+echo "Multi-Component Paths"
+echo "====================="
+echo ""
+
+# Paths through several directories, relative to another directory, then
+# a rename that must invalidate the cached components of the old path
+cat > test_commands.txt << 'EOF'
+mkdir a
+mkdir a/b
+creat /a/b/f
+mkdir other
+cd other
+open ../a/b/f -rw
+write ../a/b/f "deep"
+close ../a/b/f
+cd /
+mv a c
+open /a/b/f -r
+ls a/b
+cd other
+open ../c/b/f -r
+read ../c/b/f 4
+close ../c/b/f
+cd /
+rm c/b/f
+rmdir c/b
+rmdir c
+rmdir other
+exit
+EOF
+run_commands
+expect "deep" "A file opened through ../a/b reads back under its moved path"
+if [ "$(grep -c "Error" test_output.txt)" -eq 2 ] &&
+   grep -qF "Error: File does not exist" test_output.txt; then
+    echo "✓ The old path fails after the directory is moved"
+else
+    echo "✗ The old path fails after the directory is moved"
+    FAILED=1
+fi
+
+echo ""
+echo "================================"
+if [ $EXIT_CODE -ne 0 ]; then
     echo "✗ Tests failed with exit code: $EXIT_CODE"
+elif [ $FAILED -ne 0 ]; then
+    echo "✗ Some checks failed"
+else
+    echo "✓ All tests completed successfully!"
 fi
 echo "================================"
 
 # Cleanup
-rm -f test_commands.txt
+rm -f test_commands.txt test_output.txt test_host.txt test_host.bin test_get.bin \
+      test_first.txt
 
 echo ""
 echo "To verify the image integrity, you can:"